@@ -0,0 +1,77 @@
+/* Named blobs: files loaded once and streamed to peers with sendfile */
+/* a small table, scanned linearly: blobs are few and requested in bulk */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "blob.h"
+
+static blob_t* blobs;
+static int nblobs;
+
+int blob_load_dir(const char* dir) {
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		perror_die("blobs: opendir");
+	}
+	int cap = 0;
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL) {
+		int fd = openat(dirfd(d), ent->d_name, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			perror_die("blobs: open");
+		}
+		size_t len = strlen(ent->d_name);
+		if (!S_ISREG(st.st_mode) || len > BLOB_NAME_MAX) {
+			close(fd);
+			continue;
+		}
+
+		blob_t b = { .fd = fd, .size = st.st_size, .hash = BLOB_HASH_INIT, .name_len = len };
+		for (size_t i = 0; i < len; i++) {
+			b.hash = blob_hash_step(b.hash, ent->d_name[i]);
+		}
+		if (blob_find(b.hash, len) != NULL) {
+			die("blobs: the name %s collides with another; rename it", ent->d_name);
+		}
+		if (b.size > 0) {
+			b.map = mmap(NULL, b.size, PROT_READ, MAP_SHARED, fd, 0);
+			if (b.map == MAP_FAILED) {
+				perror_die("blobs: mmap");
+			}
+		}
+		if (nblobs == cap) {
+			cap = cap ? 2 * cap : 16;
+			blobs = realloc(blobs, cap * sizeof *blobs);
+			if (blobs == NULL) {
+				die("OOM");
+			}
+		}
+		blobs[nblobs++] = b;
+	}
+	closedir(d);
+	return nblobs;
+}
+
+int blob_count(void) {
+	return nblobs;
+}
+
+const blob_t* blob_find(uint32_t hash, size_t name_len) {
+	for (int i = 0; i < nblobs; i++) {
+		if (blobs[i].hash == hash && blobs[i].name_len == name_len) {
+			return &blobs[i];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,49 @@
+/* header file for named blobs streamed by the event servers */
+
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Text framing extension: outside a frame, '%name$' asks for the blob
+ * called name. The reply is the blob's size as a varint (see framing.h)
+ * followed by its bytes, in order with the replies to the frames around
+ * it; an unknown name gets a size of 0. Servers started without blobs
+ * ignore '%' as any other byte between frames.
+ */
+#define BLOB_REQUEST '%'
+
+/* longest blob name */
+#define BLOB_NAME_MAX 254
+
+/* Names are matched by length and FNV-1a hash, so a request needs no
+ * buffer for its name
+ */
+#define BLOB_HASH_INIT 2166136261u
+
+static inline uint32_t blob_hash_step(uint32_t h, uint8_t c) {
+	return (h ^ c) * 16777619u;
+}
+
+/* a file loaded at startup, shared by all threads and never freed */
+typedef struct {
+	int fd;			/* for sendfile */
+	const uint8_t* map;	/* the whole file, for peers without a socket */
+	uint64_t size;
+	uint32_t hash;
+	uint8_t name_len;
+} blob_t;
+
+/* Opens and maps every regular file in dir as a blob named after it.
+ * Returns the number loaded; dies in case of errors.
+ */
+int blob_load_dir(const char* dir);
+
+/* Number of blobs loaded */
+int blob_count(void);
+
+/* The blob whose name has this hash and length, or NULL */
+const blob_t* blob_find(uint32_t hash, size_t name_len);
+
+#endif /* BLOB_H */
@@ -0,0 +1,209 @@
+/* Traffic capture to an append-only trace file, and its sequential reader */
+/* shared mapping grown with fallocate and mremap, sliding read window */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "capture.h"
+
+/* the trace file is extended (and the mapping grown) this much at a time */
+#define CAPTURE_GROW (64 << 20)
+
+/* bytes of the trace the reader keeps mapped */
+#define TRACE_WINDOW (64 << 20)
+
+struct capture {
+	pthread_mutex_t lock;
+	int fd;
+	uint8_t* map;
+	size_t cap;		/* file size and length of the mapping */
+	uint64_t end;
+	int64_t t0;
+	bool failed;		/* out of space: the trace ends here */
+};
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t rec_size(size_t len) {
+	return (sizeof(trace_rec_t) + len + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+}
+
+capture_t* capture_create(const char* path) {
+	capture_t* c = calloc(1, sizeof *c);
+	if (c == NULL) {
+		die("OOM");
+	}
+	/* a predecessor still capturing to path keeps writing its own inode:
+	 * truncating that under its mapping would kill it with SIGBUS
+	 */
+	unlink(path);
+	c->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		perror_die("capture: open");
+	}
+	/* allocated up front, so stores into the mapping cannot hit a full disk */
+	int err = posix_fallocate(c->fd, 0, CAPTURE_GROW);
+	if (err != 0) {
+		errno = err;
+		perror_die("capture: fallocate");
+	}
+	c->cap = CAPTURE_GROW;
+	c->map = mmap(NULL, c->cap, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->map == MAP_FAILED) {
+		perror_die("capture: mmap");
+	}
+	pthread_mutex_init(&c->lock, NULL);
+
+	trace_header_t* h = (trace_header_t*)c->map;
+	memcpy(h->magic, TRACE_MAGIC, sizeof h->magic);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	c->end = sizeof *h;
+	h->end = c->end;
+	c->t0 = now_ns();
+	return c;
+}
+
+static bool capture_grow(capture_t* c, size_t need) {
+	size_t cap = c->cap;
+	while (cap < need) {
+		cap += CAPTURE_GROW;
+	}
+	int err = posix_fallocate(c->fd, c->cap, cap - c->cap);
+	if (err != 0) {
+		fprintf(stderr, "capture: fallocate: %s; capture stopped\n", strerror(err));
+		return false;
+	}
+	void* map = mremap(c->map, c->cap, cap, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+		perror("capture: mremap; capture stopped");
+		return false;
+	}
+	c->map = map;
+	c->cap = cap;
+	return true;
+}
+
+void capture_record(capture_t* c, int kind, uint32_t conn, const void* data, size_t len) {
+	size_t size = rec_size(len);
+	pthread_mutex_lock(&c->lock);
+	if (c->failed || (c->end + size > c->cap && !capture_grow(c, c->end + size))) {
+		c->failed = true;
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	/* stamped under the lock, so records are in time order */
+	trace_rec_t* rec = (trace_rec_t*)(c->map + c->end);
+	rec->t_ns = now_ns() - c->t0;
+	rec->conn = conn;
+	rec->info = (uint32_t)kind << 30 | (uint32_t)len;
+	if (len > 0) {
+		memcpy(rec + 1, data, len);
+	}
+	c->end += size;
+	__atomic_store_n(&((trace_header_t*)c->map)->end, c->end, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&c->lock);
+}
+
+struct trace_reader {
+	int fd;
+	uint64_t end;
+	uint64_t off;		/* of the next record */
+	uint8_t* win;
+	uint64_t win_off;	/* file offset of win, page aligned */
+	size_t win_len;
+};
+
+trace_reader_t* trace_open(const char* path) {
+	trace_reader_t* r = calloc(1, sizeof *r);
+	if (r == NULL) {
+		die("OOM");
+	}
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (r->fd < 0) {
+		perror_die("trace: open");
+	}
+	trace_header_t h;
+	if (pread(r->fd, &h, sizeof h, 0) != sizeof h || memcmp(h.magic, TRACE_MAGIC, sizeof h.magic) != 0) {
+		die("%s: not a trace file", path);
+	}
+	struct stat st;
+	if (fstat(r->fd, &st) < 0) {
+		perror_die("trace: fstat");
+	}
+	/* a capture still running, or killed, has preallocated space after end */
+	r->end = h.end < (uint64_t)st.st_size ? h.end : (uint64_t)st.st_size;
+	r->off = sizeof h;
+	r->win = MAP_FAILED;
+	return r;
+}
+
+/* Makes [off, off + len) readable through the window */
+static bool trace_map(trace_reader_t* r, uint64_t off, size_t len) {
+	if (r->win != MAP_FAILED && off >= r->win_off && off + len <= r->win_off + r->win_len) {
+		return true;
+	}
+	if (off + len > r->end) {
+		return false;
+	}
+	if (r->win != MAP_FAILED) {
+		munmap(r->win, r->win_len);
+	}
+	r->win_off = off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t want = off - r->win_off + len;
+	r->win_len = want > TRACE_WINDOW ? want : TRACE_WINDOW;
+	if (r->win_len > r->end - r->win_off) {
+		r->win_len = r->end - r->win_off;
+	}
+	r->win = mmap(NULL, r->win_len, PROT_READ, MAP_SHARED, r->fd, r->win_off);
+	if (r->win == MAP_FAILED) {
+		perror_die("trace: mmap");
+	}
+	madvise(r->win, r->win_len, MADV_SEQUENTIAL);
+	return true;
+}
+
+const trace_rec_t* trace_next(trace_reader_t* r, const uint8_t** data) {
+	if (!trace_map(r, r->off, sizeof(trace_rec_t))) {
+		return NULL;
+	}
+	const trace_rec_t* rec = (const trace_rec_t*)(r->win + (r->off - r->win_off));
+	size_t len = TRACE_LEN(rec->info);
+	if (!trace_map(r, r->off, sizeof *rec + len)) {
+		/* cut short by a capture that was killed mid-record */
+		return NULL;
+	}
+	rec = (const trace_rec_t*)(r->win + (r->off - r->win_off));
+	*data = (const uint8_t*)(rec + 1);
+	r->off += rec_size(len);
+	return rec;
+}
+
+uint64_t trace_size(trace_reader_t* r) {
+	return r->end;
+}
+
+void trace_close(trace_reader_t* r) {
+	if (r->win != MAP_FAILED) {
+		munmap(r->win, r->win_len);
+	}
+	close(r->fd);
+	free(r);
+}
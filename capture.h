@@ -0,0 +1,66 @@
+/* header file for capturing and replaying inbound traffic */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Trace file layout: a trace_header_t, then records, each a trace_rec_t
+ * followed by its data and padded to TRACE_ALIGN bytes. Records are only
+ * appended, in time order, so a trace is read front to back through a
+ * sliding mmap window and never has to fit in memory.
+ */
+#define TRACE_MAGIC "EVTRACE1"
+#define TRACE_ALIGN 8
+
+/* record kinds */
+enum { TRACE_OPEN = 1, TRACE_DATA = 2, TRACE_CLOSE = 3 };
+
+typedef struct {
+	char magic[8];
+	uint64_t end;		/* bytes of complete records, header included */
+	uint64_t start_ns;	/* CLOCK_REALTIME when the capture started */
+	uint64_t reserved;
+} trace_header_t;
+
+typedef struct {
+	uint64_t t_ns;		/* since the capture started */
+	uint32_t conn;		/* the server's fd; reused after TRACE_CLOSE */
+	uint32_t info;		/* kind in the top 2 bits, data length below */
+} trace_rec_t;
+
+#define TRACE_KIND(info) ((info) >> 30)
+#define TRACE_LEN(info) ((info) & 0x3fffffffu)
+
+/* Appends records to a trace file mapped MAP_SHARED; the header's end is
+ * advanced after each record, so a server killed mid-capture leaves a
+ * readable trace. Thread safe.
+ */
+typedef struct capture capture_t;
+
+/* Creates the trace file at path, replacing any file there. Dies in case
+ * of errors.
+ */
+capture_t* capture_create(const char* path);
+
+/* Appends one record; data is len bytes for TRACE_DATA, else NULL */
+void capture_record(capture_t* c, int kind, uint32_t conn, const void* data, size_t len);
+
+/* Reads a trace front to back */
+typedef struct trace_reader trace_reader_t;
+
+/* Opens the trace at path. Dies in case of errors. */
+trace_reader_t* trace_open(const char* path);
+
+/* Returns the next record, with *data pointing at its payload, or NULL at
+ * the end of the trace. Both stay valid until the next call.
+ */
+const trace_rec_t* trace_next(trace_reader_t* r, const uint8_t** data);
+
+/* Size of the trace in bytes */
+uint64_t trace_size(trace_reader_t* r);
+
+void trace_close(trace_reader_t* r);
+
+#endif /* CAPTURE_H */
@@ -1,32 +1,105 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <time.h>
 
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "sockutils.h"
+#include "shmring.h"
+#include "connector.h"
+#include "framing.h"
+#include "blob.h"
 
 #define MAXDATASIZE 1024 /* max number of bytes we can get at once */
+#define UDP_RECV_TIMEOUT 5 /* seconds to wait for a datagram reply */
+#define CONNECT_TIMEOUT_MS 5000 /* default time a TCP connect may take */
+#define MAX_CONNECTING 256 /* default TCP connects in flight at once */
+#define BLOB_RECV_SIZE (64 * 1024) /* bytes taken by one recv in blob mode */
+#define UDP_LOSS_TIMEOUT_MS 200 /* UDP pipelined mode: replies not back by then are lost */
+#define UDP_MAX_DEPTH 1024 /* UDP pipelined mode: datagrams per sendmmsg, at most */
 
 /* Structure for arguments to pass to client_thread() */
 typedef struct _thread_data_t {
 	int id, sockfd;
 	char *host, *port;
+	char *shm_path;		/* same-host shm transport instead of TCP */
+	shm_chan_t *shm;
+	int udp;		/* one datagram per message, no connection ack */
+	int depth;		/* pipelined mode: max frames in flight, 0 = off */
+	long n_frames;		/* pipelined mode: frames per connection */
+	int frame_len;		/* pipelined mode: payload bytes per frame */
+	int binary;		/* pipelined mode: varint-framed binary frames */
+	char *blob;		/* blob mode: the name to request, NULL = off */
+	long blob_bytes;	/* blob mode results */
+	long frames_done;	/* pipelined mode results */
+	long frames_lost;	/* UDP pipelined mode: replies that never came */
+	double rtt_sum;		/* sum of per-frame round trips, seconds */
 	char *msg[3];
 	char buf[MAXDATASIZE];
 } thread_data_t;
 
+ssize_t conn_send(thread_data_t *data, const void *buf, size_t len) {
+/* send over whichever transport the client connected with */
+	if (data->shm) {
+		return shm_chan_send_all(data->shm, buf, len, SHM_SPIN_NS);
+	}
+	if (data->udp) {
+		return send(data->sockfd, buf, len, 0);
+	}
+	return send_all(data->sockfd, buf, len);
+}
+
+ssize_t conn_recv(thread_data_t *data, void *buf, size_t len) {
+	if (data->shm) {
+		return shm_chan_recv_wait(data->shm, buf, len, SHM_SPIN_NS);
+	}
+	return recv(data->sockfd, buf, len, 0);
+}
+
+/* Non-blocking variants: -1 with errno EAGAIN when nothing moves */
+ssize_t conn_send_some(thread_data_t *data, const void *buf, size_t len) {
+	if (data->shm) {
+		return shm_chan_send(data->shm, buf, len);
+	}
+	return send(data->sockfd, buf, len, MSG_DONTWAIT);
+}
+
+ssize_t conn_recv_some(thread_data_t *data, void *buf, size_t len) {
+	if (data->shm) {
+		return shm_chan_recv(data->shm, buf, len);
+	}
+	return recv(data->sockfd, buf, len, MSG_DONTWAIT);
+}
+
+void conn_wait(thread_data_t *data, bool want_write) {
+/* block until a reply can be read or, with want_write, more sent */
+	if (data->shm) {
+		shm_chan_wait(data->shm, want_write, SHM_SPIN_NS);
+		return;
+	}
+	struct pollfd pfd = { .fd = data->sockfd, .events = POLLIN | (want_write ? POLLOUT : 0) };
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		perror_die("client: poll");
+}
+
 void *client_send(void *arg) {
 /* Sending operation thread */
 	thread_data_t *data = (thread_data_t *)arg;
 	for (int i=0; i<3; i++) {
 		printf("conn%d sending %s\n", data->id, data->msg[i]);
-		if (send(data->sockfd, data->msg[i],
-				strlen(data->msg[i]), 0) < 1)
+		if (conn_send(data, data->msg[i],
+				strlen(data->msg[i])) < 1)
 			perror_die("client: send");
 		sleep(2);
 	}
@@ -40,8 +113,13 @@ void *client_recv(void *arg) {
 	char end[] = "0000";
 	while (k != 4) {			/* end sequence check */
 		/* receive data */
-		if ((numbytes = recv(data->sockfd,
-				data->buf, MAXDATASIZE-1, 0)) == -1) {
+		if ((numbytes = conn_recv(data,
+				data->buf, MAXDATASIZE-1)) == -1) {
+			if (data->udp && errno == EAGAIN) {
+				/* datagrams are not retransmitted */
+				printf("conn%d reply lost, giving up\n", data->id);
+				break;
+			}
 			perror_die("client: recv");
 		}
 		/* print the data received */
@@ -67,21 +145,308 @@ void *client_recv(void *arg) {
 	pthread_exit(NULL);
 }
 
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void client_pipeline(thread_data_t *data) {
+/* Keep up to depth '^payload$' frames in flight. Replies carry no
+ * delimiters but are exactly as long as their payload, so they are
+ * matched back to frames in order by counting bytes. Binary frames are a
+ * varint length and the payload, and so are their replies. Sending and
+ * reading are interleaved: the server stops reading while its replies go
+ * unread, so blocking on a large batch would deadlock both sides.
+ */
+	int len = data->frame_len, depth = data->depth;
+	unsigned int seed = data->id + 1;
+	char *payload = xmalloc(len);
+	for (int i=0; i<len; i++)
+		payload[i] = 'a' + rand_r(&seed) % 25;
+
+	/* every request and every reply is the same bytes */
+	uint8_t hdr[VARINT_MAX_LEN];
+	int hlen = data->binary ? varint_put(hdr, len) : 0;
+	int flen = data->binary ? hlen + len : len + 2;
+	int rlen = hlen + len;
+	char *frame = xmalloc(flen), *reply = xmalloc(rlen);
+	if (data->binary) {
+		memcpy(frame, hdr, hlen);
+		memcpy(frame + hlen, payload, len);
+	} else {
+		frame[0] = '^';
+		memcpy(frame + 1, payload, len);
+		frame[len + 1] = '$';
+	}
+	memcpy(reply, hdr, hlen);
+	for (int i=0; i<len; i++)
+		reply[hlen + i] = payload[i] + 1;
+
+	/* up to depth frames go out back to back, as one send if they fit */
+	char *batch = xmalloc((size_t)depth * flen);
+	size_t batch_len = 0, batch_off = 0;
+	double *sent_at = xmalloc(depth * sizeof(double));
+	char buf[MAXDATASIZE];
+	long sent = 0, done = 0;
+	int got = 0;		/* reply bytes of frame 'done' seen so far */
+
+	while (done < data->n_frames) {
+		double now;
+		if (batch_off == batch_len) {
+			int k = 0;
+			now = now_sec();
+			while (sent < data->n_frames && sent - done < depth) {
+				memcpy(&batch[(size_t)k++ * flen], frame, flen);
+				sent_at[sent++ % depth] = now;
+			}
+			batch_len = (size_t)k * flen;
+			batch_off = 0;
+		}
+		bool moved = false;
+		if (batch_off < batch_len) {
+			ssize_t n = conn_send_some(data, batch + batch_off, batch_len - batch_off);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				perror_die("client: send");
+			if (n > 0) {
+				batch_off += n;
+				moved = true;
+			}
+		}
+
+		ssize_t numbytes = conn_recv_some(data, buf, sizeof buf);
+		if (numbytes < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror_die("client: recv");
+			if (!moved)
+				conn_wait(data, batch_off < batch_len);
+			continue;
+		}
+		if (numbytes == 0)
+			die("conn%d: server closed after %ld frames", data->id, done);
+		now = now_sec();
+		for (int i=0; i<numbytes; i++) {
+			if (buf[i] != reply[got])
+				die("conn%d: bad reply byte in frame %ld", data->id, done);
+			if (++got == rlen) {
+				data->rtt_sum += now - sent_at[done++ % depth];
+				got = 0;
+			}
+		}
+	}
+	data->frames_done = done;
+
+	free(payload);
+	free(frame);
+	free(reply);
+	free(batch);
+	free(sent_at);
+}
+
+void conn_recv_all(thread_data_t *data, void *buf, size_t len) {
+/* receive exactly len bytes, or die */
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = conn_recv(data, (char *)buf + got, len - got);
+		if (n < 0)
+			perror_die("client: recv");
+		if (n == 0)
+			die("conn%d: server closed mid-reply", data->id);
+		got += n;
+	}
+}
+
+void client_blobs(thread_data_t *data) {
+/* Ask for the blob n_frames times, each request followed by a text frame
+ * whose reply has to come right after the blob: the server keeps replies
+ * in request order around a blob it streams with sendfile.
+ */
+	char req[BLOB_NAME_MAX + 16];
+	int reqlen = snprintf(req, sizeof req, "%c%s$^ping$", BLOB_REQUEST, data->blob);
+	char *buf = xmalloc(BLOB_RECV_SIZE);
+	for (long i=0; i<data->n_frames; i++) {
+		if (conn_send(data, req, reqlen) < 0)
+			perror_die("client: send");
+
+		/* the blob's size as a varint, then its bytes */
+		uint8_t hdr[VARINT_MAX_LEN];
+		uint32_t size;
+		int hlen = 0;
+		do {
+			if (hlen == VARINT_MAX_LEN)
+				die("conn%d: bad blob size", data->id);
+			conn_recv_all(data, &hdr[hlen++], 1);
+		} while (varint_get(hdr, hlen, &size) == 0);
+		if (size == 0)
+			die("conn%d: the server has no blob named %s", data->id, data->blob);
+		for (uint32_t left = size; left > 0; ) {
+			ssize_t n = conn_recv(data, buf, left < BLOB_RECV_SIZE ? left : BLOB_RECV_SIZE);
+			if (n <= 0)
+				die("conn%d: blob cut short", data->id);
+			left -= n;
+		}
+
+		char pong[4];
+		conn_recv_all(data, pong, sizeof pong);
+		if (memcmp(pong, "qjoh", sizeof pong) != 0)
+			die("conn%d: reply out of order after blob %ld", data->id, i);
+		data->blob_bytes += size;
+		data->frames_done++;
+	}
+	free(buf);
+}
+
+void client_udp_pipeline(thread_data_t *data) {
+/* Keep up to depth datagrams in flight, one frame each, sent with one
+ * sendmmsg and their replies taken with recvmmsg. Replies come back in
+ * order, unless lost: when none arrives for UDP_LOSS_TIMEOUT_MS, all
+ * frames in flight are counted lost and sending resumes.
+ */
+	int len = data->frame_len, depth = data->depth;
+	unsigned int seed = data->id + 1;
+	char *payload = xmalloc(len);
+	for (int i=0; i<len; i++)
+		payload[i] = 'a' + rand_r(&seed) % 25;
+
+	/* binary datagrams are the hello and varint-framed frames */
+	uint8_t hdr[VARINT_MAX_LEN + 1];
+	int hlen = 0;
+	if (data->binary) {
+		hdr[0] = BINARY_HELLO;
+		hlen = 1 + varint_put(hdr + 1, len);
+	}
+	int flen = data->binary ? hlen + len : len + 2;
+	int rlen = hlen + len;
+	char *frame = xmalloc(flen), *reply = xmalloc(rlen);
+	if (data->binary) {
+		memcpy(frame, hdr, hlen);
+		memcpy(frame + hlen, payload, len);
+	} else {
+		frame[0] = '^';
+		memcpy(frame + 1, payload, len);
+		frame[len + 1] = '$';
+	}
+	memcpy(reply, hdr, hlen);
+	for (int i=0; i<len; i++)
+		reply[hlen + i] = payload[i] + 1;
+
+	struct timeval tv = { .tv_sec = 0, .tv_usec = UDP_LOSS_TIMEOUT_MS * 1000 };
+	if (setsockopt(data->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == -1)
+		perror_die("client: setsockopt SO_RCVTIMEO");
+
+	/* every datagram out is the same frame; each reply gets a buffer one
+	 * byte longer than expected, to catch oversized ones */
+	struct iovec siov = { .iov_base = frame, .iov_len = flen };
+	struct mmsghdr *smsgs = xmalloc(depth * sizeof *smsgs);
+	struct mmsghdr *rmsgs = xmalloc(depth * sizeof *rmsgs);
+	struct iovec *riov = xmalloc(depth * sizeof *riov);
+	char *rbufs = xmalloc((size_t)depth * (rlen + 1));
+	for (int i=0; i<depth; i++) {
+		memset(&smsgs[i], 0, sizeof smsgs[i]);
+		smsgs[i].msg_hdr.msg_iov = &siov;
+		smsgs[i].msg_hdr.msg_iovlen = 1;
+		riov[i].iov_base = &rbufs[(size_t)i * (rlen + 1)];
+		riov[i].iov_len = rlen + 1;
+		memset(&rmsgs[i], 0, sizeof rmsgs[i]);
+		rmsgs[i].msg_hdr.msg_iov = &riov[i];
+		rmsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	double *sent_at = xmalloc(depth * sizeof(double));
+	long sent = 0, done = 0, lost = 0;
+
+	while (done + lost < data->n_frames) {
+		int k = 0;
+		double now = now_sec();
+		while (sent < data->n_frames && sent - done - lost < depth) {
+			sent_at[sent++ % depth] = now;
+			k++;
+		}
+		for (int off = 0; off < k; ) {
+			int n = sendmmsg(data->sockfd, smsgs, k - off, 0);
+			if (n < 0)
+				perror_die("client: sendmmsg");
+			off += n;
+		}
+
+		int n = recvmmsg(data->sockfd, rmsgs, depth, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror_die("client: recvmmsg");
+			lost += sent - done - lost;
+			continue;
+		}
+		now = now_sec();
+		for (int i=0; i<n; i++) {
+			if (rmsgs[i].msg_len != (unsigned)rlen ||
+					memcmp(riov[i].iov_base, reply, rlen) != 0)
+				die("conn%d: bad reply to frame %ld", data->id, done + lost);
+			/* a reply arriving after its frame was given up on */
+			if (sent - done - lost == 0)
+				continue;
+			data->rtt_sum += now - sent_at[(done + lost) % depth];
+			done++;
+		}
+	}
+	data->frames_done = done;
+	data->frames_lost = lost;
+
+	free(payload);
+	free(frame);
+	free(reply);
+	free(smsgs);
+	free(rmsgs);
+	free(riov);
+	free(rbufs);
+	free(sent_at);
+}
+
 void *client_thread(void *arg) {
 /* Individual client thread operations function */
 	thread_data_t *data = (thread_data_t *)arg;
-	int sockfd = connect_inet(data->host, data->port); 
+	if (data->shm_path) {
+		data->shm = shm_chan_connect(data->shm_path);
+	} else if (data->udp) {
+		data->sockfd = connect_udp(data->host, data->port);
+		struct timeval tv = { .tv_sec = UDP_RECV_TIMEOUT, .tv_usec = 0 };
+		if (setsockopt(data->sockfd, SOL_SOCKET, SO_RCVTIMEO,
+				&tv, sizeof tv) == -1)
+			perror_die("client: setsockopt SO_RCVTIMEO");
+	}
+	/* TCP sockets were connected up front by connect_all */
 
 	int numbytes;  
 	char buf[MAXDATASIZE];
 	/* wait for server to send ack of connection */
-	do {
-		if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1)
+	while (!data->udp) {
+		if ((numbytes = conn_recv(data, buf, MAXDATASIZE-1)) == -1)
 			perror_die("client: recv");
-	} while (buf[0] != '*');
+		if (buf[0] == '*')
+			break;
+	}
+
+	/* ask for binary framing and wait for the server to agree; datagrams
+	 * opt in one by one */
+	if (data->binary && !data->udp) {
+		char hello = BINARY_HELLO;
+		if (conn_send(data, &hello, 1) < 1)
+			perror_die("client: send");
+		if ((numbytes = conn_recv(data, buf, 1)) != 1 || buf[0] != BINARY_HELLO)
+			die("conn%d: server did not agree to binary framing", data->id);
+	}
+
+	if (data->depth > 0) {
+		if (data->udp)
+			client_udp_pipeline(data);
+		else
+			client_pipeline(data);
+		goto done;
+	}
+	if (data->blob) {
+		client_blobs(data);
+		goto done;
+	}
 
 	pthread_t sender, receiver;
-	data->sockfd = sockfd;
 
 	/* sending thread */
 	int rc;
@@ -99,15 +464,60 @@ void *client_thread(void *arg) {
 	pthread_join(sender, NULL);
 	pthread_join(receiver, NULL);
 
-	close(sockfd);
+done:
+	if (data->shm) {
+		shm_chan_close(data->shm);
+	} else {
+		close(data->sockfd);
+	}
 	pthread_exit(NULL);
 };
 
+int connect_all(thread_data_t *t_data, int n, int max_connecting, int timeout_ms) {
+/* Open the TCP connections of all clients at once: non-blocking connects,
+ * at most max_connecting in flight, the server name resolved once.
+ * Failed clients get sockfd -1. Returns the number connected.
+ */
+	connector_t *c = connector_create(timeout_ms);
+	connect_result_t res[64];
+	int started = 0, connected = 0, finished = 0;
+	double start = now_sec();
+
+	while (finished < n) {
+		while (started < n && connector_pending(c) < max_connecting) {
+			thread_data_t *data = &t_data[started++];
+			int rv = connector_start(c, data->host, data->port, data);
+			if (rv != 0)
+				die("client: %s: %s", data->host, gai_strerror(rv));
+		}
+		int k = connector_poll(c, res, 64, -1);
+		for (int i=0; i<k; i++) {
+			thread_data_t *data = res[i].data;
+			data->sockfd = res[i].fd;
+			finished++;
+			if (res[i].fd < 0) {
+				fprintf(stderr, "conn%d: connect: %s\n",
+						data->id, strerror(res[i].err));
+				continue;
+			}
+			/* the client threads use blocking I/O */
+			int flags = fcntl(res[i].fd, F_GETFL, 0);
+			fcntl(res[i].fd, F_SETFL, flags & ~O_NONBLOCK);
+			connected++;
+		}
+	}
+	connector_destroy(c);
+	printf("Connected %d of %d clients in %.3fs\n", connected, n, now_sec() - start);
+	return connected;
+}
+
 int main(int argc, char *argv[])
 {
-	char *host="localhost", *port="9090";
-	int opt, n_clients=1;
-	while ((opt = getopt(argc, argv, "n:s:p:")) != -1) {
+	char *host="localhost", *port="9090", *shm_path=NULL, *blob=NULL;
+	int opt, n_clients=1, udp=0, depth=0, frame_len=16, binary=0;
+	int max_connecting=MAX_CONNECTING, connect_timeout=CONNECT_TIMEOUT_MS;
+	long n_frames=10000;
+	while ((opt = getopt(argc, argv, "n:s:p:u:dP:f:l:bF:c:t:")) != -1) {
 		switch (opt) {
 			case 'n':
 				n_clients = atoi(optarg);
@@ -118,31 +528,96 @@ int main(int argc, char *argv[])
 			case 'p':
 				port = strdup(optarg);
 				break;
+			case 'u':
+				shm_path = strdup(optarg);
+				break;
+			case 'd':
+				udp = 1;
+				break;
+			case 'P':
+				depth = atoi(optarg);
+				break;
+			case 'f':
+				n_frames = atol(optarg);
+				break;
+			case 'l':
+				frame_len = atoi(optarg);
+				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'F':
+				blob = strdup(optarg);
+				break;
+			case 'c':
+				max_connecting = atoi(optarg);
+				break;
+			case 't':
+				connect_timeout = atoi(optarg);
+				break;
 			case '?':
 				fprintf(stderr, "usage: clients "
 						"[-n number_of_clients] "
 						"[-s server] "
-						"[-p port_num]\n");
+						"[-p port_num] "
+						"[-u shm_socket_path] "
+						"[-d] "
+						"[-c max_connecting] "
+						"[-t connect_timeout_ms] "
+						"[-P pipeline_depth "
+						"[-f frames_per_client] "
+						"[-l frame_len] [-b]] "
+						"[-F blob_name [-f requests_per_client]]\n");
 				exit(EXIT_FAILURE);
 		}
 	}
+	if (depth > 0 && frame_len < 1)
+		die("pipelined mode needs frame_len >= 1");
+	if (depth > 0 && udp) {
+		/* one frame per datagram, which the server must take whole */
+		uint8_t hdr[VARINT_MAX_LEN];
+		int dgram_len = binary ? 1 + varint_put(hdr, frame_len) + frame_len : frame_len + 2;
+		if (depth > UDP_MAX_DEPTH || dgram_len > UDP_DGRAM_MAX)
+			die("UDP pipelined mode takes a depth of at most %d and datagrams "
+					"(frame and framing) of at most %d bytes",
+					UDP_MAX_DEPTH, UDP_DGRAM_MAX);
+	}
+	if (binary && depth == 0)
+		die("binary framing is a pipelined mode option (-P)");
+	if (blob && (udp || depth > 0 || strlen(blob) > BLOB_NAME_MAX))
+		die("blob mode needs a stream transport, no -P, and a name of at most %d bytes",
+				BLOB_NAME_MAX);
+	if (max_connecting < 1)
+		die("max_connecting must be at least 1");
 //	printf("clients=%d host=%s port=%s", n_clients, host, port);
 
 	pthread_t clients[n_clients];		/* client thread objects */
 
 	/* data for threads */
 	thread_data_t t_data[n_clients];
-	thread_data_t data = { 0, 0, host, port,
-		{"^abc$de^abte$f", "xyz^123", "25$^ab0000$abab"},
-		""
+	thread_data_t data = {
+		.host = host, .port = port,
+		.shm_path = shm_path, .udp = udp,
+		.depth = depth, .n_frames = n_frames, .frame_len = frame_len,
+		.binary = binary, .blob = blob,
+		.msg = {"^abc$de^abte$f", "xyz^123", "25$^ab0000$abab"},
 	};
 
+	for (int i=0; i<n_clients; i++) {
+		t_data[i] = data;
+		t_data[i].id = i;
+	}
+
 	time_t start = time(NULL);
+	double start_sec = now_sec();
+
+	if (!shm_path && !udp)
+		connect_all(t_data, n_clients, max_connecting, connect_timeout);
 
 	/* create threads */
 	for (int i=0; i<n_clients; i++) {
-		t_data[i] = data;
-		t_data[i].id = i;
+		if (t_data[i].sockfd < 0)
+			continue;
 		int rc;
 		if ((rc = pthread_create(&clients[i], NULL,
 					client_thread, &t_data[i]))) {
@@ -152,11 +627,42 @@ int main(int argc, char *argv[])
 
 	/* wait for all children to exit */
 	for (int i=0; i<n_clients; i++) {
-		pthread_join(clients[i], NULL);
+		if (t_data[i].sockfd >= 0)
+			pthread_join(clients[i], NULL);
 	}
 
 	double elapsed = difftime(time(NULL), start);
 	printf("Elapsed time: %fs\n", elapsed);
 
+	if (depth > 0) {
+		long frames = 0, lost = 0;
+		double rtt = 0;
+		for (int i=0; i<n_clients; i++) {
+			frames += t_data[i].frames_done;
+			lost += t_data[i].frames_lost;
+			rtt += t_data[i].rtt_sum;
+		}
+		double secs = now_sec() - start_sec;
+		printf("Pipelined: %ld frames of %d bytes, depth %d: "
+				"%.0f frames/s, mean rtt %.1fus%s%s\n",
+				frames, frame_len, depth, frames / secs,
+				frames ? rtt / frames * 1e6 : 0.0,
+				binary ? ", binary framing" : "",
+				udp ? ", UDP" : "");
+		if (udp)
+			printf("Lost: %ld datagrams (%.2f%%)\n", lost,
+					frames + lost ? 100.0 * lost / (frames + lost) : 0.0);
+	}
+	if (blob) {
+		long requests = 0, bytes = 0;
+		for (int i=0; i<n_clients; i++) {
+			requests += t_data[i].frames_done;
+			bytes += t_data[i].blob_bytes;
+		}
+		double secs = now_sec() - start_sec;
+		printf("Blobs: %ld requests for %s, %ld bytes: %.0f requests/s, %.1f MB/s\n",
+				requests, blob, bytes, requests / secs, bytes / secs / 1e6);
+	}
+
 	return EXIT_SUCCESS;
 }
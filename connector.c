@@ -0,0 +1,424 @@
+/* Bulk non-blocking TCP connects */
+/* cached name resolution, epoll completion, timeouts and happy eyeballs */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "connector.h"
+
+#define MAX_EVENTS 256
+
+static int64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ---- resolver cache ---- */
+
+typedef struct cache_entry {
+	struct cache_entry* next;
+	char* host;
+	char* port;
+	int64_t expires_ms;
+	addr_list_t addrs;
+} cache_entry_t;
+
+static cache_entry_t* cache;
+static int cache_ttl = RESOLVE_TTL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void resolve_set_ttl(int seconds) {
+	pthread_mutex_lock(&cache_lock);
+	cache_ttl = seconds;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int resolve(const char* host, const char* port, addr_list_t* out) {
+/* getaddrinfo, with the families interleaved for happy eyeballs */
+	struct addrinfo hints, *servinfo;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int rv = getaddrinfo(host, port, &hints, &servinfo);
+	if (rv != 0) {
+		return rv;
+	}
+
+	/* split by family, keeping getaddrinfo's order within each */
+	struct addrinfo* fam[2][RESOLVE_MAX_ADDRS];
+	int nfam[2] = {0, 0};
+	int first = -1;
+	for (struct addrinfo* p = servinfo; p != NULL; p = p->ai_next) {
+		int f = p->ai_family == AF_INET6;
+		if (first < 0) {
+			first = f;
+		}
+		if (nfam[f] < RESOLVE_MAX_ADDRS) {
+			fam[f][nfam[f]++] = p;
+		}
+	}
+	out->n = 0;
+	for (int i = 0; out->n < RESOLVE_MAX_ADDRS && i < RESOLVE_MAX_ADDRS; i++) {
+		for (int k = 0; k < 2 && out->n < RESOLVE_MAX_ADDRS; k++) {
+			int f = k == 0 ? first : !first;
+			if (i < nfam[f]) {
+				memcpy(&out->addr[out->n], fam[f][i]->ai_addr, fam[f][i]->ai_addrlen);
+				out->len[out->n++] = fam[f][i]->ai_addrlen;
+			}
+		}
+	}
+	freeaddrinfo(servinfo);
+	return out->n > 0 ? 0 : EAI_NONAME;
+}
+
+int resolve_cached(const char* host, const char* port, addr_list_t* out) {
+	int64_t now = now_ms();
+	pthread_mutex_lock(&cache_lock);
+	for (cache_entry_t* e = cache; e != NULL; e = e->next) {
+		if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0 &&
+				e->expires_ms > now) {
+			*out = e->addrs;
+			pthread_mutex_unlock(&cache_lock);
+			return 0;
+		}
+	}
+	int ttl = cache_ttl;
+	pthread_mutex_unlock(&cache_lock);
+
+	/* resolve unlocked: a slow lookup must not hold up cached names */
+	int rv = resolve(host, port, out);
+	if (rv != 0 || ttl == 0) {
+		return rv;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	cache_entry_t* e;
+	for (e = cache; e != NULL; e = e->next) {
+		if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0) {
+			break;
+		}
+	}
+	if (e == NULL) {
+		e = xmalloc(sizeof *e);
+		e->host = strdup(host);
+		e->port = strdup(port);
+		e->next = cache;
+		cache = e;
+	}
+	e->addrs = *out;
+	e->expires_ms = now + (int64_t)ttl * 1000;
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+/* ---- connector ---- */
+
+/* one connect; its attempts are sockets to successive addresses */
+typedef struct {
+	void* data;
+	addr_list_t addrs;
+	int next_addr;			/* next address to try */
+	int fds[RESOLVE_MAX_ADDRS];	/* attempts in flight, by address, or -1 */
+	int inflight;
+	int last_err;
+	uint32_t gen;			/* bumped when done: stale timers skip it */
+	bool busy;
+} request_t;
+
+typedef struct {
+	int req;
+	uint32_t gen;
+	int64_t due_ms;
+} conn_timer_t;
+
+/* Timers of one kind all have the same delay, so a FIFO is in due order */
+typedef struct {
+	conn_timer_t* q;
+	size_t head, tail, cap;	/* free running, cap a power of two */
+} timer_fifo_t;
+
+struct connector {
+	int epfd;
+	int timeout_ms;
+	request_t* reqs;
+	int nreqs, cap;
+	int* free_reqs;		/* stack of unused request slots */
+	int nfree;
+	int pending;		/* started, not yet reported */
+	timer_fifo_t fallback;	/* start the next address alongside */
+	timer_fifo_t deadline;	/* give up */
+	connect_result_t* done;	/* outcomes not yet reported */
+	int ndone, done_cap;
+};
+
+static void fifo_push(timer_fifo_t* f, int req, uint32_t gen, int64_t due_ms) {
+	if (f->tail - f->head == f->cap) {
+		size_t cap = f->cap ? 2 * f->cap : 64;
+		conn_timer_t* q = xmalloc(cap * sizeof *q);
+		for (size_t i = f->head; i != f->tail; i++) {
+			q[i & (cap - 1)] = f->q[i & (f->cap - 1)];
+		}
+		free(f->q);
+		f->q = q;
+		f->cap = cap;
+	}
+	f->q[f->tail++ & (f->cap - 1)] = (conn_timer_t){ req, gen, due_ms };
+}
+
+static conn_timer_t* fifo_head(timer_fifo_t* f) {
+	return f->head == f->tail ? NULL : &f->q[f->head & (f->cap - 1)];
+}
+
+connector_t* connector_create(int timeout_ms) {
+	connector_t* c = calloc(1, sizeof *c);
+	if (c == NULL) {
+		die("out of memory for the connector");
+	}
+	c->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (c->epfd < 0) {
+		perror_die("connector: epoll_create1");
+	}
+	c->timeout_ms = timeout_ms;
+	return c;
+}
+
+static void finish(connector_t* c, int idx, int fd, int err) {
+/* report the request done, closing every other attempt */
+	request_t* r = &c->reqs[idx];
+	for (int i = 0; i < RESOLVE_MAX_ADDRS; i++) {
+		if (r->fds[i] >= 0 && r->fds[i] != fd) {
+			close(r->fds[i]);
+		}
+		r->fds[i] = -1;
+	}
+	if (c->ndone == c->done_cap) {
+		c->done_cap = c->done_cap ? 2 * c->done_cap : 64;
+		c->done = realloc(c->done, c->done_cap * sizeof *c->done);
+		if (c->done == NULL) {
+			die("out of memory for connect results");
+		}
+	}
+	c->done[c->ndone++] = (connect_result_t){ fd, err, r->data };
+	r->busy = false;
+	r->gen++;
+	c->free_reqs[c->nfree++] = idx;
+}
+
+static void try_next(connector_t* c, int idx) {
+/* start an attempt on the next address that does not fail right away */
+	request_t* r = &c->reqs[idx];
+	while (r->next_addr < r->addrs.n) {
+		int a = r->next_addr++;
+		struct sockaddr* sa = (struct sockaddr*)&r->addrs.addr[a];
+		int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			r->last_err = errno;
+			continue;
+		}
+		if (connect(fd, sa, r->addrs.len[a]) == 0) {
+			finish(c, idx, fd, 0);
+			return;
+		}
+		if (errno != EINPROGRESS) {
+			r->last_err = errno;
+			close(fd);
+			continue;
+		}
+		struct epoll_event ev = {
+			.events = EPOLLOUT,
+			.data.u64 = (uint64_t)idx << 32 | a,
+		};
+		if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror_die("connector: epoll_ctl");
+		}
+		r->fds[a] = fd;
+		r->inflight++;
+		if (r->next_addr < r->addrs.n) {
+			fifo_push(&c->fallback, idx, r->gen, now_ms() + CONNECT_ATTEMPT_DELAY_MS);
+		}
+		return;
+	}
+	if (r->inflight == 0) {
+		finish(c, idx, -1, r->last_err ? r->last_err : ECONNREFUSED);
+	}
+}
+
+int connector_start(connector_t* c, const char* host, const char* port, void* data) {
+	if (c->nfree == 0) {
+		int cap = c->cap ? 2 * c->cap : 64;
+		c->reqs = realloc(c->reqs, cap * sizeof *c->reqs);
+		c->free_reqs = realloc(c->free_reqs, cap * sizeof *c->free_reqs);
+		if (c->reqs == NULL || c->free_reqs == NULL) {
+			die("out of memory for connects");
+		}
+		for (int i = cap - 1; i >= c->cap; i--) {
+			c->reqs[i].busy = false;
+			c->reqs[i].gen = 0;
+			c->free_reqs[c->nfree++] = i;
+		}
+		c->cap = cap;
+	}
+	int idx = c->free_reqs[c->nfree - 1];
+	request_t* r = &c->reqs[idx];
+	int rv = resolve_cached(host, port, &r->addrs);
+	if (rv != 0) {
+		return rv;
+	}
+	c->nfree--;
+	r->data = data;
+	r->next_addr = 0;
+	r->inflight = 0;
+	r->last_err = 0;
+	r->busy = true;
+	for (int i = 0; i < RESOLVE_MAX_ADDRS; i++) {
+		r->fds[i] = -1;
+	}
+	c->pending++;
+	fifo_push(&c->deadline, idx, r->gen, now_ms() + c->timeout_ms);
+	try_next(c, idx);
+	return 0;
+}
+
+static int64_t run_timers(connector_t* c) {
+/* fire what is due; returns ms until the next timer, -1 if none */
+	int64_t now = now_ms();
+	conn_timer_t* t;
+	while ((t = fifo_head(&c->deadline)) != NULL && t->due_ms <= now) {
+		request_t* r = &c->reqs[t->req];
+		if (r->busy && r->gen == t->gen) {
+			finish(c, t->req, -1, ETIMEDOUT);
+		}
+		c->deadline.head++;
+	}
+	while ((t = fifo_head(&c->fallback)) != NULL && t->due_ms <= now) {
+		int idx = t->req;
+		uint32_t gen = t->gen;
+		c->fallback.head++;
+		if (c->reqs[idx].busy && c->reqs[idx].gen == gen) {
+			try_next(c, idx);
+		}
+	}
+
+	int64_t next = -1;
+	timer_fifo_t* fifos[2] = { &c->deadline, &c->fallback };
+	for (int i = 0; i < 2; i++) {
+		if ((t = fifo_head(fifos[i])) != NULL && (next < 0 || t->due_ms - now < next)) {
+			next = t->due_ms - now;
+		}
+	}
+	return next;
+}
+
+static int take_done(connector_t* c, connect_result_t* results, int max) {
+	int n = c->ndone < max ? c->ndone : max;
+	memcpy(results, c->done, n * sizeof *results);
+	memmove(c->done, c->done + n, (c->ndone - n) * sizeof *c->done);
+	c->ndone -= n;
+	c->pending -= n;
+	return n;
+}
+
+int connector_poll(connector_t* c, connect_result_t* results, int max, int timeout_ms) {
+	int64_t deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+	struct epoll_event events[MAX_EVENTS];
+	bool waited = false;	/* a timeout of 0 still checks once */
+	while (1) {
+		int64_t next_timer = run_timers(c);
+		if (c->ndone > 0 || c->pending == 0) {
+			return take_done(c, results, max);
+		}
+
+		int64_t wait = next_timer;
+		if (deadline >= 0) {
+			int64_t left = deadline - now_ms();
+			if (left <= 0) {
+				if (waited) {
+					return 0;
+				}
+				left = 0;
+			}
+			if (wait < 0 || left < wait) {
+				wait = left;
+			}
+		}
+		int nready = epoll_wait(c->epfd, events, MAX_EVENTS, (int)wait);
+		if (nready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror_die("connector: epoll_wait");
+		}
+		waited = true;
+		for (int i = 0; i < nready; i++) {
+			int idx = events[i].data.u64 >> 32;
+			int a = events[i].data.u64 & 0xffffffff;
+			request_t* r = &c->reqs[idx];
+			if (!r->busy || r->fds[a] < 0) {
+				/* an attempt closed earlier in this batch */
+				continue;
+			}
+			int fd = r->fds[a];
+			int err = 0;
+			socklen_t len = sizeof err;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+				err = errno;
+			}
+			if (err == 0) {
+				epoll_ctl(c->epfd, EPOLL_CTL_DEL, fd, NULL);
+				finish(c, idx, fd, 0);
+				continue;
+			}
+			/* this address failed: the next one need not wait */
+			close(fd);
+			r->fds[a] = -1;
+			r->inflight--;
+			r->last_err = err;
+			if (r->inflight == 0) {
+				try_next(c, idx);
+			}
+		}
+	}
+}
+
+int connector_fd(connector_t* c) {
+	return c->epfd;
+}
+
+int connector_pending(connector_t* c) {
+	return c->pending;
+}
+
+void connector_destroy(connector_t* c) {
+	for (int i = 0; i < c->cap; i++) {
+		if (c->reqs[i].busy) {
+			finish(c, i, -1, ECANCELED);
+		}
+	}
+	for (int i = 0; i < c->ndone; i++) {
+		if (c->done[i].fd >= 0) {
+			close(c->done[i].fd);
+		}
+	}
+	close(c->epfd);
+	free(c->reqs);
+	free(c->free_reqs);
+	free(c->fallback.q);
+	free(c->deadline.q);
+	free(c->done);
+	free(c);
+}
@@ -0,0 +1,78 @@
+/* header file for bulk non-blocking connects with a resolver cache */
+
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* addresses kept per resolved name */
+#define RESOLVE_MAX_ADDRS 8
+
+/* Default time resolved names are kept, in seconds */
+#define RESOLVE_TTL 60
+
+/* Happy eyeballs: a connect that has not completed after this long gets
+ * the next address (of the other family first) started alongside it
+ */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+typedef struct {
+	int n;
+	struct sockaddr_storage addr[RESOLVE_MAX_ADDRS];
+	socklen_t len[RESOLVE_MAX_ADDRS];
+} addr_list_t;
+
+/* Resolves host:port for TCP through a process-wide cache, so a thousand
+ * connects to one server cost one getaddrinfo. Addresses alternate between
+ * families, starting with the one getaddrinfo preferred. Returns 0, or a
+ * getaddrinfo error code (see gai_strerror). Thread safe.
+ */
+int resolve_cached(const char* host, const char* port, addr_list_t* out);
+
+/* Sets how long resolved names are reused, 0 to disable the cache */
+void resolve_set_ttl(int seconds);
+
+/* A set of connects in progress, waited for with one epoll instance.
+ * Not thread safe: one thread starts and polls them.
+ */
+typedef struct connector connector_t;
+
+/* the outcome of one connect */
+typedef struct {
+	int fd;		/* connected non-blocking socket, -1 on failure */
+	int err;	/* errno of the failure, 0 on success */
+	void* data;	/* as given to connector_start */
+} connect_result_t;
+
+/* Creates a connector; connects not done within timeout_ms fail with
+ * ETIMEDOUT. Dies in case of errors.
+ */
+connector_t* connector_create(int timeout_ms);
+
+/* Starts connecting to host:port. The outcome is reported by
+ * connector_poll, or right away for name resolution failures: returns 0,
+ * or a getaddrinfo error code.
+ */
+int connector_start(connector_t* c, const char* host, const char* port, void* data);
+
+/* Waits up to timeout_ms (-1 blocks) for connects to finish and stores at
+ * most max outcomes in results. Returns the number stored.
+ */
+int connector_poll(connector_t* c, connect_result_t* results, int max, int timeout_ms);
+
+/* An fd that polls readable while connects have finished, for waiting on
+ * the connector from another event loop; connector_poll with a timeout of
+ * 0 then collects them. Timeouts and happy eyeballs fallbacks are only
+ * acted on in connector_poll, so poll at least every
+ * CONNECT_ATTEMPT_DELAY_MS while connects are pending.
+ */
+int connector_fd(connector_t* c);
+
+/* Number of connects started and not yet reported */
+int connector_pending(connector_t* c);
+
+/* Closes whatever is still connecting and frees the connector */
+void connector_destroy(connector_t* c);
+
+#endif /* CONNECTOR_H */
@@ -1,280 +1,1336 @@
-/* Multiplexing connection select server
- * accepting mutliple clients concurrently
+/* Multiplexing event-driven server
+ * accepting mutliple clients concurrently, on a selectable
+ * event loop backend (select, poll, epoll or io_uring)
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
-#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "sockutils.h"
+#include "shmring.h"
+#include "protocol.h"
+#include "eventloop.h"
+#include "handoff.h"
+#include "upgrade.h"
+#include "latency.h"
+#include "loopstats.h"
+#include "capture.h"
+#include "blob.h"
 
-#define MAXFDS 16 * 1024
-#define SENDBUF_SIZE 1024
+/* max events handled per wakeup; not a limit on fds */
+#define MAXEVENTS 1024
+/* pre-fork mode: a worker that dies sooner is restarted after this delay */
+#define RESPAWN_MIN_SECS 1
+/* acceptor mode: connections accepted per listener wakeup, at most */
+#define ACCEPT_BATCH 64
+/* acceptor mode: period over which reactor busy time is averaged */
+#define LOAD_WINDOW_NS 10000000
+/* migrations: reactor byte rates are compared once per period; a reactor
+ * above 5/4 of the mean for SUSTAINED_PERIODS sheds peers, then the rates
+ * get SETTLE_PERIODS to reflect the move
+ */
+#define BALANCE_PERIOD_NS 100000000
+#define SUSTAINED_PERIODS 3
+#define SETTLE_PERIODS 3
+#define MIN_IMBALANCE_BYTES (64 * 1024)	/* per period, hot minus cold */
+/* migrations: busiest peers tracked per reactor */
+#define HOT_PEERS 16
+/* hot upgrade: default time the old process gets to drain its peers, and
+ * how often it checks while draining
+ */
+#define DEFAULT_DRAIN_MS 5000
+#define DRAIN_POLL_MS 50
 
-typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ServerState;
+/* select-server is this file built with -DDEFAULT_BACKEND=\"select\" */
+#ifndef DEFAULT_BACKEND
+#define DEFAULT_BACKEND "epoll"
+#endif
 
+/* Per-worker counters of the pre-fork mode, in a MAP_SHARED segment the
+ * supervisor reads. A single process counts into a private slot.
+ */
 typedef struct {
-	ServerState state;
+	pid_t pid;
+	int restarts;		/* supervisor only */
+	uint64_t lost;		/* supervisor only: open peers of dead workers */
+	_Atomic uint64_t accepted;
+	_Atomic uint64_t closed;
+	_Atomic uint64_t events;
+} worker_stats_t;
 
-	/* sendbuf is the server buffer,
-	 * on_peer_ready_recv handler populates it,
-	 * on_peer_ready_sned handler drains it
-	 */
-	uint8_t sendbuf[SENDBUF_SIZE];
-	/* sendbuf_end points to last valid byte in sendbuf */
-	int sendbuf_end;
-	/* sendptr is the next byte to send */
-	int sendptr;
-} peer_state_t;
-
-/* fd is global. i.e Each peer has a unique fd in global scope,
- * when a peer disconnects fd is released to be used by another
- * on_peer_connected should initialize the state properly to remove
- * trace of the old peer on the same fd
+static worker_stats_t private_stats;
+worker_stats_t* my_stats = &private_stats;
+
+/* stand-ins for the listening sockets in the event data */
+peer_state_t listener_peer;
+peer_state_t shm_listener_peer;
+/* hot upgrade: the Unix listener, and a successor being handed over to */
+peer_state_t upgrade_peer;
+peer_state_t successor_peer;
+
+/* hot upgrade: once a successor accepts, peers are let go between frames
+ * until none is left or the deadline passes
  */
-peer_state_t global_state[MAXFDS];
- 
-/* the return structure of callback functions
- * tell if the port should be kept monitoring for read/write
+int64_t drain_ns = DEFAULT_DRAIN_MS * 1000000L;
+_Atomic int64_t drain_deadline;		/* 0: not draining */
+_Atomic uint64_t drained;		/* peers closed at rest while draining */
+
+/* a peer and the bytes it moved, halved every balance period */
+typedef struct {
+	peer_state_t* peer;
+	uint64_t bytes;
+} hot_peer_t;
+
+/* Acceptor mode: one thread accepts and hands each connection to one of
+ * N reactor threads, each running its own event loop over its peers.
+ * With migrations on, a migrator thread moves live peers off reactors
+ * that carry more than their share of the bytes.
+ * Fields are written by the reactor unless marked otherwise.
  */
 typedef struct {
-	bool want_read;		/* true -> keep monitoring fd for reading */
-	bool want_write;	/* true -> keep monitoring fd for writing */
-} fd_status_t;
-
-/* these constants make creating fd_status_t values less verebose */
-const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
-const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
-const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
-const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
-
-fd_status_t on_peer_connected(int sockfd, const struct sockaddr* peer_addr,
-				socklen_t peer_addr_len) {
-	assert(sockfd < MAXFDS);
-	connection_report(peer_addr, peer_addr_len);
-
-	// Initialize state to send back a '*' to the peer immediately.
-	peer_state_t* peerstate = &global_state[sockfd];
-	peerstate->state = INITIAL_ACK;
-	peerstate->sendbuf[0] = '*';
-	peerstate->sendptr = 0;
-	peerstate->sendbuf_end = 1;
-
-	// Signal that this socket is ready for writing now.
-	return fd_status_W;
-}
-
-fd_status_t on_peer_ready_recv(int sockfd) {
-	assert(sockfd < MAXFDS);
-	peer_state_t* peerstate = &global_state[sockfd];
-
-	if (peerstate->state == INITIAL_ACK || peerstate->sendptr < peerstate->sendbuf_end) {
-		/* Initial ack sending not complete or nothing to send */
-		return fd_status_W;
-	}
-
-	uint8_t buf[1024];
-	int nbytes = recv(sockfd, buf, sizeof buf, 0);
-	if (nbytes == 0) {
-		/* assume peer disconnected */
-		return fd_status_NORW;
-	} else if (nbytes < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			/* socket is not really ready to receive */
-			return fd_status_R;
-		} else {
-			perror_die("recv");
+	int id;
+	const char* backend;
+	long stall_us;			/* -1: loop stats off */
+	handoff_t* inbox;		/* acceptor -> reactor */
+	peer_state_t inbox_peer;	/* stand-in for the inbox doorbell */
+	_Atomic uint64_t closed;	/* peers this reactor closed */
+	_Atomic uint64_t events;
+	_Atomic int64_t busy_ns;	/* time spent handling events */
+	_Atomic int dump_loopstats;	/* set by the acceptor on SIGUSR2 */
+
+	/* migrations */
+	bool migrate;			/* set before start */
+	handoff_t* moves_in;		/* migrator -> reactor */
+	handoff_t* moves_out;		/* reactor -> migrator */
+	peer_state_t moves_peer;	/* stand-in for the moves_in doorbell */
+	_Atomic uint64_t moved_in;
+	_Atomic uint64_t moved_out;
+	_Atomic uint64_t bytes;		/* received and sent by the peers */
+	_Atomic int migrate_to;		/* set by the migrator: where to shed, or -1 */
+	_Atomic uint64_t migrate_budget;	/* set by the migrator: bytes per period */
+	hot_peer_t hot[HOT_PEERS];	/* Space-Saving top-k of the peers by bytes */
+	uint64_t bytes_seen;		/* peer_bytes_moved already charged */
+	int64_t hot_decay_at;
+
+	/* acceptor only */
+	uint64_t assigned;
+	int64_t last_busy_ns;
+	int load;			/* busy permille, averaged over windows */
+	pthread_t thread;
+
+	/* migrator only */
+	uint64_t last_bytes;
+	_Atomic uint64_t rate;		/* bytes over the last balance period */
+	int streak;			/* periods spent well above the mean */
+} reactor_t;
+
+/* the reactor the calling thread runs, NULL outside acceptor mode */
+_Thread_local reactor_t* my_reactor;
+
+void track_peer(reactor_t* r, peer_state_t* peerstate, bool closing) {
+/* charge the bytes moved since the last call to peerstate */
+	uint64_t delta = peer_bytes_moved - r->bytes_seen;
+	r->bytes_seen = peer_bytes_moved;
+	int min = 0;
+	for (int i = 0; i < HOT_PEERS; i++) {
+		if (r->hot[i].peer == peerstate) {
+			if (closing) {
+				r->hot[i] = (hot_peer_t){ NULL, 0 };
+			} else {
+				r->hot[i].bytes += delta;
+			}
+			return;
 		}
-	}
-	bool ready_to_send = false;
-	for (int i=0; i<nbytes; ++i) {
-		switch (peerstate->state) {
-			case INITIAL_ACK:
-				assert(0 && "can't reach here");
-				break;
-			case WAIT_FOR_MSG:
-				if (buf[i] == '^') {
-					peerstate->state = IN_MSG;
-				}
-				break;
-			case IN_MSG:
-				if (buf[i] == '$') {
-					peerstate->state = WAIT_FOR_MSG;
-				} else {
-					assert(peerstate->sendbuf_end < SENDBUF_SIZE);
-					peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] +1;
-					ready_to_send = true;
-				}
-				break;
+		if (r->hot[i].bytes < r->hot[min].bytes) {
+			min = i;
 		}
 	}
-	/* Report reading readiness iff there's nothing to send to the peer as
-	 * a result of the latest recv
+	if (closing || delta == 0) {
+		return;
+	}
+	/* Space-Saving: a newcomer inherits the smallest count it evicts, so
+	 * a peer that keeps moving bytes climbs past the ones that stopped
 	 */
-	return (fd_status_t){.want_read = !ready_to_send,
-				.want_write = ready_to_send};
+	r->hot[min].peer = peerstate;
+	r->hot[min].bytes += delta;
 }
 
-fd_status_t on_peer_ready_send(int sockfd) {
-	assert(sockfd < MAXFDS);
-	peer_state_t* peerstate = &global_state[sockfd];
+uint32_t peer_events(peer_state_t* peerstate, fd_status_t status) {
+/* loop interest for a handler status */
+	if (peerstate->shm != NULL) {
+		/* shm peers always wait for a kick on their eventfd */
+		return EV_READ;
+	}
+	return (status.want_read ? EV_READ : 0) | (status.want_write ? EV_WRITE : 0);
+}
 
-	if (peerstate->sendptr >= peerstate->sendbuf_end) {
-		/* Nothing to send */
-		return fd_status_RW;
+void update_peer_events(eventloop_t* loop, peer_state_t* peerstate, fd_status_t status) {
+/* re-arm the peer's interest from a handler status, closing it on NORW */
+	if (atomic_load_explicit(&drain_deadline, memory_order_relaxed) != 0 &&
+			(status.want_read || status.want_write) && peer_at_rest(peerstate)) {
+		atomic_fetch_add_explicit(&drained, 1, memory_order_relaxed);
+		status = fd_status_NORW;
 	}
-	int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
-	int nsent = send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen, 0);
-	if (nsent == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			return fd_status_W;
-		} else {
-			perror_die("send");
+	if (!status.want_read && !status.want_write) {
+		printf("socket %d closing\n", peerstate->fd);
+		atomic_fetch_add_explicit(&my_stats->closed, 1, memory_order_relaxed);
+		if (my_reactor != NULL) {
+			atomic_fetch_add_explicit(&my_reactor->closed, 1, memory_order_relaxed);
+			if (my_reactor->migrate) {
+				track_peer(my_reactor, peerstate, true);
+			}
 		}
+		ev_del(loop, peerstate->fd);
+		peer_destroy(peerstate);
+		return;
 	}
-	if (nsent < sendlen) {
-		peerstate->sendptr += nsent;
-		return fd_status_W;
-	} else {
-		/* Everythong was sent successfully; reset the queue */
-		peerstate->sendptr = 0;
-		peerstate->sendbuf_end = 0;
+	if (my_reactor != NULL && my_reactor->migrate) {
+		track_peer(my_reactor, peerstate, false);
+	}
+	uint32_t events = peer_events(peerstate, status);
+	if (events != peerstate->armed) {
+		ev_mod(loop, peerstate->fd, events, peerstate);
+		peerstate->armed = events;
+	}
+}
+
+/* Peers whose handlers queued output during the current batch. Instead of
+ * waiting a round for EV_WRITE, their output is sent when the batch ends,
+ * still registered for reading; only a short write arms EV_WRITE. A
+ * backend reports an fd at most once per wait, so no peer is listed twice.
+ */
+_Thread_local peer_state_t* flush_list[MAXEVENTS];
+_Thread_local int nflush;
+
+bool queue_flush(peer_state_t* peerstate) {
+/* false if the list is full: the caller waits for EV_WRITE instead */
+	if (nflush == MAXEVENTS) {
+		return false;
+	}
+	flush_list[nflush++] = peerstate;
+	return true;
+}
+
+void flush_peers(eventloop_t* loop) {
+/* end of a batch: every listed peer's output goes out in one call */
+	for (int i = 0; i < nflush; i++) {
+		update_peer_events(loop, flush_list[i], on_peer_ready_send(flush_list[i]));
+	}
+	nflush = 0;
+}
+
+volatile sig_atomic_t dump_loopstats;
+
+void on_sigusr2(int sig) {
+	(void)sig;
+	dump_loopstats = 1;
+}
 
-		/* Special-case state transition in if we were in INITIAL_ACK until now */
-		if (peerstate->state == INITIAL_ACK) {
-			peerstate->state = WAIT_FOR_MSG;
+void add_peer(eventloop_t* loop, const handoff_msg_t* conn) {
+/* start serving a connection accepted by this or another thread; its accept
+ * stage runs from conn->accept_ns, hand-off to a reactor included */
+	peer_state_t* newpeer = peer_create(conn->fd, conn->shm);
+	if (conn->shm != NULL) {
+		newpeer->armed = EV_READ;
+		ev_add(loop, conn->fd, EV_READ, newpeer);
+		on_peer_connected(newpeer, NULL, 0);
+		LAT_ACK_PENDING_SINCE(&newpeer->lat, conn->accept_ns);
+		/* push the '*' ack right away */
+		shm_chan_notify(conn->shm);
+		return;
+	}
+	const struct sockaddr* addr = conn->addr_len ? (const struct sockaddr*)&conn->addr : NULL;
+	fd_status_t status = on_peer_connected(newpeer, addr, conn->addr_len);
+	LAT_ACK_PENDING_SINCE(&newpeer->lat, conn->accept_ns);
+	/* the '*' ack goes out with the batch's flush */
+	if (queue_flush(newpeer)) {
+		status = fd_status_R;
+	}
+	newpeer->armed = peer_events(newpeer, status);
+	ev_add(loop, conn->fd, newpeer->armed, newpeer);
+}
+
+bool accept_shm_peer(handoff_msg_t* conn) {
+/* hand the rings to a new shm peer; conn gets its channel and eventfd */
+	int connfd = accept(shm_listener_peer.fd, NULL, NULL);
+	if (connfd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror_die("accept");
 		}
+		return false;
+	}
+	conn->accept_ns = LAT_NOW();
+	shm_chan_t* chan = shm_chan_accept(connfd);
+	if (chan == NULL) {
+		return false;
+	}
+	conn->shm = chan;
+	conn->fd = shm_chan_fd(chan);
+	conn->addr_len = 0;
+	conn->moved = NULL;
+	printf("shm peer connected on fd %d\n", conn->fd);
+	atomic_fetch_add_explicit(&my_stats->accepted, 1, memory_order_relaxed);
+	return true;
+}
 
-		return fd_status_R;
+void start_drain(eventloop_t* loop) {
+/* the successor accepts now: close the listeners and let the peers go */
+	ev_del(loop, listener_peer.fd);
+	close(listener_peer.fd);
+	listener_peer.fd = -1;
+	if (shm_listener_peer.fd >= 0) {
+		ev_del(loop, shm_listener_peer.fd);
+		close(shm_listener_peer.fd);
+		shm_listener_peer.fd = -1;
 	}
+	ev_del(loop, upgrade_peer.fd);
+	close(upgrade_peer.fd);
+	upgrade_peer.fd = -1;
+
+	uint64_t open = atomic_load(&my_stats->accepted) - atomic_load(&my_stats->closed);
+	printf("upgrade: successor accepting, draining %lu peers within %ldms\n",
+		(unsigned long)open, (long)(drain_ns / 1000000));
+	atomic_store(&drain_deadline, loopstats_now() + drain_ns);
 }
 
-int main (int argc, char* argv[]) {
-	setvbuf(stdout, NULL, _IONBF, 0);
+void handle_upgrade_event(eventloop_t* loop, ev_event_t* ev) {
+/* a successor asking for the listeners, or confirming it accepts */
+	if (ev->data == &upgrade_peer) {
+		int connfd = accept(upgrade_peer.fd, NULL, NULL);
+		if (connfd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror_die("upgrade: accept");
+			}
+			return;
+		}
+		if (successor_peer.fd >= 0) {
+			/* one hand-over at a time */
+			close(connfd);
+			return;
+		}
+		int fds[UPGRADE_MAX_FDS] = { listener_peer.fd, shm_listener_peer.fd };
+		if (upgrade_hand_over(connfd, fds, shm_listener_peer.fd >= 0 ? 2 : 1) < 0) {
+			perror("upgrade: hand over");
+			close(connfd);
+			return;
+		}
+		printf("upgrade: listeners handed to a successor\n");
+		successor_peer.fd = connfd;
+		ev_add(loop, connfd, EV_READ, &successor_peer);
+		return;
+	}
 
-	char *port = "9090";
-	if (argc >= 2) {
-		port = argv[1];
+	/* the successor confirmed, or died before it could */
+	char ok;
+	ssize_t n = recv(successor_peer.fd, &ok, 1, MSG_DONTWAIT);
+	ev_del(loop, successor_peer.fd);
+	close(successor_peer.fd);
+	successor_peer.fd = -1;
+	if (n == 1) {
+		start_drain(loop);
+	} else {
+		printf("upgrade: successor went away, still serving\n");
 	}
-	printf("Serving on port %s\n", port);
+}
 
-	int listener_sockfd = listen_inet(port);
-	make_socket_non_blocking(listener_sockfd);
+/* set once the calling loop has swept its peers for draining */
+_Thread_local bool drain_swept;
+
+void let_go_at_rest(peer_state_t* peerstate, void* arg) {
+	if (peer_at_rest(peerstate)) {
+		atomic_fetch_add_explicit(&drained, 1, memory_order_relaxed);
+		update_peer_events((eventloop_t*)arg, peerstate, fd_status_NORW);
+	}
+}
+
+void sweep_for_drain(eventloop_t* loop) {
+/* idle peers get no event to be let go on: close those at rest once, when
+ * draining starts, and leave the deadline to peers with something in flight
+ */
+	if (drain_swept || atomic_load_explicit(&drain_deadline, memory_order_relaxed) == 0) {
+		return;
+	}
+	drain_swept = true;
+	peer_foreach(let_go_at_rest, loop);
+}
+
+void check_drained(void) {
+/* exit once draining is over */
+	int64_t deadline = atomic_load_explicit(&drain_deadline, memory_order_relaxed);
+	if (deadline == 0) {
+		return;
+	}
+	uint64_t open = atomic_load(&my_stats->accepted) - atomic_load(&my_stats->closed);
+	if (open > 0 && loopstats_now() < deadline) {
+		return;
+	}
+	printf("upgrade: drained, %lu peers let go between frames, %lu cut at the deadline\n",
+		(unsigned long)atomic_load(&drained), (unsigned long)open);
+	exit(EXIT_SUCCESS);
+}
+
+void handle_event(eventloop_t* loop, ev_event_t* ev) {
+/* dispatch one ready fd: a listener or a peer */
+	peer_state_t* peerstate = ev->data;
+	if ((peerstate == &listener_peer || peerstate == &shm_listener_peer) &&
+			peerstate->fd < 0) {
+	/* closed for a successor earlier in this batch */
+		return;
+	}
+	if (peerstate == &listener_peer) {
+	/* new peer connected */
+		struct sockaddr_storage peer_addr;
+		socklen_t peer_addr_len = sizeof(peer_addr);
+		int newsockfd = accept(listener_peer.fd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+		int64_t accept_ns = LAT_NOW();
+
+		if (newsockfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			/* handle nonblocking socket mode */
+				printf("accept returned EAGAIN or EWOULDBLOCK\n");
+			} else {
+				perror_die("accept");
+			}
+		} else {
+			make_socket_non_blocking(newsockfd);
 
-	int epollfd = epoll_create1(0);
-	if (epollfd < 0) {
-		perror_die("epoll_create1");
+			atomic_fetch_add_explicit(&my_stats->accepted, 1, memory_order_relaxed);
+			handoff_msg_t conn = { .fd = newsockfd, .addr_len = peer_addr_len, .accept_ns = accept_ns };
+			memcpy(&conn.addr, &peer_addr, peer_addr_len);
+			add_peer(loop, &conn);
+		}
+	} else if (peerstate == &shm_listener_peer) {
+	/* new shm peer: hand over the rings, then serve its eventfd */
+		handoff_msg_t conn;
+		if (accept_shm_peer(&conn)) {
+			add_peer(loop, &conn);
+		}
+	} else if (my_reactor != NULL && peerstate == &my_reactor->inbox_peer) {
+	/* connections handed over by the acceptor */
+		handoff_clear(my_reactor->inbox);
+		handoff_msg_t conn;
+		while (handoff_pop(my_reactor->inbox, &conn)) {
+			add_peer(loop, &conn);
+		}
+	} else if (my_reactor != NULL && peerstate == &my_reactor->moves_peer) {
+	/* live peers migrated here, or a request to shed some */
+		handoff_clear(my_reactor->moves_in);
+		handoff_msg_t conn;
+		while (handoff_pop(my_reactor->moves_in, &conn)) {
+			fd_status_t status;
+			peer_state_t* newpeer = peer_adopt(conn.moved, &status);
+			newpeer->armed = peer_events(newpeer, status);
+			ev_add(loop, conn.fd, newpeer->armed, newpeer);
+			atomic_fetch_add_explicit(&my_reactor->moved_in, 1, memory_order_relaxed);
+		}
+	} else if (peerstate == &upgrade_peer || peerstate == &successor_peer) {
+		handle_upgrade_event(loop, ev);
+	} else if ((ev->events & EV_ERROR) && !peer_reap_zerocopy(peerstate)) {
+	// The peer's connection failed.
+		update_peer_events(loop, peerstate, fd_status_NORW);
+	} else if (peerstate->shm != NULL) {
+	// A shm peer was kicked.
+		update_peer_events(loop, peerstate, on_shm_peer_ready(peerstate));
+	} else {
+	// A peer socket is ready.
+		if (ev->events & EV_READ) {
+		// Ready for reading; replies are flushed when the batch ends.
+			fd_status_t status = on_peer_ready_recv(peerstate);
+			if (!status.want_write || !queue_flush(peerstate)) {
+				update_peer_events(loop, peerstate, status);
+			} else if (my_reactor != NULL && my_reactor->migrate) {
+				/* charge what it received now, not to the next
+				 * peer update_peer_events sees */
+				track_peer(my_reactor, peerstate, false);
+			}
+		} else if (ev->events & EV_WRITE) {
+		// Ready for writing.
+			update_peer_events(loop, peerstate, on_peer_ready_send(peerstate));
+		}
 	}
+}
+
+typedef enum { BALANCE_LEAST, BALANCE_P2C } balance_t;
 
-	struct epoll_event accept_event;
-	accept_event.data.fd = listener_sockfd;
-	accept_event.events = EPOLLIN;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listener_sockfd, &accept_event) < 0) {
-		perror_die("epoll_ctl EPOLL_CTL_ADD");
+/* what one event loop serves */
+typedef struct {
+	char* port;
+	char* backend;
+	char* shm_path;		/* NULL: no shm listener */
+	long stall_us;		/* -1: loop stats off */
+	int listener_fd;	/* inherited listener, -1 to open our own */
+	int nreactors;		/* 0: the accepting loop serves the peers too */
+	balance_t balance;	/* how the acceptor picks a reactor */
+	bool migrate;		/* move live peers off reactors with excess bytes */
+	char* upgrade_path;	/* NULL: no hot upgrade */
+} server_conf_t;
+
+void shed_hot_peers(eventloop_t* loop, reactor_t* r) {
+/* move the busiest peers that fit in the migrator's budget, between
+ * events, so that no handler is in the middle of them
+ */
+	if (atomic_load_explicit(&r->migrate_to, memory_order_relaxed) < 0) {
+		return;
 	}
+	int to = atomic_exchange(&r->migrate_to, -1);
+	/* tracked counts sum a geometric series: twice the bytes per period */
+	uint64_t budget = 2 * atomic_load(&r->migrate_budget);
+	int moved = 0;
+	while (1) {
+		/* shm peers and peers streaming a blob stay */
+		int best = -1;
+		for (int i = 0; i < HOT_PEERS; i++) {
+			hot_peer_t* h = &r->hot[i];
+			if (h->peer != NULL && peer_can_move(h->peer) && h->bytes <= budget &&
+					(best < 0 || h->bytes > r->hot[best].bytes)) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		peer_state_t* peerstate = r->hot[best].peer;
+		budget -= r->hot[best].bytes;
+		r->hot[best] = (hot_peer_t){ NULL, 0 };
 
-	struct epoll_event* events = calloc(MAXFDS, sizeof(struct epoll_event));
+		ev_del(loop, peerstate->fd);
+		handoff_msg_t msg = { .fd = peerstate->fd, .to = to };
+		msg.moved = peer_detach(peerstate);
+		if (!handoff_push(r->moves_out, &msg)) {
+			/* the migrator is behind: keep the peer */
+			fd_status_t status;
+			peerstate = peer_adopt(msg.moved, &status);
+			peerstate->armed = peer_events(peerstate, status);
+			ev_add(loop, msg.fd, peerstate->armed, peerstate);
+			break;
+		}
+		moved++;
+	}
+	if (moved > 0) {
+		atomic_fetch_add_explicit(&r->moved_out, moved, memory_order_relaxed);
+		handoff_ring(r->moves_out);
+	}
+}
+
+void reactor_batch_done(eventloop_t* loop, reactor_t* r, int nready, int64_t woke) {
+/* publish what the balancing needs, and shed peers when asked */
+	int64_t now = loopstats_now();
+	atomic_fetch_add_explicit(&r->events, nready, memory_order_relaxed);
+	atomic_fetch_add_explicit(&r->busy_ns, now - woke, memory_order_relaxed);
+	if (!r->migrate) {
+		return;
+	}
+	atomic_store_explicit(&r->bytes, peer_bytes_moved, memory_order_relaxed);
+	if (now >= r->hot_decay_at) {
+		for (int i = 0; i < HOT_PEERS; i++) {
+			r->hot[i].bytes /= 2;
+		}
+		r->hot_decay_at = now + BALANCE_PERIOD_NS;
+	}
+	shed_hot_peers(loop, r);
+}
+
+void print_zerocopy_stats(void) {
+	if (zerocopy_min <= 0) {
+		return;
+	}
+	printf("zero-copy sends of >= %ld bytes: %lu zero-copy (%lu copied by the kernel), %lu copied\n",
+		zerocopy_min,
+		(unsigned long)atomic_load(&zerocopy_stats.zerocopy),
+		(unsigned long)atomic_load(&zerocopy_stats.fell_back),
+		(unsigned long)atomic_load(&zerocopy_stats.copied));
+}
+
+bool take_dump_request(void) {
+/* has SIGUSR2 asked this loop for its stats? */
+	if (my_reactor != NULL) {
+		return atomic_exchange(&my_reactor->dump_loopstats, 0);
+	}
+	if (dump_loopstats) {
+		dump_loopstats = 0;
+		return true;
+	}
+	return false;
+}
+
+void run_loop(eventloop_t* loop, loopstats_t* ls) {
+/* wait for and handle events forever */
+	ev_event_t* events = calloc(MAXEVENTS, sizeof(ev_event_t));
 	if (events == NULL) {
-		die("Unable to allocate memory for epoll_events");
+		die("Unable to allocate memory for events");
 	}
 
 	while (1) {
-		int nready = epoll_wait(epollfd, events, MAXFDS, -1);
-		for (int i = 0; i < nready ; i++) {
-			if (events[i].events & EPOLLERR) {
-				perror_die("epoll_wait returned EPOLLERR");
+		if (ls != NULL) {
+			loopstats_wait(ls);
+		}
+		/* reactors leave the drain deadline to the accepting thread */
+		bool watch_drain = my_reactor == NULL && drain_deadline != 0;
+		int nready = ev_wait(loop, events, MAXEVENTS, watch_drain ? DRAIN_POLL_MS : -1);
+		/* reactors publish their busy time for the acceptor's balancing */
+		int64_t woke = my_reactor != NULL ? loopstats_now() : 0;
+		atomic_fetch_add_explicit(&my_stats->events, nready, memory_order_relaxed);
+		if (ls == NULL) {
+			for (int i = 0; i < nready; i++) {
+				handle_event(loop, &events[i]);
+			}
+			if (my_reactor == NULL && take_dump_request()) {
+				print_zerocopy_stats();
+			}
+		} else {
+			loopstats_woke(ls, nready);
+			for (int i = 0; i < nready; i++) {
+				/* the handler may free the peer: take its fd first */
+				int fd = ((peer_state_t*)events[i].data)->fd;
+				int64_t start = loopstats_now();
+				handle_event(loop, &events[i]);
+				loopstats_handled(ls, fd, events[i].events, start);
+			}
+			if (take_dump_request()) {
+				flockfile(stdout);
+				if (my_reactor != NULL) {
+					printf("reactor %d:\n", my_reactor->id);
+				}
+				loopstats_print(ls, stdout);
+				if (my_reactor == NULL) {
+					print_zerocopy_stats();
+				}
+				funlockfile(stdout);
 			}
+		}
+		flush_peers(loop);
+		sweep_for_drain(loop);
+		if (my_reactor != NULL) {
+			reactor_batch_done(loop, my_reactor, nready, woke);
+		} else {
+			check_drained();
+		}
+	}
+}
 
-			if (events[i].data.fd == listener_sockfd) {
-			/* new peer connected */
-				struct sockaddr_storage peer_addr;
-				socklen_t peer_addr_len = sizeof(peer_addr);
-				int newsockfd = accept(listener_sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+/* ---- acceptor mode ---- */
 
-				if (newsockfd < 0) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					/* handle nonblocking socket mode */
-						printf("accept returned EAGAIN or EWOULDBLOCK\n");
-					} else {
-						perror_die("accept");
-					}
-				} else {
-					make_socket_non_blocking(newsockfd);
-					if (newsockfd >= MAXFDS) {
-						die("socket fd (%d) >= MAXFDS (%d)", newsockfd, MAXFDS);
-					}
+typedef struct {
+	reactor_t* reactors;
+	int n;
+	const char* backend;
+	int cooldown;		/* periods left before the next request */
+	_Atomic uint64_t requests;	/* times a reactor was asked to shed */
+	pthread_t thread;
+} migrator_t;
 
-					fd_status_t status = on_peer_connected(newsockfd, (struct sockaddr*)&peer_addr, peer_addr_len);
-					struct epoll_event event = {0};
-					event.data.fd = newsockfd;
-					if (status.want_read) {
-						event.events |= EPOLLIN;	
-					}
-					if (status.want_write) {
-						event.events |= EPOLLOUT;	
-					}
+typedef struct {
+	reactor_t* reactors;
+	int n;
+	migrator_t* migrator;	/* NULL: no migrations */
+	balance_t policy;
+	long stall_us;		/* the reactors' loop stats, -1 off */
+	int64_t window_start;	/* of the current load window */
+	uint32_t rand;
+	uint64_t handed;	/* connections handed off */
+	uint64_t redirected;	/* sent elsewhere: the pick's ring was full */
+	bool* pending;		/* pushed to since the last doorbell */
+} balancer_t;
 
-					if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &event) < 0) {
-						perror_die("epoll_ctl EPOLL_CTL_ADD");
-					}
+void* reactor_main(void* arg) {
+/* serve the peers handed over through the inbox */
+	reactor_t* r = arg;
+	my_reactor = r;
+	eventloop_t* loop = eventloop_create(r->backend);
+	if (loop == NULL) {
+		die("reactor %d: cannot create a %s loop", r->id, r->backend);
+	}
+	r->inbox_peer.fd = handoff_fd(r->inbox);
+	ev_add(loop, r->inbox_peer.fd, EV_READ, &r->inbox_peer);
+	if (r->migrate) {
+		r->moves_peer.fd = handoff_fd(r->moves_in);
+		ev_add(loop, r->moves_peer.fd, EV_READ, &r->moves_peer);
+	}
+	run_loop(loop, r->stall_us >= 0 ? loopstats_create(r->stall_us * 1000) : NULL);
+	return NULL;
+}
+
+uint32_t next_rand(uint32_t* state) {
+/* xorshift32 */
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+int64_t reactor_active(reactor_t* r) {
+/* open peers, counting those still in the inbox */
+	uint64_t in = r->assigned + atomic_load_explicit(&r->moved_in, memory_order_relaxed);
+	uint64_t out = atomic_load_explicit(&r->closed, memory_order_relaxed) +
+		atomic_load_explicit(&r->moved_out, memory_order_relaxed);
+	return (int64_t)(in - out);
+}
+
+void refresh_loads(balancer_t* bal) {
+/* fold the reactors' busy time over the last window into their load */
+	int64_t now = loopstats_now();
+	int64_t span = now - bal->window_start;
+	if (span < LOAD_WINDOW_NS) {
+		return;
+	}
+	for (int i = 0; i < bal->n; i++) {
+		reactor_t* r = &bal->reactors[i];
+		int64_t busy = atomic_load_explicit(&r->busy_ns, memory_order_relaxed);
+		int permille = (int)((busy - r->last_busy_ns) * 1000 / span);
+		r->last_busy_ns = busy;
+		/* after a long quiet spell the old load says nothing */
+		r->load = span >= 4 * LOAD_WINDOW_NS ? permille : (3 * r->load + permille) / 4;
+	}
+	bal->window_start = now;
+}
+
+int pick_reactor(balancer_t* bal) {
+	if (bal->policy == BALANCE_LEAST || bal->n == 1) {
+		int best = 0;
+		for (int i = 1; i < bal->n; i++) {
+			if (reactor_active(&bal->reactors[i]) < reactor_active(&bal->reactors[best])) {
+				best = i;
+			}
+		}
+		return best;
+	}
+
+	/* Power of two choices: the less loaded of two random reactors. Loads
+	 * lag by a window, so always taking the least loaded would send a
+	 * whole burst of accepts to the same one.
+	 */
+	int a = next_rand(&bal->rand) % bal->n;
+	int b = (a + 1 + next_rand(&bal->rand) % (bal->n - 1)) % bal->n;
+	reactor_t* ra = &bal->reactors[a];
+	reactor_t* rb = &bal->reactors[b];
+	if (ra->load != rb->load) {
+		return ra->load < rb->load ? a : b;
+	}
+	return reactor_active(ra) <= reactor_active(rb) ? a : b;
+}
+
+void hand_off(balancer_t* bal, const handoff_msg_t* conn) {
+/* queue conn on the picked reactor, or the next one with room */
+	int target = pick_reactor(bal);
+	int tries = 0;
+	while (!handoff_push(bal->reactors[target].inbox, conn)) {
+		/* make sure the full reactor is draining, then look further */
+		handoff_ring(bal->reactors[target].inbox);
+		bal->pending[target] = false;
+		bal->redirected++;
+		target = (target + 1) % bal->n;
+		if (++tries % bal->n == 0) {
+			sched_yield();
+		}
+	}
+	bal->reactors[target].assigned++;
+	bal->pending[target] = true;
+	bal->handed++;
+}
+
+void rebalance(migrator_t* m) {
+/* Compare the reactors' byte rates over the last period. One that stays
+ * well above the mean is asked to shed half its excess over the coldest.
+ */
+	uint64_t sum = 0;
+	int hot = 0, cold = 0;
+	for (int i = 0; i < m->n; i++) {
+		reactor_t* r = &m->reactors[i];
+		uint64_t bytes = atomic_load_explicit(&r->bytes, memory_order_relaxed);
+		uint64_t rate = bytes - r->last_bytes;
+		r->last_bytes = bytes;
+		atomic_store_explicit(&r->rate, rate, memory_order_relaxed);
+		sum += rate;
+		if (rate > atomic_load_explicit(&m->reactors[hot].rate, memory_order_relaxed)) {
+			hot = i;
+		}
+		if (rate < atomic_load_explicit(&m->reactors[cold].rate, memory_order_relaxed)) {
+			cold = i;
+		}
+	}
+	if (m->cooldown > 0) {
+		/* let the rates show the last move first */
+		m->cooldown--;
+		for (int i = 0; i < m->n; i++) {
+			m->reactors[i].streak = 0;
+		}
+		return;
+	}
+	uint64_t hot_rate = atomic_load_explicit(&m->reactors[hot].rate, memory_order_relaxed);
+	uint64_t cold_rate = atomic_load_explicit(&m->reactors[cold].rate, memory_order_relaxed);
+	for (int i = 0; i < m->n; i++) {
+		if (i != hot) {
+			m->reactors[i].streak = 0;
+		}
+	}
+	if (hot_rate * 4 * m->n <= sum * 5 || hot_rate - cold_rate < MIN_IMBALANCE_BYTES) {
+		m->reactors[hot].streak = 0;
+		return;
+	}
+	m->reactors[hot].streak++;
+	if (m->reactors[hot].streak < SUSTAINED_PERIODS) {
+		return;
+	}
+
+	reactor_t* r = &m->reactors[hot];
+	atomic_store(&r->migrate_budget, (hot_rate - cold_rate) / 2);
+	atomic_store(&r->migrate_to, cold);
+	handoff_ring(r->moves_in);
+	atomic_fetch_add(&m->requests, 1);
+	r->streak = 0;
+	m->cooldown = SETTLE_PERIODS;
+}
+
+void* migrator_main(void* arg) {
+/* relay migrated peers between reactors and decide who sheds them */
+	migrator_t* m = arg;
+	eventloop_t* loop = eventloop_create(m->backend);
+	if (loop == NULL) {
+		die("migrator: cannot create a %s loop", m->backend);
+	}
+	for (int i = 0; i < m->n; i++) {
+		reactor_t* r = &m->reactors[i];
+		ev_add(loop, handoff_fd(r->moves_out), EV_READ, r);
+	}
+	ev_event_t* events = xmalloc(m->n * sizeof(ev_event_t));
+	bool* pending = calloc(m->n, sizeof(bool));
+	int64_t next_period = loopstats_now() + BALANCE_PERIOD_NS;
+
+	while (1) {
+		int64_t left = next_period - loopstats_now();
+		int nready = ev_wait(loop, events, m->n,
+				left > 0 ? (int)((left + 999999) / 1000000) : 0);
+		for (int i = 0; i < nready; i++) {
+			reactor_t* from = events[i].data;
+			handoff_clear(from->moves_out);
+			handoff_msg_t msg;
+			while (handoff_pop(from->moves_out, &msg)) {
+				reactor_t* to = &m->reactors[msg.to];
+				while (!handoff_push(to->moves_in, &msg)) {
+					handoff_ring(to->moves_in);
+					sched_yield();
 				}
-			} else {
-			// A peer socket is ready.
-				if (events[i].events & EPOLLIN) {
-				// Ready for reading.
-					int fd = events[i].data.fd;
-					fd_status_t status = on_peer_ready_recv(fd);
-					struct epoll_event event = {0};
-					event.data.fd = fd;
-					if (status.want_read) {
-						event.events |= EPOLLIN;
-					}
-					if (status.want_write) {
-						event.events |= EPOLLOUT;
-					}
-					if (event.events == 0) {
-						printf("socket %d closing\n", fd);
-						if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-							perror_die("epoll_ctl EPOLL_CTL_DEL");
-						}
-						close(fd);
-					} else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
-						perror_die("epoll_ctl EPOLL_CTL_MOD");
-					}
-				} else if (events[i].events & EPOLLOUT) {
-				// Ready for writing.
-					int fd = events[i].data.fd;
-					fd_status_t status = on_peer_ready_send(fd);
-					struct epoll_event event = {0};
-					event.data.fd = fd;
-
-					if (status.want_read) {
-						event.events |= EPOLLIN;
-					}
-					if (status.want_write) {
-						event.events |= EPOLLOUT;
+				pending[msg.to] = true;
+			}
+		}
+		for (int i = 0; i < m->n; i++) {
+			if (pending[i]) {
+				pending[i] = false;
+				handoff_ring(m->reactors[i].moves_in);
+			}
+		}
+
+		if (loopstats_now() >= next_period) {
+			rebalance(m);
+			next_period += BALANCE_PERIOD_NS;
+		}
+	}
+	return NULL;
+}
+
+void print_balancer_stats(balancer_t* bal) {
+	printf("%s balancing: %lu connections handed off, %lu redirected from full rings\n",
+		bal->policy == BALANCE_LEAST ? "least-connections" : "power-of-two-choices",
+		(unsigned long)bal->handed, (unsigned long)bal->redirected);
+	if (bal->migrator != NULL) {
+		printf("migrations: %lu requests to shed\n",
+			(unsigned long)atomic_load(&bal->migrator->requests));
+	}
+	printf("reactor  assigned   active   load%%   events       MB/s     in       out\n");
+	for (int i = 0; i < bal->n; i++) {
+		reactor_t* r = &bal->reactors[i];
+		printf("%-8d %-10lu %-8ld %-7.1f %-12lu %-8.2f %-8lu %lu\n", i,
+			(unsigned long)r->assigned, (long)reactor_active(r), r->load / 10.0,
+			(unsigned long)atomic_load(&r->events),
+			atomic_load(&r->rate) * (1e9 / BALANCE_PERIOD_NS) / 1e6,
+			(unsigned long)atomic_load(&r->moved_in),
+			(unsigned long)atomic_load(&r->moved_out));
+	}
+}
+
+void run_acceptor(server_conf_t* conf, eventloop_t* loop) {
+/* accept on loop's listeners and spread the peers over reactor threads */
+	balancer_t bal = {
+		.n = conf->nreactors,
+		.policy = conf->balance,
+		.stall_us = conf->stall_us,
+		.window_start = loopstats_now(),
+		.rand = (uint32_t)getpid() | 1,
+	};
+	bal.reactors = calloc(bal.n, sizeof(reactor_t));
+	bal.pending = calloc(bal.n, sizeof(bool));
+	if (bal.reactors == NULL || bal.pending == NULL) {
+		die("out of memory for %d reactors", bal.n);
+	}
+
+	/* SIGUSR2 goes to the acceptor, which relays it to the reactors */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (int i = 0; i < bal.n; i++) {
+		reactor_t* r = &bal.reactors[i];
+		r->id = i;
+		r->backend = conf->backend;
+		r->stall_us = conf->stall_us;
+		r->inbox = handoff_create();
+		r->migrate = conf->migrate;
+		atomic_init(&r->migrate_to, -1);
+		if (r->migrate) {
+			r->moves_in = handoff_create();
+			r->moves_out = handoff_create();
+		}
+		if (pthread_create(&r->thread, NULL, reactor_main, r) != 0) {
+			die("cannot start reactor %d", i);
+		}
+	}
+	if (conf->migrate) {
+		migrator_t* m = calloc(1, sizeof(migrator_t));
+		if (m == NULL) {
+			die("out of memory for the migrator");
+		}
+		m->reactors = bal.reactors;
+		m->n = bal.n;
+		m->backend = conf->backend;
+		if (pthread_create(&m->thread, NULL, migrator_main, m) != 0) {
+			die("cannot start the migrator");
+		}
+		bal.migrator = m;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	struct sigaction sa = { .sa_handler = on_sigusr2 };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+	printf("Accepting for %d reactors, %s balancing; SIGUSR2 prints the assignments\n",
+		bal.n, bal.policy == BALANCE_LEAST ? "least-connections" : "power-of-two-choices");
+
+	/* listeners plus the upgrade socket and a successor */
+	ev_event_t events[4];
+	while (1) {
+		int nready = ev_wait(loop, events, 4, drain_deadline != 0 ? DRAIN_POLL_MS : -1);
+		refresh_loads(&bal);
+		for (int i = 0; i < nready; i++) {
+			handoff_msg_t conn;
+			peer_state_t* ready = events[i].data;
+			if (ready == &upgrade_peer || ready == &successor_peer) {
+				handle_upgrade_event(loop, &events[i]);
+				if (drain_deadline != 0) {
+					/* wake the reactors to sweep their idle peers */
+					for (int r = 0; r < bal.n; r++) {
+						handoff_ring(bal.reactors[r].inbox);
 					}
-					if (event.events == 0) {
-						printf("socket %d closing\n", fd);
-						if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-							perror_die("epoll_ctl EPOLL_CTL_DEL");
-						}
-						close(fd);
-					} else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
-						perror_die("epoll_ctl EPOLL_CTL_MOD");
+				}
+				continue;
+			}
+			if (ready->fd < 0) {
+				/* a listener closed for a successor */
+				continue;
+			}
+			if (ready == &shm_listener_peer) {
+				if (accept_shm_peer(&conn)) {
+					hand_off(&bal, &conn);
+				}
+				continue;
+			}
+			/* drain the backlog, ringing each reactor once per batch */
+			for (int n = 0; n < ACCEPT_BATCH; n++) {
+				conn.addr_len = sizeof(conn.addr);
+				conn.fd = accept(listener_peer.fd, (struct sockaddr*)&conn.addr, &conn.addr_len);
+				conn.accept_ns = LAT_NOW();
+				if (conn.fd < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						break;
 					}
+					perror_die("accept");
 				}
+				make_socket_non_blocking(conn.fd);
+				conn.shm = NULL;
+				conn.moved = NULL;
+				atomic_fetch_add_explicit(&my_stats->accepted, 1, memory_order_relaxed);
+				hand_off(&bal, &conn);
+			}
+		}
+		for (int i = 0; i < bal.n; i++) {
+			if (bal.pending[i]) {
+				bal.pending[i] = false;
+				handoff_ring(bal.reactors[i].inbox);
+			}
+		}
+
+		if (dump_loopstats) {
+			dump_loopstats = 0;
+			print_balancer_stats(&bal);
+			print_zerocopy_stats();
+			for (int i = 0; bal.stall_us >= 0 && i < bal.n; i++) {
+				atomic_store(&bal.reactors[i].dump_loopstats, 1);
+				handoff_ring(bal.reactors[i].inbox);
+			}
+		}
+		check_drained();
+	}
+}
+
+void run_event_loop(server_conf_t* conf) {
+/* serve the listeners and their peers forever */
+	eventloop_t* loop = eventloop_create(conf->backend);
+	if (loop == NULL) {
+		die("event loop backend '%s' unavailable (have: " EV_BACKENDS ")", conf->backend);
+	}
+	printf("Serving on port %s with the %s backend\n", conf->port, eventloop_backend(loop));
+	shm_listener_peer.fd = -1;
+	upgrade_peer.fd = -1;
+	successor_peer.fd = -1;
+
+	/* hot upgrade: take the listeners over from a running server, if any */
+	int inherited[UPGRADE_MAX_FDS];
+	int predecessor = -1;
+	int ninherited = 0;
+	if (conf->upgrade_path != NULL) {
+		ninherited = upgrade_take_over(conf->upgrade_path, inherited, &predecessor);
+	}
+
+	/* an inherited listener is shared with other processes: let epoll
+	 * wake only one of them per connection
+	 */
+	uint32_t listen_events = EV_READ;
+	int listener_sockfd = conf->listener_fd;
+	if (ninherited > 0) {
+		printf("upgrade: took over the listeners of the running server\n");
+		listener_sockfd = inherited[0];
+	} else if (listener_sockfd < 0) {
+		listener_sockfd = listen_inet(conf->port);
+	} else {
+		listen_events |= EV_EXCLUSIVE;
+	}
+
+	/* a readiness notification does not guarantee the socket is
+	 * actually ready: use non blocking sockets everywhere
+	 */
+	make_socket_non_blocking(listener_sockfd);
+	listener_peer.fd = listener_sockfd;
+	ev_add(loop, listener_sockfd, listen_events, &listener_peer);
+
+	/* same-host peers set up shared-memory rings over a Unix socket */
+	if (ninherited > 1 || conf->shm_path != NULL) {
+		int shm_listener_sockfd;
+		if (ninherited > 1) {
+			shm_listener_sockfd = inherited[1];
+		} else {
+			printf("Serving shm peers on %s\n", conf->shm_path);
+			shm_listener_sockfd = listen_shm(conf->shm_path);
+		}
+		make_socket_non_blocking(shm_listener_sockfd);
+		shm_listener_peer.fd = shm_listener_sockfd;
+		ev_add(loop, shm_listener_sockfd, EV_READ, &shm_listener_peer);
+	}
+
+	/* be ready to hand over to the next build, then let the previous
+	 * one go: both accept until it hears from us
+	 */
+	if (conf->upgrade_path != NULL) {
+		upgrade_peer.fd = upgrade_listen(conf->upgrade_path);
+		make_socket_non_blocking(upgrade_peer.fd);
+		ev_add(loop, upgrade_peer.fd, EV_READ, &upgrade_peer);
+		printf("upgrade: a successor started with -H %s takes over\n", conf->upgrade_path);
+	}
+	if (predecessor >= 0) {
+		upgrade_confirm(predecessor);
+	}
+
+	if (conf->nreactors > 0) {
+		run_acceptor(conf, loop);
+	}
+
+	loopstats_t* ls = NULL;
+	if (conf->stall_us >= 0 || zerocopy_min > 0) {
+		struct sigaction sa = { .sa_handler = on_sigusr2 };
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR2, &sa, NULL);
+	}
+	if (conf->stall_us >= 0) {
+		ls = loopstats_create(conf->stall_us * 1000);
+		printf("Loop stats on SIGUSR2, stalls >= %ldus logged\n", conf->stall_us);
+	}
+	if (zerocopy_min > 0) {
+		printf("Zero-copy sends from %ld bytes, counters on SIGUSR2\n", zerocopy_min);
+	}
+	run_loop(loop, ls);
+}
+
+/* ---- pre-fork mode ---- */
+
+volatile sig_atomic_t supervisor_stop;
+volatile sig_atomic_t supervisor_dump;
+
+void on_supervisor_signal(int sig) {
+	if (sig == SIGUSR2) {
+		supervisor_dump = 1;
+	} else {
+		supervisor_stop = 1;
+	}
+}
+
+void print_worker_stats(worker_stats_t* stats, int nworkers) {
+	printf("worker  pid      accepted   active   events       restarts  lost\n");
+	for (int i = 0; i < nworkers; i++) {
+		worker_stats_t* w = &stats[i];
+		uint64_t accepted = atomic_load(&w->accepted);
+		uint64_t closed = atomic_load(&w->closed);
+		printf("%-7d %-8d %-10lu %-8lu %-12lu %-9d %lu\n", i, (int)w->pid,
+			(unsigned long)accepted, (unsigned long)(accepted - closed),
+			(unsigned long)atomic_load(&w->events), w->restarts,
+			(unsigned long)w->lost);
+	}
+}
+
+pid_t spawn_worker(server_conf_t* conf, worker_stats_t* slot) {
+/* fork a worker that runs the event loop, counting into slot */
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror_die("fork");
+	}
+	if (pid > 0) {
+		return pid;
+	}
+
+	/* child: default signals, and go down with the supervisor */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1) {
+		exit(EXIT_FAILURE);	/* supervisor already gone */
+	}
+	atomic_store(&slot->accepted, 0);
+	atomic_store(&slot->closed, 0);
+	atomic_store(&slot->events, 0);
+	my_stats = slot;
+	lat_init();
+	run_event_loop(conf);
+	exit(EXIT_SUCCESS);
+}
+
+void run_supervisor(server_conf_t* conf, int nworkers) {
+/* start nworkers event loop processes and restart any that dies; the
+ * others keep their connections, since nothing is shared but the
+ * listener and the counters
+ */
+	worker_stats_t* stats = mmap(NULL, nworkers * sizeof(worker_stats_t),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror_die("mmap worker stats");
+	}
+	memset(stats, 0, nworkers * sizeof(worker_stats_t));
+	time_t* started = xmalloc(nworkers * sizeof(time_t));
+
+	struct sigaction sa = { .sa_handler = on_supervisor_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	for (int i = 0; i < nworkers; i++) {
+		stats[i].pid = spawn_worker(conf, &stats[i]);
+		started[i] = time(NULL);
+	}
+	printf("supervisor %d: %d workers, %s; SIGUSR2 prints their counters\n",
+		(int)getpid(), nworkers, conf->listener_fd >= 0 ?
+		"one shared listener (EPOLLEXCLUSIVE)" : "SO_REUSEPORT listener each");
+
+	while (!supervisor_stop) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno != EINTR) {
+				perror_die("waitpid");
+			}
+			if (supervisor_dump) {
+				supervisor_dump = 0;
+				print_worker_stats(stats, nworkers);
 			}
+			continue;
+		}
+		for (int i = 0; i < nworkers; i++) {
+			if (stats[i].pid != pid) {
+				continue;
+			}
+			worker_stats_t* w = &stats[i];
+			if (WIFSIGNALED(status)) {
+				printf("worker %d (pid %d) killed by signal %d\n", i,
+					(int)pid, WTERMSIG(status));
+			} else {
+				printf("worker %d (pid %d) exited with %d\n", i,
+					(int)pid, WEXITSTATUS(status));
+			}
+			w->lost += atomic_load(&w->accepted) - atomic_load(&w->closed);
+			w->restarts++;
+			/* do not spin on a worker that dies right away */
+			if (time(NULL) - started[i] < RESPAWN_MIN_SECS) {
+				sleep(RESPAWN_MIN_SECS);
+			}
+			w->pid = spawn_worker(conf, w);
+			started[i] = time(NULL);
+		}
+	}
+
+	for (int i = 0; i < nworkers; i++) {
+		kill(stats[i].pid, SIGTERM);
+	}
+	while (wait(NULL) > 0)
+		;
+	print_worker_stats(stats, nworkers);
+	exit(EXIT_SUCCESS);
+}
+
+int main (int argc, char* argv[]) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	server_conf_t conf = {
+		.port = "9090",
+		.backend = DEFAULT_BACKEND,
+		.shm_path = NULL,
+		.stall_us = -1,
+		.listener_fd = -1,
+		.nreactors = 0,
+		.balance = BALANCE_P2C,
+		.upgrade_path = NULL,
+	};
+	int nworkers = 0;		/* pre-fork mode off */
+	bool shared_listener = false;
+	char* capture_path = NULL;
+	char* blob_dir = NULL;
+	static const struct option long_opts[] = {
+		{"backend", required_argument, NULL, 'B'},
+		{NULL, 0, NULL, 0},
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "B:u:S:M:Z:C:F:w:xr:b:mH:D:", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'B':
+				conf.backend = optarg;
+				break;
+			case 'u':
+				conf.shm_path = optarg;
+				break;
+			case 'S':
+				shm_spin_ns = atol(optarg);
+				break;
+			case 'M':
+				conf.stall_us = atol(optarg);
+				break;
+			case 'Z':
+				zerocopy_min = atol(optarg);
+				break;
+			case 'C':
+				capture_path = optarg;
+				break;
+			case 'F':
+				blob_dir = optarg;
+				break;
+			case 'w':
+				nworkers = atoi(optarg);
+				break;
+			case 'x':
+				shared_listener = true;
+				break;
+			case 'r':
+				conf.nreactors = atoi(optarg);
+				break;
+			case 'm':
+				conf.migrate = true;
+				break;
+			case 'H':
+				conf.upgrade_path = optarg;
+				break;
+			case 'D':
+				drain_ns = atol(optarg) * 1000000L;
+				break;
+			case 'b':
+				if (strcmp(optarg, "least") == 0) {
+					conf.balance = BALANCE_LEAST;
+				} else if (strcmp(optarg, "p2c") == 0) {
+					conf.balance = BALANCE_P2C;
+				} else {
+					die("unknown balancing policy '%s' (have: least, p2c)", optarg);
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s "
+						"[--backend " EV_BACKENDS "] "
+						"[-u shm_socket_path] "
+						"[-S shm_spin_ns] "
+						"[-M stall_us] "
+						"[-Z zerocopy_min_bytes] "
+						"[-C trace_path] "
+						"[-F blob_dir] "
+						"[-w n_workers [-x]] "
+						"[-r n_reactors [-b least|p2c] [-m]] "
+						"[-H upgrade_socket_path [-D drain_ms]] "
+						"[port_num]\n", argv[0]);
+				exit(EXIT_FAILURE);
 		}
 	}
 
+	if (optind < argc) {
+		conf.port = argv[optind];
+	}
+
+	if (conf.migrate && conf.nreactors < 2) {
+		die("-m moves peers between reactors: it needs -r 2 or more");
+	}
+
+	/* a peer gone while we write must not take the server down: sendmsg
+	 * passes MSG_NOSIGNAL, but sendfile for blobs has no such flag
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (blob_dir != NULL) {
+		/* loaded before any fork, so workers share the mappings */
+		int n = blob_load_dir(blob_dir);
+		printf("Serving %d blobs from %s\n", n, blob_dir);
+	}
+
+	if (nworkers > 0) {
+		if (conf.shm_path != NULL) {
+			die("-u needs a single process: the shm socket path cannot be shared");
+		}
+		if (conf.upgrade_path != NULL) {
+			die("-H needs a single process: hand-over is between two servers");
+		}
+		if (capture_path != NULL) {
+			die("-C needs a single process: workers cannot share one trace");
+		}
+		if (shared_listener) {
+			conf.listener_fd = listen_inet(conf.port);
+		}
+		run_supervisor(&conf, nworkers);
+	}
+
+	if (capture_path != NULL) {
+		peer_capture = capture_create(capture_path);
+		printf("Capturing inbound traffic to %s\n", capture_path);
+	}
+
+	lat_init();
+	run_event_loop(&conf);
 	return 0;
 }
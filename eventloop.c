@@ -0,0 +1,742 @@
+/* Event loop backends: select, poll, epoll and io_uring */
+/* behind one registration / wait API */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "sockutils.h"
+#include "eventloop.h"
+
+typedef struct {
+	const char* name;
+	void* (*create)(void);
+	void (*add)(void* impl, int fd, uint32_t events, void* data);
+	void (*mod)(void* impl, int fd, uint32_t events, void* data);
+	void (*del)(void* impl, int fd);
+	int (*wait)(void* impl, ev_event_t* events, int maxevents, int timeout_ms);
+	void (*destroy)(void* impl);
+} ev_backend_t;
+
+struct eventloop {
+	const ev_backend_t* ops;
+	void* impl;
+};
+
+/* grow an fd-indexed table so that index fd is valid, zero filling */
+static void* grow_fd_table(void* table, int* cap, int fd, size_t elem) {
+	if (fd < *cap) {
+		return table;
+	}
+	int newcap = *cap ? *cap : 64;
+	while (newcap <= fd) {
+		newcap *= 2;
+	}
+	table = realloc(table, newcap * elem);
+	if (table == NULL) {
+		die("eventloop: out of memory");
+	}
+	memset((char*)table + *cap * elem, 0, (newcap - *cap) * elem);
+	*cap = newcap;
+	return table;
+}
+
+static struct timeval* ms_to_timeval(int timeout_ms, struct timeval* tv) {
+	if (timeout_ms < 0) {
+		return NULL;
+	}
+	tv->tv_sec = timeout_ms / 1000;
+	tv->tv_usec = (timeout_ms % 1000) * 1000;
+	return tv;
+}
+
+/* select: master fd_sets plus a dense list of the registered fds, so a
+ * wakeup copies only the used prefix of the sets and checks only the fds
+ * we actually track instead of every number up to the highest fd
+ */
+typedef struct {
+	fd_set readfds_master;
+	fd_set writefds_master;
+	int fdset_max;
+	int nfds;
+	int fds[FD_SETSIZE];	/* registered fds, unordered */
+	int pos[FD_SETSIZE];	/* index of fd in fds */
+	void* data[FD_SETSIZE];
+} select_impl_t;
+
+static void* select_create(void) {
+	select_impl_t* s = xmalloc(sizeof *s);
+	FD_ZERO(&s->readfds_master);
+	FD_ZERO(&s->writefds_master);
+	s->fdset_max = -1;
+	s->nfds = 0;
+	return s;
+}
+
+static void select_mod(void* impl, int fd, uint32_t events, void* data) {
+	select_impl_t* s = impl;
+	if (events & EV_READ) {
+		FD_SET(fd, &s->readfds_master);
+	} else {
+		FD_CLR(fd, &s->readfds_master);
+	}
+	if (events & EV_WRITE) {
+		FD_SET(fd, &s->writefds_master);
+	} else {
+		FD_CLR(fd, &s->writefds_master);
+	}
+	s->data[fd] = data;
+}
+
+static void select_add(void* impl, int fd, uint32_t events, void* data) {
+	select_impl_t* s = impl;
+	if (fd >= FD_SETSIZE) {
+		die("socket fd (%d) >= FD_SETSIZE (%d)", fd, FD_SETSIZE);
+	}
+	s->pos[fd] = s->nfds;
+	s->fds[s->nfds++] = fd;
+	if (fd > s->fdset_max) {
+		s->fdset_max = fd;
+	}
+	select_mod(impl, fd, events, data);
+}
+
+static void select_del(void* impl, int fd) {
+	select_impl_t* s = impl;
+	FD_CLR(fd, &s->readfds_master);
+	FD_CLR(fd, &s->writefds_master);
+	int last = s->fds[--s->nfds];
+	s->fds[s->pos[fd]] = last;
+	s->pos[last] = s->pos[fd];
+	if (fd == s->fdset_max) {
+		s->fdset_max = -1;
+		for (int i = 0; i < s->nfds; i++) {
+			if (s->fds[i] > s->fdset_max) {
+				s->fdset_max = s->fds[i];
+			}
+		}
+	}
+}
+
+static int select_wait(void* impl, ev_event_t* events, int maxevents, int timeout_ms) {
+	select_impl_t* s = impl;
+	/* pass copies of fd_sets, since select() modifies passed values;
+	 * only the words covering fds up to fdset_max matter
+	 */
+	fd_set readfds, writefds;
+	size_t used = (s->fdset_max / NFDBITS + 1) * sizeof(fd_mask);
+	memcpy(&readfds, &s->readfds_master, used);
+	memcpy(&writefds, &s->writefds_master, used);
+
+	struct timeval tv;
+	int nready = select(s->fdset_max + 1, &readfds, &writefds, NULL,
+			ms_to_timeval(timeout_ms, &tv));
+	if (nready < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror_die("select");
+	}
+
+	int n = 0;
+	for (int i = 0; i < s->nfds && nready > 0 && n < maxevents; i++) {
+		int fd = s->fds[i];
+		uint32_t ev = 0;
+		if (FD_ISSET(fd, &readfds)) {
+			ev |= EV_READ;
+			nready--;
+		}
+		if (FD_ISSET(fd, &writefds)) {
+			ev |= EV_WRITE;
+			nready--;
+		}
+		if (ev) {
+			events[n].data = s->data[fd];
+			events[n].events = ev;
+			n++;
+		}
+	}
+	return n;
+}
+
+static void select_destroy(void* impl) {
+	free(impl);
+}
+
+/* poll: the pollfd array stays compact, a removed entry is replaced by the
+ * last one, so poll() never scans holes
+ */
+typedef struct {
+	struct pollfd* pfds;
+	void** data;
+	int n, cap;
+	int* pos;		/* fd -> index in pfds */
+	int poscap;
+} poll_impl_t;
+
+static void* poll_create(void) {
+	poll_impl_t* p = xmalloc(sizeof *p);
+	memset(p, 0, sizeof *p);
+	return p;
+}
+
+static short poll_mask(uint32_t events) {
+	return ((events & EV_READ) ? POLLIN : 0) | ((events & EV_WRITE) ? POLLOUT : 0);
+}
+
+static void poll_add(void* impl, int fd, uint32_t events, void* data) {
+	poll_impl_t* p = impl;
+	if (p->n == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 64;
+		p->pfds = realloc(p->pfds, p->cap * sizeof(struct pollfd));
+		p->data = realloc(p->data, p->cap * sizeof(void*));
+		if (p->pfds == NULL || p->data == NULL) {
+			die("eventloop: out of memory");
+		}
+	}
+	p->pos = grow_fd_table(p->pos, &p->poscap, fd, sizeof(int));
+	p->pos[fd] = p->n;
+	p->pfds[p->n].fd = fd;
+	p->pfds[p->n].events = poll_mask(events);
+	p->pfds[p->n].revents = 0;
+	p->data[p->n] = data;
+	p->n++;
+}
+
+static void poll_mod(void* impl, int fd, uint32_t events, void* data) {
+	poll_impl_t* p = impl;
+	int i = p->pos[fd];
+	p->pfds[i].events = poll_mask(events);
+	p->data[i] = data;
+}
+
+static void poll_del(void* impl, int fd) {
+	poll_impl_t* p = impl;
+	int i = p->pos[fd];
+	p->n--;
+	if (i != p->n) {
+		p->pfds[i] = p->pfds[p->n];
+		p->data[i] = p->data[p->n];
+		p->pos[p->pfds[i].fd] = i;
+	}
+}
+
+static int poll_wait(void* impl, ev_event_t* events, int maxevents, int timeout_ms) {
+	poll_impl_t* p = impl;
+	int nready = poll(p->pfds, p->n, timeout_ms);
+	if (nready < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror_die("poll");
+	}
+
+	int n = 0;
+	for (int i = 0; i < p->n && nready > 0 && n < maxevents; i++) {
+		short re = p->pfds[i].revents;
+		if (re == 0) {
+			continue;
+		}
+		nready--;
+		uint32_t ev = 0;
+		if (re & (POLLIN | POLLHUP)) {
+			ev |= EV_READ;
+		}
+		if (re & POLLOUT) {
+			ev |= EV_WRITE;
+		}
+		if (re & (POLLERR | POLLNVAL)) {
+			ev |= EV_ERROR;
+		}
+		events[n].data = p->data[i];
+		events[n].events = ev;
+		n++;
+	}
+	return n;
+}
+
+static void poll_destroy(void* impl) {
+	poll_impl_t* p = impl;
+	free(p->pfds);
+	free(p->data);
+	free(p->pos);
+	free(p);
+}
+
+/* epoll */
+typedef struct {
+	int epollfd;
+	struct epoll_event* buf;
+	int bufcap;
+} epoll_impl_t;
+
+static void* epoll_create_impl(void) {
+	int epollfd = epoll_create1(0);
+	if (epollfd < 0) {
+		perror("epoll_create1");
+		return NULL;
+	}
+	epoll_impl_t* e = xmalloc(sizeof *e);
+	e->epollfd = epollfd;
+	e->buf = NULL;
+	e->bufcap = 0;
+	return e;
+}
+
+static void epoll_ctl_impl(void* impl, int op, int fd, uint32_t events, void* data) {
+	epoll_impl_t* e = impl;
+	struct epoll_event event = {0};
+	event.data.ptr = data;
+	if (events & EV_READ) {
+		event.events |= EPOLLIN;
+	}
+	if (events & EV_WRITE) {
+		event.events |= EPOLLOUT;
+	}
+	if (events & EV_EXCLUSIVE) {
+		event.events |= EPOLLEXCLUSIVE;
+	}
+	if (epoll_ctl(e->epollfd, op, fd, &event) < 0) {
+		perror_die(op == EPOLL_CTL_ADD ? "epoll_ctl EPOLL_CTL_ADD" : "epoll_ctl EPOLL_CTL_MOD");
+	}
+}
+
+static void epoll_add_impl(void* impl, int fd, uint32_t events, void* data) {
+	epoll_ctl_impl(impl, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static void epoll_mod_impl(void* impl, int fd, uint32_t events, void* data) {
+	epoll_ctl_impl(impl, EPOLL_CTL_MOD, fd, events, data);
+}
+
+static void epoll_del_impl(void* impl, int fd) {
+	epoll_impl_t* e = impl;
+	if (epoll_ctl(e->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+		perror_die("epoll_ctl EPOLL_CTL_DEL");
+	}
+}
+
+static int epoll_wait_impl(void* impl, ev_event_t* events, int maxevents, int timeout_ms) {
+	epoll_impl_t* e = impl;
+	if (e->bufcap < maxevents) {
+		free(e->buf);
+		e->buf = xmalloc(maxevents * sizeof(struct epoll_event));
+		e->bufcap = maxevents;
+	}
+	int nready = epoll_wait(e->epollfd, e->buf, maxevents, timeout_ms);
+	if (nready < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror_die("epoll_wait");
+	}
+	for (int i = 0; i < nready; i++) {
+		uint32_t re = e->buf[i].events;
+		uint32_t ev = 0;
+		if (re & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+			ev |= EV_READ;
+		}
+		if (re & EPOLLOUT) {
+			ev |= EV_WRITE;
+		}
+		if (re & EPOLLERR) {
+			ev |= EV_ERROR;
+		}
+		events[i].data = e->buf[i].data.ptr;
+		events[i].events = ev;
+	}
+	return nready;
+}
+
+static void epoll_destroy_impl(void* impl) {
+	epoll_impl_t* e = impl;
+	close(e->epollfd);
+	free(e->buf);
+	free(e);
+}
+
+/* io_uring: one-shot IORING_OP_POLL_ADD per registered fd, re-armed after
+ * each completion, which gives level-triggered semantics like the others.
+ * Re-arms and interest changes are queued in the SQ and go to the kernel
+ * together with the next wait, so a wakeup costs one io_uring_enter.
+ */
+#define URING_ENTRIES 256
+
+typedef struct uring_reg {
+	int fd;
+	uint32_t events;
+	void* data;
+	bool armed;		/* a POLL_ADD is in flight */
+	bool queued;		/* on the re-arm list */
+	bool deleted;		/* freed once its poll is gone */
+	unsigned wait_gen;	/* merges duplicate completions in one wait */
+	int out_idx;
+} uring_reg_t;
+
+typedef struct {
+	int ring_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe* sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned to_submit;
+	unsigned wait_gen;
+	uring_reg_t** regs;	/* fd -> registration */
+	int regcap;
+	uring_reg_t** rearm;	/* completed registrations to re-arm */
+	int nrearm, rearmcap;
+} uring_impl_t;
+
+static int uring_enter(uring_impl_t* u, unsigned to_submit, unsigned min_complete,
+		unsigned flags, void* arg, size_t argsz) {
+	return syscall(__NR_io_uring_enter, u->ring_fd, to_submit, min_complete,
+			flags, arg, argsz);
+}
+
+static void uring_submit(uring_impl_t* u) {
+	while (u->to_submit > 0) {
+		int n = uring_enter(u, u->to_submit, 0, 0, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			perror_die("io_uring_enter");
+		}
+		u->to_submit -= n;
+	}
+}
+
+static struct io_uring_sqe* uring_get_sqe(uring_impl_t* u) {
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+		/* SQ full: hand what we have to the kernel first */
+		uring_submit(u);
+	}
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe* sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	return sqe;
+}
+
+static uint32_t uring_poll_mask(uint32_t events) {
+	return ((events & EV_READ) ? POLLIN : 0) | ((events & EV_WRITE) ? POLLOUT : 0);
+}
+
+static void uring_arm(uring_impl_t* u, uring_reg_t* reg) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = reg->fd;
+	sqe->poll32_events = uring_poll_mask(reg->events);
+	sqe->user_data = (uintptr_t)reg;
+	reg->armed = true;
+}
+
+static void* uring_create(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof p);
+	int ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_fd < 0) {
+		perror("io_uring_setup");
+		return NULL;
+	}
+
+	uring_impl_t* u = xmalloc(sizeof *u);
+	memset(u, 0, sizeof *u);
+	u->ring_fd = ring_fd;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len) {
+			u->sq_len = u->cq_len;
+		}
+		u->cq_len = u->sq_len;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		perror_die("io_uring mmap sq");
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			perror_die("io_uring mmap cq");
+		}
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		perror_die("io_uring mmap sqes");
+	}
+
+	char* sq = u->sq_ptr;
+	u->sq_head = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	char* cq = u->cq_ptr;
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return u;
+}
+
+static void uring_add(void* impl, int fd, uint32_t events, void* data) {
+	uring_impl_t* u = impl;
+	u->regs = grow_fd_table(u->regs, &u->regcap, fd, sizeof(uring_reg_t*));
+	uring_reg_t* reg = xmalloc(sizeof *reg);
+	memset(reg, 0, sizeof *reg);
+	reg->fd = fd;
+	reg->events = events;
+	reg->data = data;
+	u->regs[fd] = reg;
+	uring_arm(u, reg);
+}
+
+static void uring_mod(void* impl, int fd, uint32_t events, void* data) {
+	uring_impl_t* u = impl;
+	uring_reg_t* reg = u->regs[fd];
+	reg->data = data;
+	if (reg->events == events) {
+		return;
+	}
+	reg->events = events;
+	if (reg->armed) {
+		/* change the mask of the pending poll in place; if it already
+		 * completed the update fails and the re-arm uses the new mask
+		 */
+		struct io_uring_sqe* sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)reg;
+		sqe->len = IORING_POLL_UPDATE_EVENTS;
+		sqe->poll32_events = uring_poll_mask(events);
+		sqe->user_data = 0;
+	}
+	/* otherwise it is queued and gets armed before the next wait */
+}
+
+static void uring_del(void* impl, int fd) {
+	uring_impl_t* u = impl;
+	uring_reg_t* reg = u->regs[fd];
+	u->regs[fd] = NULL;
+	reg->deleted = true;
+	if (reg->armed) {
+		/* freed when the cancelled poll completes */
+		struct io_uring_sqe* sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)reg;
+		sqe->user_data = 0;
+		/* the cancellation must reach the kernel before the fd is closed */
+		uring_submit(u);
+	} else if (!reg->queued) {
+		free(reg);
+	}
+	/* queued ones are freed by the re-arm pass */
+}
+
+static int uring_reap(uring_impl_t* u, ev_event_t* events, int maxevents) {
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+	while (head != tail && n < maxevents) {
+		struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+		head++;
+		if (cqe->user_data == 0) {
+			/* completion of an update or removal */
+			continue;
+		}
+		uring_reg_t* reg = (uring_reg_t*)(uintptr_t)cqe->user_data;
+		reg->armed = false;
+		if (reg->deleted) {
+			if (!reg->queued) {
+				free(reg);
+			}
+			continue;
+		}
+		if (!reg->queued) {
+			if (u->nrearm == u->rearmcap) {
+				u->rearmcap = u->rearmcap ? u->rearmcap * 2 : 64;
+				u->rearm = realloc(u->rearm, u->rearmcap * sizeof(uring_reg_t*));
+				if (u->rearm == NULL) {
+					die("eventloop: out of memory");
+				}
+			}
+			u->rearm[u->nrearm++] = reg;
+			reg->queued = true;
+		}
+		if (cqe->res <= 0) {
+			/* cancelled by an update that raced with completion */
+			continue;
+		}
+		uint32_t ev = 0;
+		if (cqe->res & (POLLIN | POLLHUP)) {
+			ev |= EV_READ;
+		}
+		if (cqe->res & POLLOUT) {
+			ev |= EV_WRITE;
+		}
+		if (cqe->res & (POLLERR | POLLNVAL)) {
+			ev |= EV_ERROR;
+		}
+		ev &= reg->events | EV_ERROR;
+		if (ev == 0) {
+			continue;
+		}
+		if (reg->wait_gen == u->wait_gen) {
+			events[reg->out_idx].events |= ev;
+		} else {
+			reg->wait_gen = u->wait_gen;
+			reg->out_idx = n;
+			events[n].data = reg->data;
+			events[n].events = ev;
+			n++;
+		}
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int uring_wait(void* impl, ev_event_t* events, int maxevents, int timeout_ms) {
+	uring_impl_t* u = impl;
+	u->wait_gen++;
+
+	/* re-arm everything that fired last time and is still registered */
+	for (int i = 0; i < u->nrearm; i++) {
+		uring_reg_t* reg = u->rearm[i];
+		reg->queued = false;
+		if (reg->deleted) {
+			free(reg);
+		} else if (!reg->armed) {
+			uring_arm(u, reg);
+		}
+	}
+	u->nrearm = 0;
+
+	if (*u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		/* nothing pending: submit and wait in the same call */
+		unsigned flags = timeout_ms != 0 ? IORING_ENTER_GETEVENTS : 0;
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg arg;
+		void* argp = NULL;
+		size_t argsz = 0;
+		if (timeout_ms > 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			memset(&arg, 0, sizeof arg);
+			arg.ts = (uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof arg;
+		}
+		int rc = uring_enter(u, u->to_submit, timeout_ms != 0 ? 1 : 0,
+				flags, argp, argsz);
+		if (rc < 0) {
+			if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+				perror_die("io_uring_enter");
+			}
+		} else {
+			u->to_submit -= rc;
+		}
+	} else {
+		uring_submit(u);
+	}
+	return uring_reap(u, events, maxevents);
+}
+
+static void uring_destroy(void* impl) {
+	uring_impl_t* u = impl;
+	munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr != u->sq_ptr) {
+		munmap(u->cq_ptr, u->cq_len);
+	}
+	munmap(u->sq_ptr, u->sq_len);
+	close(u->ring_fd);
+	for (int fd = 0; fd < u->regcap; fd++) {
+		free(u->regs[fd]);
+	}
+	free(u->regs);
+	free(u->rearm);
+	free(u);
+}
+
+static const ev_backend_t backends[] = {
+	{"select", select_create, select_add, select_mod, select_del,
+		select_wait, select_destroy},
+	{"poll", poll_create, poll_add, poll_mod, poll_del,
+		poll_wait, poll_destroy},
+	{"epoll", epoll_create_impl, epoll_add_impl, epoll_mod_impl, epoll_del_impl,
+		epoll_wait_impl, epoll_destroy_impl},
+	{"io_uring", uring_create, uring_add, uring_mod, uring_del,
+		uring_wait, uring_destroy},
+};
+
+eventloop_t* eventloop_create(const char* backend) {
+	for (size_t i = 0; i < sizeof backends / sizeof backends[0]; i++) {
+		if (strcmp(backend, backends[i].name) == 0) {
+			void* impl = backends[i].create();
+			if (impl == NULL) {
+				return NULL;
+			}
+			eventloop_t* loop = xmalloc(sizeof *loop);
+			loop->ops = &backends[i];
+			loop->impl = impl;
+			return loop;
+		}
+	}
+	return NULL;
+}
+
+const char* eventloop_backend(eventloop_t* loop) {
+	return loop->ops->name;
+}
+
+void ev_add(eventloop_t* loop, int fd, uint32_t events, void* data) {
+	loop->ops->add(loop->impl, fd, events, data);
+}
+
+void ev_mod(eventloop_t* loop, int fd, uint32_t events, void* data) {
+	loop->ops->mod(loop->impl, fd, events, data);
+}
+
+void ev_del(eventloop_t* loop, int fd) {
+	loop->ops->del(loop->impl, fd);
+}
+
+int ev_wait(eventloop_t* loop, ev_event_t* events, int maxevents, int timeout_ms) {
+	return loop->ops->wait(loop->impl, events, maxevents, timeout_ms);
+}
+
+void eventloop_destroy(eventloop_t* loop) {
+	loop->ops->destroy(loop->impl);
+	free(loop);
+}
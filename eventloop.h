@@ -0,0 +1,57 @@
+/* header file for the pluggable event loop backends */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+
+/* interest and readiness bits */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4	/* reported only: error or hangup on the fd */
+/* ev_add only: of several loops (processes) waiting on the same fd, wake
+ * just one. Honored by epoll (EPOLLEXCLUSIVE), ignored by the others. */
+#define EV_EXCLUSIVE 0x8
+
+/* Backends, picked by name at runtime:
+ *   "select"   - fd_set based, fds must stay below FD_SETSIZE
+ *   "poll"     - compacted pollfd array
+ *   "epoll"    - Linux epoll (default)
+ *   "io_uring" - one-shot IORING_OP_POLL_ADD re-armed on each wait, no liburing
+ * All of them are level triggered.
+ */
+#define EV_BACKENDS "select, poll, epoll, io_uring"
+
+typedef struct eventloop eventloop_t;
+
+/* one ready fd as returned by ev_wait */
+typedef struct {
+	void* data;		/* as given to ev_add/ev_mod */
+	uint32_t events;	/* EV_READ | EV_WRITE | EV_ERROR */
+} ev_event_t;
+
+/* Creates a loop on the named backend. Returns NULL if the name is unknown
+ * or the backend is unavailable on this kernel.
+ */
+eventloop_t* eventloop_create(const char* backend);
+
+/* Name of the backend the loop runs on */
+const char* eventloop_backend(eventloop_t* loop);
+
+/* Registers fd, changes its interest set or removes it. data is handed
+ * back with every event on fd. Dies in case of errors.
+ */
+void ev_add(eventloop_t* loop, int fd, uint32_t events, void* data);
+void ev_mod(eventloop_t* loop, int fd, uint32_t events, void* data);
+void ev_del(eventloop_t* loop, int fd);
+
+/* Waits up to timeout_ms (-1 blocks) for ready fds and stores at most
+ * maxevents of them in events. Returns the number stored, 0 on timeout
+ * or interruption; dies in case of errors.
+ */
+int ev_wait(eventloop_t* loop, ev_event_t* events, int maxevents, int timeout_ms);
+
+/* Closes the backend's resources */
+void eventloop_destroy(eventloop_t* loop);
+
+#endif /* EVENTLOOP_H */
@@ -0,0 +1,71 @@
+/* Binary framing mode */
+/* varint length headers, payloads transformed a run at a time */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "framing.h"
+
+int varint_put(uint8_t* buf, uint32_t v) {
+	int n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = (uint8_t)v;
+	return n;
+}
+
+int varint_get(const uint8_t* buf, size_t len, uint32_t* v) {
+	uint32_t val = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (i * 7 < 32) {
+			val |= (uint32_t)(buf[i] & 0x7f) << (i * 7);
+		}
+		if (!(buf[i] & 0x80)) {
+			*v = val;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+int binframe_transform(binframe_t* f, const uint8_t* in, uint8_t* out, int n) {
+	int frames = 0;
+	int i = 0;
+	while (i < n) {
+		if (f->in_payload) {
+			/* the bulk of the stream: a tight loop the compiler vectorizes */
+			int run = (uint32_t)(n - i) < f->left ? n - i : (int)f->left;
+			for (int j = 0; j < run; j++) {
+				out[i + j] = in[i + j] + 1;
+			}
+			i += run;
+			f->left -= run;
+			if (f->left == 0) {
+				f->in_payload = false;
+				frames++;
+			}
+			continue;
+		}
+
+		uint8_t b = in[i];
+		out[i++] = b;
+		if (f->shift < 32) {
+			f->left |= (uint32_t)(b & 0x7f) << f->shift;
+			f->shift += 7;
+		}
+		if (b & 0x80) {
+			continue;
+		}
+		/* header done; an empty frame completes right here */
+		f->shift = 0;
+		if (f->left > 0) {
+			f->in_payload = true;
+		} else {
+			frames++;
+		}
+	}
+	return frames;
+}
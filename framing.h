@@ -0,0 +1,52 @@
+/* header file for the binary framing mode */
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Right after the '*' ack a client may send this byte instead of text.
+ * The server echoes it, and from then on both directions carry binary
+ * frames: the payload length as a varint (LEB128), then the raw payload.
+ * Replies are framed the same way, with every payload byte incremented, so
+ * a reply is exactly as long as its request. UDP datagrams opt in by
+ * starting with this byte.
+ */
+#define BINARY_HELLO '#'
+
+/* Largest datagram udp-server takes in one receive without GRO; bigger
+ * ones are truncated, so clients keep their datagrams within it
+ */
+#define UDP_DGRAM_MAX 2048
+
+/* bytes of the longest varint, enough for a 32-bit length */
+#define VARINT_MAX_LEN 5
+
+/* where a binary stream stands between chunks; zeroed at the start */
+typedef struct {
+	uint32_t left;		/* header: the length so far; payload: bytes to go */
+	uint8_t shift;		/* header: length bits parsed so far */
+	bool in_payload;
+} binframe_t;
+
+/* Encodes v at buf, which needs VARINT_MAX_LEN bytes of room. Returns the
+ * number of bytes written.
+ */
+int varint_put(uint8_t* buf, uint32_t v);
+
+/* Decodes the varint at buf into v. Returns the number of bytes it took,
+ * or 0 if it does not end within len bytes.
+ */
+int varint_get(const uint8_t* buf, size_t len, uint32_t* v);
+
+/* Runs n bytes of a binary stream through the reply transform into out,
+ * which may be in itself: headers are copied and payload bytes
+ * incremented, a payload at a time with no delimiters to look for, so out
+ * gets exactly n bytes. Length bits past 32 are ignored. Returns the
+ * number of frames completed.
+ */
+int binframe_transform(binframe_t* f, const uint8_t* in, uint8_t* out, int n);
+
+#endif /* FRAMING_H */
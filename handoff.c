@@ -0,0 +1,79 @@
+/* Hand-off rings between event loop threads */
+/* SPSC ring of accepted connections plus an eventfd doorbell */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "handoff.h"
+
+#define CACHELINE 64
+
+/* head and tail are free running counters */
+struct handoff {
+	_Alignas(CACHELINE) _Atomic uint32_t head;	/* written by producer */
+	_Alignas(CACHELINE) _Atomic uint32_t tail;	/* written by consumer */
+	_Alignas(CACHELINE) int efd;
+	handoff_msg_t slot[HANDOFF_SLOTS];
+};
+
+handoff_t* handoff_create(void) {
+	handoff_t* h;
+	if (posix_memalign((void**)&h, CACHELINE, sizeof(handoff_t)) != 0) {
+		die("out of memory for hand-off ring");
+	}
+	atomic_init(&h->head, 0);
+	atomic_init(&h->tail, 0);
+	h->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (h->efd < 0) {
+		perror_die("handoff: eventfd");
+	}
+	return h;
+}
+
+bool handoff_push(handoff_t* h, const handoff_msg_t* msg) {
+	uint32_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+	if (head - tail == HANDOFF_SLOTS) {
+		return false;
+	}
+	h->slot[head & (HANDOFF_SLOTS - 1)] = *msg;
+	atomic_store_explicit(&h->head, head + 1, memory_order_release);
+	return true;
+}
+
+void handoff_ring(handoff_t* h) {
+	uint64_t one = 1;
+	if (write(h->efd, &one, sizeof one) < 0 && errno != EAGAIN) {
+		perror_die("handoff: eventfd write");
+	}
+}
+
+int handoff_fd(handoff_t* h) {
+	return h->efd;
+}
+
+void handoff_clear(handoff_t* h) {
+	uint64_t cnt;
+	if (read(h->efd, &cnt, sizeof cnt) < 0 && errno != EAGAIN) {
+		perror_die("handoff: eventfd read");
+	}
+}
+
+bool handoff_pop(handoff_t* h, handoff_msg_t* msg) {
+	uint32_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	*msg = h->slot[tail & (HANDOFF_SLOTS - 1)];
+	atomic_store_explicit(&h->tail, tail + 1, memory_order_release);
+	return true;
+}
@@ -0,0 +1,52 @@
+/* header file for handing connections between event loop threads */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "shmring.h"
+#include "protocol.h"
+
+/* Slots per hand-off ring (power of two) */
+#define HANDOFF_SLOTS 1024
+
+/* a connection accepted or served by one thread, to be served by another */
+typedef struct {
+	int fd;
+	shm_chan_t* shm;	/* non-NULL for shm peers; fd is its eventfd */
+	socklen_t addr_len;	/* 0 when there is no INET address */
+	struct sockaddr_storage addr;
+	int64_t accept_ns;	/* LAT_NOW() at accept, for the latency trace */
+	peer_state_t* moved;	/* from peer_detach for a live peer, else NULL */
+	int to;			/* for moved peers: the destination loop */
+} handoff_msg_t;
+
+/* A single-producer single-consumer ring of handoff_msg_t with an eventfd
+ * doorbell the consumer registers in its event loop. The producer pushes
+ * any number of messages and rings once; the consumer clears the doorbell
+ * before popping, so a push racing with the drain rings it again.
+ */
+typedef struct handoff handoff_t;
+
+/* Creates an empty ring; dies in case of errors */
+handoff_t* handoff_create(void);
+
+/* Producer: copies msg into the ring. Returns false if it is full. */
+bool handoff_push(handoff_t* h, const handoff_msg_t* msg);
+
+/* Producer: wakes the consumer after one or more pushes */
+void handoff_ring(handoff_t* h);
+
+/* Consumer: the doorbell fd, readable while a ring is pending */
+int handoff_fd(handoff_t* h);
+
+/* Consumer: resets the doorbell; call before draining with handoff_pop */
+void handoff_clear(handoff_t* h);
+
+/* Consumer: takes the oldest message. Returns false if the ring is empty. */
+bool handoff_pop(handoff_t* h, handoff_msg_t* msg);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,72 @@
+/* Log-linear histograms */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+static uint64_t load(const _Atomic uint64_t* c) {
+	return atomic_load_explicit((_Atomic uint64_t*)c, memory_order_relaxed);
+}
+
+static uint64_t bucket_low(int b) {
+	if (b < HIST_SUB) {
+		return (uint64_t)b;
+	}
+	int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + (b & (HIST_SUB - 1))) << (e - HIST_SUB_BITS);
+}
+
+void hist_merge(hist_t* into, const hist_t* from) {
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		uint64_t c = load(&from->count[b]);
+		if (c != 0) {
+			hist_bump(&into->count[b], c);
+		}
+	}
+	hist_bump(&into->n, load(&from->n));
+	hist_bump(&into->sum, load(&from->sum));
+	if (load(&from->max) > load(&into->max)) {
+		atomic_store_explicit(&into->max, load(&from->max), memory_order_relaxed);
+	}
+}
+
+uint64_t hist_percentile(const hist_t* h, double p) {
+	uint64_t n = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		n += load(&h->count[b]);
+	}
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(p / 100.0 * (double)n + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += load(&h->count[b]);
+		if (seen >= rank) {
+			return bucket_low(b);
+		}
+	}
+	return load(&h->max);
+}
+
+void hist_print(FILE* out, const char* name, const hist_t* h,
+		double scale, const char* unit) {
+	uint64_t n = load(&h->n);
+	if (n == 0) {
+		fprintf(out, "%-12s n=0\n", name);
+		return;
+	}
+	fprintf(out, "%-12s n=%-8lu mean=%.1f%s p50=%.1f%s p90=%.1f%s "
+			"p99=%.1f%s p99.9=%.1f%s max=%.1f%s\n", name,
+			(unsigned long)n,
+			(double)load(&h->sum) / (double)n / scale, unit,
+			hist_percentile(h, 50) / scale, unit,
+			hist_percentile(h, 90) / scale, unit,
+			hist_percentile(h, 99) / scale, unit,
+			hist_percentile(h, 99.9) / scale, unit,
+			load(&h->max) / scale, unit);
+}
@@ -0,0 +1,63 @@
+/* header file for log-linear histograms */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Each power of two is split into 2^HIST_SUB_BITS linear buckets, so a
+ * recorded value is known to within 12.5% over the whole uint64 range.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* One writer thread records, any thread may read or merge it while it
+ * does: the counters are atomics updated with plain relaxed stores.
+ */
+typedef struct {
+	_Atomic uint64_t count[HIST_BUCKETS];
+	_Atomic uint64_t n;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+} hist_t;
+
+static inline int hist_bucket(uint64_t v) {
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		(int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_bump(_Atomic uint64_t* c, uint64_t by) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + by,
+			memory_order_relaxed);
+}
+
+/* Records v; only the owning thread may call this */
+static inline void hist_record(hist_t* h, uint64_t v) {
+	hist_bump(&h->count[hist_bucket(v)], 1);
+	hist_bump(&h->n, 1);
+	hist_bump(&h->sum, v);
+	if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+	}
+}
+
+/* Adds the counts of from into into; into must be private to the caller */
+void hist_merge(hist_t* into, const hist_t* from);
+
+/* Lower bound of the bucket holding the p-th percentile (0 < p <= 100) */
+uint64_t hist_percentile(const hist_t* h, double p);
+
+/* Prints "name: n, mean, p50, p90, p99, p99.9, max" with values divided
+ * by scale and suffixed with unit
+ */
+void hist_print(FILE* out, const char* name, const hist_t* h,
+		double scale, const char* unit);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,282 @@
+/* In-process server benchmark
+ * drives the servers' connection handling over socketpair(AF_UNIX)
+ * endpoints, with no listener and no TCP stack, and reports CPU per frame
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sockutils.h"
+#include "serve.h"
+#include "threadpool.h"
+#include "protocol.h"
+#include "eventloop.h"
+
+#define MAXEVENTS 1024
+
+typedef struct {
+	int fd;			/* client end of the socketpair */
+	int depth;		/* frames in flight */
+	long n_frames;
+	int frame_len;
+	long frames_done;
+} driver_t;
+
+static atomic_long server_cpu_ns;	/* CPU of the threads serving */
+
+static int64_t clock_ns(clockid_t clk) {
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* drive_connection(void* arg) {
+/* the pipelined stream of clients.c: wait for '*', keep up to depth
+ * '^payload$' frames in flight, check every reply byte, then hang up
+ */
+	driver_t* d = arg;
+	char c;
+	if (recv(d->fd, &c, 1, 0) != 1 || c != '*') {
+		die("driver: no ack");
+	}
+
+	int len = d->frame_len;
+	char* payload = xmalloc(len);
+	for (int i = 0; i < len; i++) {
+		payload[i] = 'a' + i % 25;
+	}
+	char* batch = xmalloc((size_t)d->depth * (len + 2));
+	char buf[4096];
+	long sent = 0, done = 0;
+	int got = 0;
+
+	while (done < d->n_frames) {
+		int k = 0;
+		while (sent < d->n_frames && sent - done < d->depth) {
+			char* f = &batch[(size_t)k++ * (len + 2)];
+			f[0] = '^';
+			memcpy(f + 1, payload, len);
+			f[len + 1] = '$';
+			sent++;
+		}
+		if (k > 0 && send_all(d->fd, batch, (size_t)k * (len + 2)) < 0) {
+			perror_die("driver: send");
+		}
+		int n = recv(d->fd, buf, sizeof buf, 0);
+		if (n <= 0) {
+			die("driver: server closed after %ld frames", done);
+		}
+		for (int i = 0; i < n; i++) {
+			if (buf[i] != payload[got] + 1) {
+				die("driver: bad reply byte in frame %ld", done);
+			}
+			if (++got == len) {
+				done++;
+				got = 0;
+			}
+		}
+	}
+	d->frames_done = done;
+	shutdown(d->fd, SHUT_WR);
+	/* wait for the server side to close */
+	while (recv(d->fd, buf, sizeof buf, 0) > 0)
+		;
+	close(d->fd);
+	free(payload);
+	free(batch);
+	return NULL;
+}
+
+/* ---- the servers' connection handling ---- */
+
+static void run_sequential(int* fds, int n) {
+/* sequential-server: one connection after the other on this thread */
+	int64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	for (int i = 0; i < n; i++) {
+		serve_connection(fds[i], 0);
+	}
+	atomic_fetch_add(&server_cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+}
+
+static void pool_job(void* arg) {
+	int fd = (int)(intptr_t)arg;
+	int64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	serve_connection(fd, 0);
+	atomic_fetch_add(&server_cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+}
+
+static void run_threadpool(int* fds, int n, int nthreads) {
+/* threadpool-server: a blocking job per connection */
+	tpool_t tp = tpool_create(nthreads);
+	if (tp == NULL) {
+		die("threadpool creation failed");
+	}
+	for (int i = 0; i < n; i++) {
+		tpool_dispatch(tp, pool_job, (void*)(intptr_t)fds[i]);
+	}
+	tpool_wait_all(tp);
+	tpool_destroy(tp);
+}
+
+static void run_event(int* fds, int n, const char* backend) {
+/* epoll-server: the protocol.c handlers on one event loop thread */
+	int64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	eventloop_t* loop = eventloop_create(backend);
+	if (loop == NULL) {
+		die("event loop backend '%s' unavailable", backend);
+	}
+	for (int i = 0; i < n; i++) {
+		make_socket_non_blocking(fds[i]);
+		peer_state_t* peer = peer_create(fds[i], NULL);
+		fd_status_t status = on_peer_connected(peer, NULL, 0);
+		ev_add(loop, fds[i], (status.want_read ? EV_READ : 0) |
+				(status.want_write ? EV_WRITE : 0), peer);
+	}
+
+	ev_event_t events[MAXEVENTS];
+	int live = n;
+	while (live > 0) {
+		int nready = ev_wait(loop, events, MAXEVENTS, -1);
+		for (int i = 0; i < nready; i++) {
+			peer_state_t* peer = events[i].data;
+			fd_status_t status;
+			if (events[i].events & EV_ERROR) {
+				status = fd_status_NORW;
+			} else if (events[i].events & EV_READ) {
+				status = on_peer_ready_recv(peer);
+			} else {
+				status = on_peer_ready_send(peer);
+			}
+			if (!status.want_read && !status.want_write) {
+				ev_del(loop, peer->fd);
+				peer_destroy(peer);
+				live--;
+			} else {
+				ev_mod(loop, peer->fd, (status.want_read ? EV_READ : 0) |
+						(status.want_write ? EV_WRITE : 0), peer);
+			}
+		}
+	}
+	eventloop_destroy(loop);
+	atomic_fetch_add(&server_cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+}
+
+static int run_mode(const char* mode, int nconns, driver_t* proto,
+		int nthreads, const char* backend) {
+/* one benchmark pass; returns 0 if every frame came back right */
+	int* server_fds = xmalloc(nconns * sizeof(int));
+	driver_t* drivers = xmalloc(nconns * sizeof(driver_t));
+	pthread_t* threads = xmalloc(nconns * sizeof(pthread_t));
+	for (int i = 0; i < nconns; i++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror_die("socketpair");
+		}
+		server_fds[i] = sv[0];
+		drivers[i] = *proto;
+		drivers[i].fd = sv[1];
+	}
+
+	atomic_store(&server_cpu_ns, 0);
+	int64_t wall = clock_ns(CLOCK_MONOTONIC);
+	int64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	for (int i = 0; i < nconns; i++) {
+		if (pthread_create(&threads[i], NULL, drive_connection, &drivers[i])) {
+			die("driver thread creation error");
+		}
+	}
+
+	if (strcmp(mode, "sequential") == 0) {
+		run_sequential(server_fds, nconns);
+	} else if (strcmp(mode, "threadpool") == 0) {
+		run_threadpool(server_fds, nconns, nthreads);
+	} else {
+		run_event(server_fds, nconns, backend);
+	}
+
+	long frames = 0;
+	for (int i = 0; i < nconns; i++) {
+		pthread_join(threads[i], NULL);
+		frames += drivers[i].frames_done;
+	}
+	wall = clock_ns(CLOCK_MONOTONIC) - wall;
+	cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+	long want = (long)nconns * proto->n_frames;
+	printf("%-11s %8ld frames %9.0f frames/s  server %7.0f ns/frame  "
+			"process %7.0f ns/frame\n", mode, frames, frames / (wall / 1e9),
+			(double)atomic_load(&server_cpu_ns) / frames, (double)cpu / frames);
+
+	free(server_fds);
+	free(drivers);
+	free(threads);
+	return frames == want ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	char* mode = "all";
+	char* backend = "epoll";
+	int nconns = 4, nthreads = 4;
+	driver_t proto = { .depth = 8, .n_frames = 20000, .frame_len = 32 };
+	int opt;
+	while ((opt = getopt(argc, argv, "m:B:n:t:P:f:l:")) != -1) {
+		switch (opt) {
+			case 'm':
+				mode = optarg;
+				break;
+			case 'B':
+				backend = optarg;
+				break;
+			case 'n':
+				nconns = atoi(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'P':
+				proto.depth = atoi(optarg);
+				break;
+			case 'f':
+				proto.n_frames = atol(optarg);
+				break;
+			case 'l':
+				proto.frame_len = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s "
+						"[-m sequential|threadpool|event|all] "
+						"[-B backend] [-n connections] [-t pool_threads] "
+						"[-P depth] [-f frames] [-l frame_len]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (nconns <= 0 || proto.depth <= 0 || proto.frame_len <= 0) {
+		die("bad arguments");
+	}
+
+	/* server CPU is the serving threads' own time; process CPU adds the
+	 * drivers, which stand in for the clients and the kernel's socket work */
+	printf("%d connections x %ld frames of %d bytes, depth %d\n", nconns,
+			proto.n_frames, proto.frame_len, proto.depth);
+	static const char* modes[] = { "sequential", "threadpool", "event" };
+	int failed = 0;
+	for (size_t i = 0; i < sizeof modes / sizeof *modes; i++) {
+		if (strcmp(mode, "all") == 0 || strcmp(mode, modes[i]) == 0) {
+			failed |= run_mode(modes[i], nconns, &proto, nthreads, backend);
+		}
+	}
+	return failed ? EXIT_FAILURE : 0;
+}
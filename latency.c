@@ -0,0 +1,112 @@
+/* Per-frame latency tracing */
+/* sampled timestamps into per-thread histograms, merged on demand */
+
+#include "latency.h"
+
+#ifdef LATENCY_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "sockutils.h"
+#include "histogram.h"
+
+static const char* stage_names[LAT_NSTAGES] = {
+	"accept", "recv", "queue", "send", "total",
+};
+
+/* a thread's histograms; registered on first use and kept after the
+ * thread exits, so its samples stay in the dumps */
+typedef struct lat_set {
+	hist_t stage[LAT_NSTAGES];
+	struct lat_set* next;
+} lat_set_t;
+
+_Thread_local unsigned lat_tick;
+static _Thread_local lat_set_t* local_set;
+
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+static lat_set_t* sets;
+
+int64_t lat_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static lat_set_t* get_set(void) {
+	if (local_set == NULL) {
+		local_set = calloc(1, sizeof(lat_set_t));
+		if (local_set == NULL) {
+			die("out of memory for latency histograms");
+		}
+		pthread_mutex_lock(&sets_lock);
+		local_set->next = sets;
+		sets = local_set;
+		pthread_mutex_unlock(&sets_lock);
+	}
+	return local_set;
+}
+
+void lat_frame_done(lat_frame_t* f, int64_t sent) {
+	lat_set_t* set = get_set();
+	hist_record(&set->stage[LAT_RECV], f->end - f->start);
+	hist_record(&set->stage[LAT_QUEUE], f->queued - f->end);
+	hist_record(&set->stage[LAT_SEND], sent - f->queued);
+	hist_record(&set->stage[LAT_TOTAL], sent - f->start);
+	f->start = f->end = f->queued = 0;
+}
+
+void lat_accept_done(int64_t accept_ns) {
+	hist_record(&get_set()->stage[LAT_ACCEPT], lat_now() - accept_ns);
+}
+
+void lat_dump(FILE* out) {
+	lat_set_t* merged = calloc(1, sizeof(lat_set_t));
+	if (merged == NULL) {
+		return;
+	}
+	int nthreads = 0;
+	pthread_mutex_lock(&sets_lock);
+	for (lat_set_t* s = sets; s != NULL; s = s->next, nthreads++) {
+		for (int i = 0; i < LAT_NSTAGES; i++) {
+			hist_merge(&merged->stage[i], &s->stage[i]);
+		}
+	}
+	pthread_mutex_unlock(&sets_lock);
+
+	fprintf(out, "latency (1 in %d frames, %d threads):\n",
+			LAT_SAMPLE_EVERY, nthreads);
+	for (int i = 0; i < LAT_NSTAGES; i++) {
+		hist_print(out, stage_names[i], &merged->stage[i], 1000.0, "us");
+	}
+	fflush(out);
+	free(merged);
+}
+
+static void* dump_thread(void* arg) {
+	sigset_t* set = arg;
+	int sig;
+	while (sigwait(set, &sig) == 0) {
+		lat_dump(stdout);
+	}
+	return NULL;
+}
+
+void lat_init(void) {
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, dump_thread, &set)) {
+		die("latency dump thread");
+	}
+	pthread_detach(tid);
+}
+
+#endif /* LATENCY_TRACE */
@@ -0,0 +1,97 @@
+/* header file for per-frame latency tracing */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Stages a frame goes through, each recorded into its own histogram:
+ *   LAT_ACCEPT  accept() returned -> '*' ack sent: time spent waiting for a
+ *               thread, a pool worker, the event loop or, in acceptor mode, the
+ *               reactor it is handed to, to pick the peer up
+ *   LAT_RECV    '^' seen -> '$' seen: the frame trickling in
+ *   LAT_QUEUE   '$' seen -> reply queued for sending
+ *   LAT_SEND    reply queued -> reply fully sent
+ *   LAT_TOTAL   '^' seen -> reply fully sent
+ */
+enum { LAT_ACCEPT, LAT_RECV, LAT_QUEUE, LAT_SEND, LAT_TOTAL, LAT_NSTAGES };
+
+/* one frame in flight per connection is traced */
+typedef struct {
+	int64_t start;		/* '^', or accept() until the ack is out */
+	int64_t end;		/* '$' */
+	int64_t queued;
+} lat_frame_t;
+
+#ifdef LATENCY_TRACE
+
+/* trace one frame in this many per thread; a power of two */
+#ifndef LAT_SAMPLE_EVERY
+#define LAT_SAMPLE_EVERY 64
+#endif
+
+extern _Thread_local unsigned lat_tick;
+
+int64_t lat_now(void);
+
+/* Records the stages of a finished frame into the calling thread's
+ * histograms and resets f
+ */
+void lat_frame_done(lat_frame_t* f, int64_t sent);
+
+/* Records the accept stage of a connection accepted at accept_ns */
+void lat_accept_done(int64_t accept_ns);
+
+/* Makes SIGUSR1 dump the merged histograms to stdout. Blocks SIGUSR1 in the
+ * caller, so call it from main before starting other threads.
+ */
+void lat_init(void);
+
+/* Merges the histograms of every thread and prints them */
+void lat_dump(FILE* out);
+
+#define LAT_NOW() lat_now()
+#define LAT_FRAME_START(f) do { \
+		if ((f)->start == 0 && (++lat_tick & (LAT_SAMPLE_EVERY - 1)) == 0) \
+			(f)->start = lat_now(); \
+	} while (0)
+#define LAT_FRAME_END(f) do { \
+		if ((f)->start != 0 && (f)->end == 0) \
+			(f)->end = lat_now(); \
+	} while (0)
+#define LAT_FRAME_QUEUED(f) do { \
+		if ((f)->end != 0 && (f)->queued == 0) \
+			(f)->queued = lat_now(); \
+	} while (0)
+#define LAT_FRAME_SENT(f) do { \
+		if ((f)->queued != 0) \
+			lat_frame_done((f), lat_now()); \
+	} while (0)
+#define LAT_ACCEPTED(accept_ns) lat_accept_done(accept_ns)
+/* for servers that send the ack later: keep the accept time in f */
+#define LAT_ACK_PENDING(f) ((f)->start = lat_now())
+/* the same for a connection accepted earlier, at accept_ns, by another thread */
+#define LAT_ACK_PENDING_SINCE(f, accept_ns) ((f)->start = (accept_ns))
+#define LAT_ACK_SENT(f) do { \
+		lat_accept_done((f)->start); \
+		(f)->start = 0; \
+	} while (0)
+
+#else /* !LATENCY_TRACE: everything compiles away */
+
+#define LAT_NOW() ((int64_t)0)
+#define LAT_FRAME_START(f) ((void)0)
+#define LAT_FRAME_END(f) ((void)0)
+#define LAT_FRAME_QUEUED(f) ((void)0)
+#define LAT_FRAME_SENT(f) ((void)0)
+#define LAT_ACCEPTED(accept_ns) ((void)0)
+#define LAT_ACK_PENDING(f) ((void)0)
+#define LAT_ACK_PENDING_SINCE(f, accept_ns) ((void)0)
+#define LAT_ACK_SENT(f) ((void)0)
+#define lat_init() ((void)0)
+#define lat_dump(out) ((void)0)
+
+#endif /* LATENCY_TRACE */
+
+#endif /* LATENCY_H */
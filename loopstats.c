@@ -0,0 +1,109 @@
+/* Event loop health metrics */
+/* wait time, events per wakeup, handler time, slowest calls and stalls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sockutils.h"
+#include "eventloop.h"
+#include "loopstats.h"
+
+loopstats_t* loopstats_create(int64_t stall_ns) {
+	loopstats_t* ls = calloc(1, sizeof(loopstats_t));
+	if (ls == NULL) {
+		die("out of memory for loop stats");
+	}
+	ls->stall_ns = stall_ns;
+	ls->started_ns = loopstats_now();
+	return ls;
+}
+
+int64_t loopstats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void loopstats_wait(loopstats_t* ls) {
+	ls->wait_start = loopstats_now();
+	if (ls->wake != 0) {
+		int64_t busy = ls->wait_start - ls->wake;
+		hist_record(&ls->busy_ns, busy);
+		ls->total_busy_ns += busy;
+	}
+}
+
+void loopstats_woke(loopstats_t* ls, int nevents) {
+	ls->wake = loopstats_now();
+	int64_t waited = ls->wake - ls->wait_start;
+	hist_record(&ls->wait_ns, waited);
+	hist_record(&ls->nevents, nevents);
+	ls->total_wait_ns += waited;
+}
+
+void loopstats_handled(loopstats_t* ls, int fd, uint32_t events, int64_t start_ns) {
+	int64_t took = loopstats_now() - start_ns;
+	hist_record(&ls->handler_ns, took);
+	loop_call_t call = { start_ns, took, fd, events };
+
+	/* replace the fastest of the slowest calls */
+	int min = 0;
+	for (int i = 1; i < LOOP_TOP_SLOW; i++) {
+		if (ls->slowest[i].took_ns < ls->slowest[min].took_ns) {
+			min = i;
+		}
+	}
+	if (took > ls->slowest[min].took_ns) {
+		ls->slowest[min] = call;
+	}
+
+	if (took >= ls->stall_ns) {
+		ls->stalls[ls->nstalls++ % LOOP_STALL_LOG] = call;
+	}
+}
+
+static void print_call(FILE* out, loopstats_t* ls, const loop_call_t* c) {
+	fprintf(out, "  fd %-6d %s%s%s %10.1fus at +%.3fs\n", c->fd,
+			c->events & EV_READ ? "R" : "-",
+			c->events & EV_WRITE ? "W" : "-",
+			c->events & EV_ERROR ? "E" : "-",
+			c->took_ns / 1000.0,
+			(c->at_ns - ls->started_ns) / 1e9);
+}
+
+static int by_took_desc(const void* a, const void* b) {
+	int64_t x = ((const loop_call_t*)a)->took_ns, y = ((const loop_call_t*)b)->took_ns;
+	return (x < y) - (x > y);
+}
+
+void loopstats_print(loopstats_t* ls, FILE* out) {
+	int64_t total = ls->total_wait_ns + ls->total_busy_ns;
+	fprintf(out, "event loop: %.1f%% busy over %.3fs\n",
+			total ? 100.0 * ls->total_busy_ns / total : 0.0, total / 1e9);
+	hist_print(out, "wait", &ls->wait_ns, 1000.0, "us");
+	hist_print(out, "busy", &ls->busy_ns, 1000.0, "us");
+	hist_print(out, "handler", &ls->handler_ns, 1000.0, "us");
+	hist_print(out, "events", &ls->nevents, 1.0, "");
+
+	loop_call_t top[LOOP_TOP_SLOW];
+	int ntop = 0;
+	for (int i = 0; i < LOOP_TOP_SLOW; i++) {
+		if (ls->slowest[i].took_ns > 0) {
+			top[ntop++] = ls->slowest[i];
+		}
+	}
+	qsort(top, ntop, sizeof top[0], by_took_desc);
+	fprintf(out, "slowest handler calls:\n");
+	for (int i = 0; i < ntop; i++) {
+		print_call(out, ls, &top[i]);
+	}
+
+	fprintf(out, "stalls >= %.1fus: %lu\n", ls->stall_ns / 1000.0,
+			(unsigned long)ls->nstalls);
+	uint64_t first = ls->nstalls > LOOP_STALL_LOG ? ls->nstalls - LOOP_STALL_LOG : 0;
+	for (uint64_t i = first; i < ls->nstalls; i++) {
+		print_call(out, ls, &ls->stalls[i % LOOP_STALL_LOG]);
+	}
+	fflush(out);
+}
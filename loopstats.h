@@ -0,0 +1,60 @@
+/* header file for event loop health metrics */
+
+#ifndef LOOPSTATS_H
+#define LOOPSTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+/* slowest handler calls kept, and stalls remembered, per loop */
+#define LOOP_TOP_SLOW 8
+#define LOOP_STALL_LOG 32
+
+/* one handler call */
+typedef struct {
+	int64_t at_ns;		/* when the call started */
+	int64_t took_ns;
+	int fd;
+	uint32_t events;	/* EV_* bits it was called for */
+} loop_call_t;
+
+/* Per-iteration measurements of one event loop thread. A loop that spends
+ * most of its time in handlers rather than blocked in the wait is CPU
+ * bound and needs sharding.
+ */
+typedef struct {
+	hist_t wait_ns;		/* time blocked in ev_wait */
+	hist_t nevents;		/* events per wakeup */
+	hist_t handler_ns;	/* time per handler call */
+	hist_t busy_ns;		/* wakeup to next wait: handlers and loop overhead */
+	int64_t stall_ns;	/* handler calls at least this long are logged */
+
+	int64_t started_ns;
+	int64_t total_wait_ns;
+	int64_t total_busy_ns;
+	int64_t wait_start;	/* set by loopstats_wait */
+	int64_t wake;		/* set by loopstats_woke */
+
+	loop_call_t slowest[LOOP_TOP_SLOW];	/* unordered */
+	loop_call_t stalls[LOOP_STALL_LOG];	/* ring, most recent last */
+	uint64_t nstalls;
+} loopstats_t;
+
+/* Allocates zeroed stats logging handler calls of stall_ns or more */
+loopstats_t* loopstats_create(int64_t stall_ns);
+
+int64_t loopstats_now(void);
+
+/* Brackets the wait: call right before and right after ev_wait */
+void loopstats_wait(loopstats_t* ls);
+void loopstats_woke(loopstats_t* ls, int nevents);
+
+/* Records a handler call on fd that started at start_ns */
+void loopstats_handled(loopstats_t* ls, int fd, uint32_t events, int64_t start_ns);
+
+/* Prints the histograms, the slowest calls and the stall log */
+void loopstats_print(loopstats_t* ls, FILE* out);
+
+#endif /* LOOPSTATS_H */
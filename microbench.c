@@ -0,0 +1,374 @@
+/* Microbenchmarks for the protocol and threadpool hot paths
+ * ns/op and ns/byte from the clock, cycles, instructions, branch and
+ * cache misses from perf_event_open; results as JSON, optionally compared
+ * against a baseline run
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "sockutils.h"
+#include "protocol.h"
+#include "threadpool.h"
+
+#define INPUT_SIZE (256 * 1024)	/* synthetic stream per transform pass */
+#define CHUNK_SIZE 1024	/* input per transform call, one recv's worth */
+#define MIN_RUN_NS 200000000	/* repeat each benchmark for at least this */
+#define POOL_JOBS 100000	/* jobs per threadpool pass */
+#define POOL_BATCH 64
+#define MAX_RESULTS 64
+
+/* hardware counters; unsupported ones read as -1 */
+enum { PC_CYCLES, PC_INSTRUCTIONS, PC_BRANCH_MISSES, PC_CACHE_MISSES, PC_N };
+static const char* counter_names[PC_N] = {
+	"cycles", "instructions", "branch_misses", "cache_misses",
+};
+static const uint64_t counter_config[PC_N] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES,
+};
+
+typedef struct {
+	int fd[PC_N];
+} counters_t;
+
+typedef struct {
+	char name[64];
+	double ns_per_op;
+	double ns_per_byte;	/* 0 when the benchmark moves no bytes */
+	double per_op[PC_N];	/* counter deltas per op, -1 if unavailable */
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int nresults;
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void counters_open(counters_t* c) {
+/* count user and kernel work of this thread and of threads it starts */
+	for (int i = 0; i < PC_N; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = counter_config[i];
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_hv = 1;
+		c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (c->fd[i] < 0) {
+			/* kernel-side counting may be forbidden: try user only */
+			attr.exclude_kernel = 1;
+			c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+	}
+}
+
+static void counters_start(counters_t* c) {
+	for (int i = 0; i < PC_N; i++) {
+		if (c->fd[i] >= 0) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static void counters_stop(counters_t* c, double ops, double* per_op) {
+	for (int i = 0; i < PC_N; i++) {
+		uint64_t v;
+		per_op[i] = -1;
+		if (c->fd[i] >= 0) {
+			ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(c->fd[i], &v, sizeof v) == sizeof v) {
+				per_op[i] = (double)v / ops;
+			}
+		}
+	}
+}
+
+static void counters_close(counters_t* c) {
+	for (int i = 0; i < PC_N; i++) {
+		if (c->fd[i] >= 0) {
+			close(c->fd[i]);
+		}
+	}
+}
+
+static result_t* new_result(const char* fmt, int a, int b) {
+	if (nresults == MAX_RESULTS) {
+		die("too many benchmarks");
+	}
+	result_t* r = &results[nresults++];
+	snprintf(r->name, sizeof r->name, fmt, a, b);
+	return r;
+}
+
+static void report(const result_t* r) {
+	printf("%-28s %9.2f ns/op", r->name, r->ns_per_op);
+	if (r->ns_per_byte > 0) {
+		printf(" %7.3f ns/B", r->ns_per_byte);
+	}
+	for (int i = 0; i < PC_N; i++) {
+		if (r->per_op[i] >= 0) {
+			printf(" %10.1f %s", r->per_op[i], counter_names[i]);
+		}
+	}
+	printf("\n");
+}
+
+/* ---- framing transform ---- */
+
+/* '^payload$' frames of frame_len bytes, with gap_len bytes outside any
+ * frame after each: the gap sets how dense the delimiters are */
+static uint8_t* make_stream(int frame_len, int gap_len) {
+	uint8_t* buf = xmalloc(INPUT_SIZE);
+	int i = 0;
+	while (i < INPUT_SIZE) {
+		int unit = frame_len + 2 + gap_len;
+		if (i + unit > INPUT_SIZE) {
+			memset(buf + i, '-', INPUT_SIZE - i);
+			break;
+		}
+		buf[i++] = '^';
+		for (int k = 0; k < frame_len; k++) {
+			buf[i++] = 'a' + (k % 26);
+		}
+		buf[i++] = '$';
+		memset(buf + i, '-', gap_len);
+		i += gap_len;
+	}
+	return buf;
+}
+
+/* the in-place loop of serve_connection in the blocking servers */
+static int transform_in_place(ServerState* state, uint8_t* buf, int len) {
+	int outlen = 0;
+	for (int i = 0; i < len; ++i) {
+		switch (*state) {
+			case WAIT_FOR_MSG:
+				if (buf[i] == '^')
+					*state = IN_MSG;
+				break;
+			case IN_MSG:
+				if (buf[i] == '$')
+					*state = WAIT_FOR_MSG;
+				else
+					buf[outlen++] = buf[i] + 1;
+				break;
+			default:
+				break;
+		}
+	}
+	return outlen;
+}
+
+static volatile int sink;
+
+static void bench_transform(counters_t* c, int frame_len, int gap_len) {
+	uint8_t* stream = make_stream(frame_len, gap_len);
+	uint8_t* scratch = xmalloc(CHUNK_SIZE);
+	peer_state_t peer;
+	memset(&peer, 0, sizeof peer);
+	peer.state = WAIT_FOR_MSG;
+
+	/* event servers: recv-sized chunks into the peer's output chain */
+	result_t* r = new_result("event/frame%d/gap%d", frame_len, gap_len);
+	int64_t bytes = 0, start = now_ns();
+	counters_start(c);
+	do {
+		for (int off = 0; off < INPUT_SIZE; off += CHUNK_SIZE) {
+			transform_frames(&peer, stream + off, CHUNK_SIZE);
+			sink = peer_discard_output(&peer);
+		}
+		bytes += INPUT_SIZE;
+	} while (now_ns() - start < MIN_RUN_NS);
+	int64_t took = now_ns() - start;
+	counters_stop(c, (double)bytes / CHUNK_SIZE, r->per_op);
+	r->ns_per_op = (double)took / ((double)bytes / CHUNK_SIZE);
+	r->ns_per_byte = (double)took / bytes;
+	report(r);
+
+	/* blocking servers: transform each recv buffer in place */
+	r = new_result("inplace/frame%d/gap%d", frame_len, gap_len);
+	ServerState state = WAIT_FOR_MSG;
+	bytes = 0;
+	start = now_ns();
+	counters_start(c);
+	do {
+		for (int off = 0; off < INPUT_SIZE; off += CHUNK_SIZE) {
+			memcpy(scratch, stream + off, CHUNK_SIZE);
+			sink = transform_in_place(&state, scratch, CHUNK_SIZE);
+		}
+		bytes += INPUT_SIZE;
+	} while (now_ns() - start < MIN_RUN_NS);
+	took = now_ns() - start;
+	counters_stop(c, (double)bytes / CHUNK_SIZE, r->per_op);
+	r->ns_per_op = (double)took / ((double)bytes / CHUNK_SIZE);
+	r->ns_per_byte = (double)took / bytes;
+	report(r);
+
+	free(scratch);
+	free(stream);
+}
+
+/* ---- threadpool queue ---- */
+
+static atomic_long jobs_run;
+
+static void empty_job(void* arg) {
+	(void)arg;
+	atomic_fetch_add_explicit(&jobs_run, 1, memory_order_relaxed);
+}
+
+static void bench_pool(counters_t* c, int nthreads, int batch) {
+/* dispatch-to-completion cost of empty jobs: queue, wakeups, dequeue */
+	result_t* r = new_result("pool/threads%d/batch%d", nthreads, batch);
+	tpool_task_t tasks[POOL_BATCH];
+	for (int i = 0; i < POOL_BATCH; i++) {
+		tasks[i].routine = empty_job;
+		tasks[i].arg = NULL;
+	}
+
+	/* counters inherit into the workers only if they start afterwards */
+	counters_start(c);
+	tpool_t tp = tpool_create(nthreads);
+	if (tp == NULL) {
+		die("threadpool creation failed");
+	}
+	int64_t ops = 0, start = now_ns();
+	do {
+		for (int i = 0; i < POOL_JOBS; i += batch) {
+			if (batch > 1) {
+				tpool_dispatch_batch(tp, TPOOL_NORMAL, tasks, batch, NULL);
+			} else {
+				tpool_dispatch(tp, empty_job, NULL);
+			}
+		}
+		tpool_wait_all(tp);
+		ops += POOL_JOBS;
+	} while (now_ns() - start < MIN_RUN_NS);
+	int64_t took = now_ns() - start;
+	tpool_destroy(tp);
+	counters_stop(c, (double)ops, r->per_op);
+	r->ns_per_op = (double)took / ops;
+	r->ns_per_byte = 0;
+	report(r);
+}
+
+/* ---- results ---- */
+
+static void write_json(const char* path) {
+/* one object per line, so the baseline reader needs no JSON parser */
+	FILE* f = fopen(path, "w");
+	if (f == NULL) {
+		perror_die("microbench: results file");
+	}
+	fprintf(f, "[\n");
+	for (int i = 0; i < nresults; i++) {
+		result_t* r = &results[i];
+		fprintf(f, "{\"name\": \"%s\", \"ns_per_op\": %.3f, \"ns_per_byte\": %.4f",
+				r->name, r->ns_per_op, r->ns_per_byte);
+		for (int k = 0; k < PC_N; k++) {
+			if (r->per_op[k] >= 0) {
+				fprintf(f, ", \"%s\": %.2f", counter_names[k], r->per_op[k]);
+			} else {
+				fprintf(f, ", \"%s\": null", counter_names[k]);
+			}
+		}
+		fprintf(f, "}%s\n", i + 1 < nresults ? "," : "");
+	}
+	fprintf(f, "]\n");
+	fclose(f);
+	printf("results written to %s\n", path);
+}
+
+static void compare_baseline(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		printf("no baseline at %s\n", path);
+		return;
+	}
+	printf("\nagainst %s (ns/op, + is slower):\n", path);
+	char line[512];
+	while (fgets(line, sizeof line, f) != NULL) {
+		char name[64];
+		double base;
+		if (sscanf(line, "{\"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name, &base) != 2) {
+			continue;
+		}
+		for (int i = 0; i < nresults; i++) {
+			if (strcmp(results[i].name, name) == 0 && base > 0) {
+				double delta = 100.0 * (results[i].ns_per_op - base) / base;
+				printf("%-28s %9.2f -> %9.2f  %+6.1f%%\n", name, base,
+						results[i].ns_per_op, delta);
+			}
+		}
+	}
+	fclose(f);
+}
+
+int main(int argc, char* argv[]) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	char* out = "microbench.json";
+	char* baseline = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "o:b:")) != -1) {
+		switch (opt) {
+			case 'o':
+				out = optarg;
+				break;
+			case 'b':
+				baseline = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-o results.json] "
+						"[-b baseline.json]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	counters_t c;
+	counters_open(&c);
+	if (c.fd[PC_CYCLES] < 0) {
+		printf("perf_event_open unavailable: clock only\n");
+	}
+
+	/* frame size x delimiter density */
+	static const int frame_lens[] = { 8, 64, 512 };
+	static const int gap_lens[] = { 0, 64 };
+	for (size_t i = 0; i < sizeof frame_lens / sizeof *frame_lens; i++) {
+		for (size_t k = 0; k < sizeof gap_lens / sizeof *gap_lens; k++) {
+			bench_transform(&c, frame_lens[i], gap_lens[k]);
+		}
+	}
+
+	static const int threads[] = { 1, 2, 4 };
+	for (size_t i = 0; i < sizeof threads / sizeof *threads; i++) {
+		bench_pool(&c, threads[i], 1);
+		bench_pool(&c, threads[i], POOL_BATCH);
+	}
+
+	counters_close(&c);
+	write_json(out);
+	if (baseline != NULL) {
+		compare_baseline(baseline);
+	}
+	return 0;
+}
@@ -0,0 +1,805 @@
+/* Protocol handlers shared by the event-driven servers */
+/* '*' ack, then '^payload$' or varint-framed binary frames answered with payload+1 */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "shmring.h"
+#include "slab.h"
+#include "framing.h"
+#include "capture.h"
+#include "blob.h"
+#include "protocol.h"
+
+/* objects carved per slab chunk */
+#define PEERS_PER_CHUNK 4096
+#define OUTSEGS_PER_CHUNK 64
+/* bytes taken by one recv */
+#define RECV_CHUNK (16 * 1024)
+/* most bytes of a blob passed to one sendfile */
+#define BLOB_SEND_MAX (1 << 30)
+/* max recv/send rounds for one shm wakeup before yielding to other peers */
+#define SHM_MAX_ROUNDS 16
+
+const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
+const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
+const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
+const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
+
+long shm_spin_ns = SHM_SPIN_NS;
+long zerocopy_min = 0;
+zerocopy_stats_t zerocopy_stats;
+capture_t* peer_capture = NULL;
+
+_Thread_local uint64_t peer_bytes_moved;
+
+/* peer_state_t objects and output segments; every event loop thread has
+ * its own pools, created on first use
+ */
+static _Thread_local slab_t* peer_pool;
+static _Thread_local slab_t* outseg_pool;
+
+static slab_t* get_peer_pool(void) {
+	if (peer_pool == NULL) {
+		peer_pool = slab_create(sizeof(peer_state_t), PEERS_PER_CHUNK);
+	}
+	return peer_pool;
+}
+
+static slab_t* get_outseg_pool(void) {
+	if (outseg_pool == NULL) {
+		outseg_pool = slab_create(OUTSEG_SIZE, OUTSEGS_PER_CHUNK);
+	}
+	return outseg_pool;
+}
+
+/* socket and shm peers share the protocol handlers below */
+static ssize_t peer_recv(peer_state_t* peerstate, void* buf, size_t len) {
+	shm_chan_t* shm = peerstate->shm;
+	ssize_t n = shm ? shm_chan_recv(shm, buf, len) : recv(peerstate->fd, buf, len, 0);
+	if (n > 0) {
+		peer_bytes_moved += n;
+		if (peer_capture != NULL) {
+			capture_record(peer_capture, TRACE_DATA, peerstate->fd, buf, n);
+		}
+	}
+	return n;
+}
+
+static ssize_t peer_sendv(peer_state_t* peerstate, struct iovec* iov, int iovcnt, int flags) {
+	shm_chan_t* shm = peerstate->shm;
+	ssize_t n = 0;
+	if (shm == NULL) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+		n = sendmsg(peerstate->fd, &msg, flags | MSG_NOSIGNAL);
+	} else {
+		/* the rings have no vectored send: copy a segment at a time */
+		for (int i = 0; i < iovcnt; i++) {
+			ssize_t k = shm_chan_send(shm, iov[i].iov_base, iov[i].iov_len);
+			if (k < 0) {
+				if (n == 0) {
+					return -1;
+				}
+				break;
+			}
+			n += k;
+			if ((size_t)k < iov[i].iov_len) {
+				break;
+			}
+		}
+	}
+	if (n > 0) {
+		peer_bytes_moved += n;
+	}
+	return n;
+}
+
+/* what a blob segment holds */
+typedef struct {
+	const blob_t* blob;
+	uint64_t off;		/* next byte to send */
+} blob_ref_t;
+
+static outseg_t* out_push(peer_state_t* peerstate) {
+/* appends an empty segment */
+	outseg_t* tail = peerstate->out;
+	outseg_t* seg = slab_alloc(get_outseg_pool());
+	seg->start = seg->end = 0;
+	seg->zc_held = false;
+	seg->blob = false;
+	if (tail == NULL) {
+		seg->next = seg;
+	} else {
+		seg->next = tail->next;
+		tail->next = seg;
+	}
+	peerstate->out = seg;
+	return seg;
+}
+
+static outseg_t* out_tail_room(peer_state_t* peerstate) {
+/* the tail segment if it has room left, else a fresh one appended */
+	outseg_t* tail = peerstate->out;
+	if (tail != NULL && !tail->blob && tail->end < OUTSEG_DATA) {
+		return tail;
+	}
+	return out_push(peerstate);
+}
+
+static void out_append(peer_state_t* peerstate, const uint8_t* buf, size_t len) {
+	while (len > 0) {
+		outseg_t* seg = out_tail_room(peerstate);
+		size_t n = OUTSEG_DATA - seg->end < len ? OUTSEG_DATA - seg->end : len;
+		memcpy(&seg->data[seg->end], buf, n);
+		seg->end += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void out_append_blob(peer_state_t* peerstate, const blob_t* blob) {
+/* queues the reply to a blob request: its size, then the blob itself */
+	uint8_t hdr[VARINT_MAX_LEN];
+	uint64_t size = blob != NULL ? blob->size : 0;
+	out_append(peerstate, hdr, varint_put(hdr, size > UINT32_MAX ? 0 : size));
+	if (size == 0 || size > UINT32_MAX) {
+		return;
+	}
+	outseg_t* seg = out_push(peerstate);
+	seg->blob = true;
+	seg->end = 1;
+	*(blob_ref_t*)seg->data = (blob_ref_t){ .blob = blob, .off = 0 };
+}
+
+static outseg_t* out_unlink_head(peer_state_t* peerstate) {
+	outseg_t* tail = peerstate->out;
+	outseg_t* head = tail->next;
+	if (head == tail) {
+		peerstate->out = NULL;
+	} else {
+		tail->next = head->next;
+	}
+	return head;
+}
+
+static void out_reap(peer_state_t* peerstate) {
+/* gives fully sent segments at the head of the chain back to the pool,
+ * stopping at one a zero-copy send may still read
+ */
+	while (peerstate->out != NULL) {
+		outseg_t* head = peerstate->out->next;
+		if (head->start < head->end || head->zc_held) {
+			return;
+		}
+		slab_free(get_outseg_pool(), out_unlink_head(peerstate));
+	}
+}
+
+static outseg_t* out_first_unsent(peer_state_t* peerstate) {
+/* where sending resumes, past any sent segments still held for zero-copy;
+ * NULL if nothing is pending
+ */
+	outseg_t* seg = peerstate->out;
+	if (seg != NULL) {
+		do {
+			seg = seg->next;
+			if (seg->start < seg->end) {
+				return seg;
+			}
+		} while (seg != peerstate->out);
+	}
+	return NULL;
+}
+
+static void out_consume(peer_state_t* peerstate, size_t nsent, bool zerocopy) {
+/* marks nsent bytes as sent; a partially sent segment keeps its offset.
+ * After a zero-copy send the segments it read from are held until the
+ * kernel reports it done with them, the others go back to the pool.
+ */
+	outseg_t* seg = out_first_unsent(peerstate);
+	while (nsent > 0) {
+		size_t avail = seg->end - seg->start;
+		size_t n = avail < nsent ? avail : nsent;
+		seg->start += n;
+		nsent -= n;
+		if (zerocopy) {
+			seg->zc_held = true;
+			seg->zc_id = peerstate->zc_next - 1;
+		}
+		seg = seg->next;
+	}
+	out_reap(peerstate);
+}
+
+static void out_release(peer_state_t* peerstate, uint32_t hi) {
+/* the kernel is done with zero-copy sends up to id hi; TCP completes them
+ * in order, so segments held for earlier ids are free as well
+ */
+	outseg_t* seg = peerstate->out;
+	if (seg != NULL) {
+		do {
+			seg = seg->next;
+			if (seg->zc_held && (int32_t)(seg->zc_id - hi) <= 0) {
+				seg->zc_held = false;
+			}
+		} while (seg != peerstate->out);
+	}
+	out_reap(peerstate);
+}
+
+static size_t out_bytes(peer_state_t* peerstate) {
+/* bytes not sent yet */
+	size_t n = 0;
+	outseg_t* seg = peerstate->out;
+	if (seg != NULL) {
+		do {
+			seg = seg->next;
+			if (seg->blob) {
+				blob_ref_t* ref = (blob_ref_t*)seg->data;
+				n += ref->blob->size - ref->off;
+			} else {
+				n += seg->end - seg->start;
+			}
+		} while (seg != peerstate->out);
+	}
+	return n;
+}
+
+static void out_drop(peer_state_t* peerstate) {
+/* frees the chain but for segments a zero-copy send may still read */
+	outseg_t* held = NULL;
+	while (peerstate->out != NULL) {
+		outseg_t* seg = out_unlink_head(peerstate);
+		if (!seg->zc_held) {
+			slab_free(get_outseg_pool(), seg);
+			continue;
+		}
+		if (held == NULL) {
+			seg->next = seg;
+		} else {
+			seg->next = held->next;
+			held->next = seg;
+		}
+		held = seg;
+	}
+	peerstate->out = held;
+}
+
+size_t peer_discard_output(peer_state_t* peerstate) {
+	size_t n = out_bytes(peerstate);
+	out_drop(peerstate);
+	return n;
+}
+
+/* Peers closed while the kernel may still read their held segments: a
+ * segment is only reused once its completion comes in, and completions
+ * come through the socket's error queue, so the socket stays open until
+ * the last one. Their queues are read on each later close in the thread.
+ */
+typedef struct lingering {
+	struct lingering* next;
+	peer_state_t peer;
+} lingering_t;
+
+static _Thread_local lingering_t* lingering;
+
+static void linger_reap(void) {
+/* closes the lingering sockets whose segments are all released */
+	for (lingering_t** l = &lingering; *l != NULL; ) {
+		lingering_t* cur = *l;
+		peer_reap_zerocopy(&cur->peer);
+		if (cur->peer.out != NULL) {
+			l = &cur->next;
+			continue;
+		}
+		close(cur->peer.fd);
+		*l = cur->next;
+		free(cur);
+	}
+}
+
+peer_state_t* peer_create(int fd, shm_chan_t* shm) {
+	peer_state_t* peerstate = slab_alloc(get_peer_pool());
+	memset(peerstate, 0, sizeof *peerstate);
+	peerstate->fd = fd;
+	peerstate->shm = shm;
+	return peerstate;
+}
+
+void peer_destroy(peer_state_t* peerstate) {
+	if (peer_capture != NULL) {
+		capture_record(peer_capture, TRACE_CLOSE, peerstate->fd, NULL, 0);
+	}
+	peer_discard_output(peerstate);
+	linger_reap();
+	if (peerstate->shm != NULL) {
+		/* closes the eventfd too */
+		shm_chan_close(peerstate->shm);
+	} else if (peerstate->out != NULL) {
+		lingering_t* l = xmalloc(sizeof *l);
+		l->peer = *peerstate;
+		l->next = lingering;
+		lingering = l;
+	} else {
+		close(peerstate->fd);
+	}
+	slab_free(get_peer_pool(), peerstate);
+}
+
+/* a detached peer, with its pending output right behind the state */
+typedef struct {
+	peer_state_t peer;
+	size_t pending;
+	uint8_t data[];
+} moved_peer_t;
+
+typedef struct {
+	void (*fn)(peer_state_t*, void*);
+	void* arg;
+} peer_visit_t;
+
+static void visit_peer(void* obj, void* arg) {
+	peer_visit_t* v = arg;
+	v->fn(obj, v->arg);
+}
+
+void peer_foreach(void (*fn)(peer_state_t* peerstate, void* arg), void* arg) {
+	if (peer_pool != NULL) {
+		peer_visit_t v = { fn, arg };
+		slab_foreach(peer_pool, visit_peer, &v);
+	}
+}
+
+bool peer_can_move(peer_state_t* peerstate) {
+	if (peerstate->shm != NULL) {
+		return false;
+	}
+	outseg_t* seg = peerstate->out;
+	if (seg != NULL) {
+		do {
+			seg = seg->next;
+			/* held segments are released through this thread */
+			if ((seg->blob && seg->start < seg->end) || seg->zc_held) {
+				return false;
+			}
+		} while (seg != peerstate->out);
+	}
+	return true;
+}
+
+peer_state_t* peer_detach(peer_state_t* peerstate) {
+	assert(peer_can_move(peerstate));
+	/* the segments belong to this thread's pool: flatten them */
+	size_t pending = out_bytes(peerstate);
+	moved_peer_t* moved = xmalloc(sizeof *moved + pending);
+	moved->peer = *peerstate;
+	moved->peer.out = NULL;
+	moved->pending = pending;
+	outseg_t* seg = peerstate->out;
+	size_t off = 0;
+	if (seg != NULL) {
+		do {
+			seg = seg->next;
+			memcpy(&moved->data[off], &seg->data[seg->start], seg->end - seg->start);
+			off += seg->end - seg->start;
+		} while (seg != peerstate->out);
+	}
+	peer_discard_output(peerstate);
+	slab_free(get_peer_pool(), peerstate);
+	return &moved->peer;
+}
+
+peer_state_t* peer_adopt(peer_state_t* detached, fd_status_t* status) {
+	moved_peer_t* moved = (moved_peer_t*)detached;
+	peer_state_t* peerstate = slab_alloc(get_peer_pool());
+	*peerstate = moved->peer;
+	out_append(peerstate, moved->data, moved->pending);
+	free(moved);
+	bool pending = out_first_unsent(peerstate) != NULL;
+	*status = (fd_status_t){.want_read = !pending, .want_write = pending};
+	return peerstate;
+}
+
+bool peer_at_rest(peer_state_t* peerstate) {
+	bool between_frames = peerstate->state == WAIT_FOR_MODE ||
+		peerstate->state == WAIT_FOR_MSG ||
+		(peerstate->state == BIN_HEADER && peerstate->bin_shift == 0);
+	if (peerstate->shm != NULL || !between_frames || out_first_unsent(peerstate) != NULL) {
+		return false;
+	}
+	/* nothing of a next frame may be waiting in the socket either */
+	char c;
+	return recv(peerstate->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+		(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+fd_status_t on_peer_connected(peer_state_t* peerstate,
+				const struct sockaddr* peer_addr,
+				socklen_t peer_addr_len) {
+	if (peer_addr != NULL) {
+		connection_report(peer_addr, peer_addr_len);
+	}
+	if (peer_capture != NULL) {
+		capture_record(peer_capture, TRACE_OPEN, peerstate->fd, NULL, 0);
+	}
+
+	// Initialize state to send back a '*' to the peer immediately.
+	peerstate->state = INITIAL_ACK;
+	LAT_ACK_PENDING(&peerstate->lat);
+	out_append(peerstate, (const uint8_t*)"*", 1);
+
+	/* opt in to zero-copy sends; the kernel may not support them */
+	int one = 1;
+	if (zerocopy_min > 0 && peerstate->shm == NULL &&
+			setsockopt(peerstate->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0) {
+		peerstate->zc = ZC_ON;
+	}
+	/* a reply queued behind a blob goes out in a send of its own, which
+	 * Nagle would hold until the blob's last segment is acked
+	 */
+	if (blob_count() > 0 && peerstate->shm == NULL) {
+		setsockopt(peerstate->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	}
+
+	// Signal that this socket is ready for writing now.
+	return fd_status_W;
+}
+
+static void transform_binary(peer_state_t* peerstate, const uint8_t* buf, int nbytes,
+		uint8_t* out) {
+/* binary framing: the reply to a chunk is exactly as long as the chunk */
+	binframe_t f = {
+		.left = peerstate->bin_left,
+		.shift = peerstate->bin_shift,
+		.in_payload = peerstate->state == BIN_PAYLOAD,
+	};
+	if (!f.in_payload && f.shift == 0) {
+		LAT_FRAME_START(&peerstate->lat);
+	}
+	if (binframe_transform(&f, buf, out, nbytes) > 0) {
+		LAT_FRAME_END(&peerstate->lat);
+	}
+	peerstate->bin_left = f.left;
+	peerstate->bin_shift = f.shift;
+	peerstate->state = f.in_payload ? BIN_PAYLOAD : BIN_HEADER;
+}
+
+static int transform_text(peer_state_t* peerstate, const uint8_t* buf, int nbytes,
+		uint8_t* out, int* outlen, bool* blob_request, const blob_t** blob) {
+/* text framing: writes reply bytes to out and returns the number of input
+ * bytes taken. Stops right after a blob request, setting *blob_request
+ * and *blob (NULL for an unknown name).
+ */
+	*outlen = 0;
+	for (int i=0; i<nbytes; ++i) {
+		switch (peerstate->state) {
+			case WAIT_FOR_MSG:
+				if (buf[i] == '^') {
+					peerstate->state = IN_MSG;
+					LAT_FRAME_START(&peerstate->lat);
+				} else if (buf[i] == BLOB_REQUEST && blob_count() > 0) {
+					peerstate->state = BLOB_NAME;
+					peerstate->bin_left = BLOB_HASH_INIT;
+					peerstate->bin_shift = 0;
+				}
+				break;
+			case IN_MSG:
+				if (buf[i] == '$') {
+					peerstate->state = WAIT_FOR_MSG;
+					LAT_FRAME_END(&peerstate->lat);
+				} else {
+					out[(*outlen)++] = buf[i] +1;
+				}
+				break;
+			case BLOB_NAME:
+				if (buf[i] == '$') {
+					peerstate->state = WAIT_FOR_MSG;
+					*blob_request = true;
+					/* a name too long for any blob matches none */
+					*blob = peerstate->bin_shift > BLOB_NAME_MAX ? NULL :
+						blob_find(peerstate->bin_left, peerstate->bin_shift);
+					return i + 1;
+				}
+				peerstate->bin_left = blob_hash_step(peerstate->bin_left, buf[i]);
+				if (peerstate->bin_shift <= BLOB_NAME_MAX) {
+					peerstate->bin_shift++;
+				}
+				break;
+			default:
+				assert(0 && "can't reach here");
+				break;
+		}
+	}
+	return nbytes;
+}
+
+bool transform_frames(peer_state_t* peerstate, const uint8_t* buf, int nbytes) {
+/* run the protocol state machine over buf, appending replies to the
+ * output chain; returns true if anything was queued
+ */
+	bool queued = false;
+	if (peerstate->state == WAIT_FOR_MODE && nbytes > 0) {
+		if (buf[0] == BINARY_HELLO) {
+			/* echo the hello; the rest of the stream is binary */
+			out_append(peerstate, buf, 1);
+			peerstate->state = BIN_HEADER;
+			queued = true;
+			buf++;
+			nbytes--;
+		} else {
+			peerstate->state = WAIT_FOR_MSG;
+		}
+	}
+
+	/* replies are never longer than their input, so the input goes in
+	 * pieces no larger than the room left in the tail segment
+	 */
+	bool binary = peerstate->state == BIN_HEADER || peerstate->state == BIN_PAYLOAD;
+	while (nbytes > 0) {
+		outseg_t* seg = out_tail_room(peerstate);
+		int n = OUTSEG_DATA - seg->end < (size_t)nbytes ? (int)(OUTSEG_DATA - seg->end) : nbytes;
+		uint8_t* out = &seg->data[seg->end];
+		int outlen = n;
+		bool blob_request = false;
+		const blob_t* blob = NULL;
+		if (binary) {
+			transform_binary(peerstate, buf, n, out);
+		} else {
+			/* a blob request ends the piece: the blob goes in between */
+			n = transform_text(peerstate, buf, n, out, &outlen, &blob_request, &blob);
+		}
+		seg->end += outlen;
+		queued |= outlen > 0;
+		buf += n;
+		nbytes -= n;
+		if (blob_request) {
+			out_append_blob(peerstate, blob);
+			queued = true;
+		}
+	}
+	return queued;
+}
+
+fd_status_t on_peer_ready_recv(peer_state_t* peerstate) {
+	if (peerstate->state == INITIAL_ACK || out_first_unsent(peerstate) != NULL) {
+		/* Initial ack sending not complete or nothing to send */
+		return fd_status_W;
+	}
+
+	/* Drain the socket, up to RECV_MAX_QUEUED bytes, so that all the
+	 * frames a pipelining peer has in flight are answered by one writev.
+	 */
+	uint8_t buf[RECV_CHUNK];
+	bool ready_to_send = false;
+	int taken = 0;
+	while (taken < RECV_MAX_QUEUED) {
+		int nbytes = peer_recv(peerstate, buf, sizeof buf);
+		if (nbytes == 0) {
+			/* assume peer disconnected, once its replies are out */
+			if (ready_to_send) {
+				break;
+			}
+			return fd_status_NORW;
+		} else if (nbytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* socket is not really ready to receive; select
+				 * reports a pending error queue this way */
+				if (taken == 0) {
+					peer_reap_zerocopy(peerstate);
+				}
+				break;
+			} else if (errno == ECONNRESET) {
+				/* the peer reset the connection */
+				return fd_status_NORW;
+			} else {
+				perror_die("recv");
+			}
+		}
+		taken += nbytes;
+		ready_to_send |= transform_frames(peerstate, buf, nbytes);
+	}
+	LAT_FRAME_QUEUED(&peerstate->lat);
+	if (!ready_to_send) {
+		/* idle peers hold no segment but what zero-copy sends still read */
+		out_reap(peerstate);
+	}
+	/* Report reading readiness iff there's nothing to send to the peer as
+	 * a result of the latest recv
+	 */
+	return (fd_status_t){.want_read = !ready_to_send,
+				.want_write = ready_to_send};
+}
+
+static ssize_t send_blob(peer_state_t* peerstate, outseg_t* seg) {
+/* streams what the socket takes of a blob segment, from the file's page
+ * cache straight to the socket; shm peers copy from the mapping
+ */
+	blob_ref_t* ref = (blob_ref_t*)seg->data;
+	uint64_t left = ref->blob->size - ref->off;
+	ssize_t n;
+	if (peerstate->shm != NULL) {
+		n = shm_chan_send(peerstate->shm, ref->blob->map + ref->off, left);
+	} else {
+		off_t off = ref->off;
+		n = sendfile(peerstate->fd, ref->blob->fd, &off,
+			left < BLOB_SEND_MAX ? left : BLOB_SEND_MAX);
+		if (n == 0) {
+			/* the file was truncated under us */
+			errno = EPIPE;
+			return -1;
+		}
+	}
+	if (n > 0) {
+		peer_bytes_moved += n;
+		ref->off += n;
+		if (ref->off == ref->blob->size) {
+			seg->start = seg->end;
+			out_reap(peerstate);
+		}
+	}
+	return n;
+}
+
+fd_status_t on_peer_ready_send(peer_state_t* peerstate) {
+	outseg_t* seg = out_first_unsent(peerstate);
+	if (seg == NULL) {
+		/* Nothing to send */
+		return fd_status_RW;
+	}
+	/* one call for the whole chain; a chain longer than IOV_MAX takes
+	 * several, all but the last with MSG_MORE so that TCP still packs
+	 * full segments across them
+	 */
+	for (; seg != NULL; seg = out_first_unsent(peerstate)) {
+		if (seg->blob) {
+			ssize_t nsent = send_blob(peerstate, seg);
+			if (nsent == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return fd_status_W;
+				} else if (errno == EPIPE || errno == ECONNRESET) {
+					return fd_status_NORW;
+				} else {
+					perror_die("sendfile");
+				}
+			}
+			if (seg->start < seg->end) {
+				return fd_status_W;
+			}
+			continue;
+		}
+
+		/* the bytes up to the next blob, which goes by itself */
+		struct iovec iov[IOV_MAX];
+		int iovcnt = 0;
+		size_t sendlen = 0;
+		outseg_t* head = peerstate->out->next;
+		do {
+			iov[iovcnt].iov_base = &seg->data[seg->start];
+			iov[iovcnt].iov_len = seg->end - seg->start;
+			sendlen += iov[iovcnt++].iov_len;
+			seg = seg->next;
+		} while (seg != head && !seg->blob && iovcnt < IOV_MAX);
+
+		bool zerocopy = peerstate->zc == ZC_ON && sendlen >= (size_t)zerocopy_min;
+		int flags = (seg != head ? MSG_MORE : 0) | (zerocopy ? MSG_ZEROCOPY : 0);
+		ssize_t nsent = peer_sendv(peerstate, iov, iovcnt, flags);
+		if (nsent == -1 && zerocopy && errno == ENOBUFS) {
+			/* no socket memory left to track completions: copy */
+			zerocopy = false;
+			nsent = peer_sendv(peerstate, iov, iovcnt, flags & ~MSG_ZEROCOPY);
+		}
+		if (nsent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return fd_status_W;
+			} else if (errno == EPIPE || errno == ECONNRESET) {
+				/* the peer went away with output pending: a reset
+				 * TCP peer, or a shm peer that closed its rings */
+				return fd_status_NORW;
+			} else {
+				perror_die("send");
+			}
+		}
+		if (zerocopy) {
+			/* the kernel numbers a socket's zero-copy sends from 0 */
+			peerstate->zc_next++;
+			atomic_fetch_add_explicit(&zerocopy_stats.zerocopy, 1, memory_order_relaxed);
+		} else if (peerstate->zc != ZC_OFF) {
+			atomic_fetch_add_explicit(&zerocopy_stats.copied, 1, memory_order_relaxed);
+		}
+		out_consume(peerstate, nsent, zerocopy);
+		if ((size_t)nsent < sendlen) {
+			return fd_status_W;
+		}
+	}
+
+	/* Everything was sent successfully */
+	/* Special-case state transition in if we were in INITIAL_ACK until now */
+	if (peerstate->state == INITIAL_ACK) {
+		peerstate->state = WAIT_FOR_MODE;
+		LAT_ACK_SENT(&peerstate->lat);
+	} else {
+		LAT_FRAME_SENT(&peerstate->lat);
+	}
+	return fd_status_R;
+}
+
+bool peer_reap_zerocopy(peer_state_t* peerstate) {
+	if (peerstate->zc == ZC_OFF) {
+		return false;
+	}
+	bool reaped = false;
+	while (1) {
+		char control[128];
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof control };
+		if (recvmsg(peerstate->fd, &msg, MSG_ERRQUEUE) < 0) {
+			break;
+		}
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+					!(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			struct sock_extended_err serr;
+			memcpy(&serr, CMSG_DATA(cmsg), sizeof serr);
+			if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+				continue;
+			}
+			/* sends ee_info to ee_data are complete */
+			reaped = true;
+			out_release(peerstate, serr.ee_data);
+			if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				/* the kernel copied after all (loopback, a device
+				 * without scatter-gather): pinning pages only costs */
+				atomic_fetch_add_explicit(&zerocopy_stats.fell_back,
+					serr.ee_data - serr.ee_info + 1, memory_order_relaxed);
+				peerstate->zc = ZC_COPIED;
+			}
+		}
+	}
+	return reaped;
+}
+
+fd_status_t on_shm_peer_ready(peer_state_t* peerstate) {
+/* the channel's eventfd fired: run the socket handlers against the rings
+ * until they would block, busy-polling briefly before parking the peer
+ */
+	shm_chan_clear(peerstate->shm);
+
+	for (int round = 0; round < SHM_MAX_ROUNDS; round++) {
+		fd_status_t status;
+		if (out_first_unsent(peerstate) != NULL) {
+			status = on_peer_ready_send(peerstate);
+		} else {
+			status = on_peer_ready_recv(peerstate);
+		}
+		if (!status.want_read && !status.want_write) {
+			return fd_status_NORW;
+		}
+		if (!shm_chan_arm(peerstate->shm, status.want_read,
+				status.want_write, shm_spin_ns)) {
+			return fd_status_R;
+		}
+	}
+	/* still busy: come back after serving the other ready fds */
+	shm_chan_notify(peerstate->shm);
+	return fd_status_R;
+}
+
@@ -0,0 +1,203 @@
+/* header file for the event-driven servers' protocol handlers */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "shmring.h"
+#include "latency.h"
+
+/* Bytes of one output segment, header included */
+#define OUTSEG_SIZE 1024
+
+/* Most input taken from a peer per readiness event; as replies are never
+ * longer, this also bounds the output queued before it is flushed
+ */
+#define RECV_MAX_QUEUED (64 * 1024)
+
+/* Output waits in a chain of segments from a per-thread pool: replies are
+ * appended to the tail, and one writev sends from every segment at once.
+ * A partially sent segment keeps its offset; a fully sent one goes back
+ * to the pool. A blob segment stands for a whole file streamed with
+ * sendfile where the chain reaches it; its start and end only tell
+ * whether it is still pending.
+ */
+typedef struct outseg {
+	struct outseg* next;	/* the chain is circular: tail->next is the head */
+	uint32_t zc_id;		/* the last zero-copy send that read from it */
+	uint16_t start;		/* next byte to send */
+	uint16_t end;		/* end of the queued bytes */
+	bool zc_held;		/* sent, but the kernel may still read it */
+	bool blob;		/* data holds a blob reference, not bytes */
+	uint8_t data[];
+} outseg_t;
+
+#define OUTSEG_DATA (OUTSEG_SIZE - offsetof(outseg_t, data))
+
+/* WAIT_FOR_MODE: the first byte after the ack picks text ('^payload$')
+ * or binary framing (BINARY_HELLO, see framing.h) for the connection.
+ * BLOB_NAME: inside a text mode blob request (see blob.h).
+ */
+typedef enum {
+	INITIAL_ACK, WAIT_FOR_MODE,
+	WAIT_FOR_MSG, IN_MSG, BLOB_NAME,	/* text framing */
+	BIN_HEADER, BIN_PAYLOAD		/* binary framing */
+} ServerState;
+
+/* ZC_ON: sends of zerocopy_min bytes or more use MSG_ZEROCOPY;
+ * ZC_COPIED: the kernel reported copying them anyway, so the peer went
+ * back to plain sends, though completions may still come in
+ */
+typedef enum { ZC_OFF, ZC_ON, ZC_COPIED } ZeroCopyState;
+
+/* Only the hot per-connection fields live here (32 bytes), so a million
+ * mostly idle connections cost tens of MB. The event loop registration
+ * carries a pointer to this struct, so no table indexed by fd is needed.
+ */
+typedef struct {
+	int fd;
+	uint8_t state;		/* ServerState */
+	/* binary framing: varint bits parsed in BIN_HEADER;
+	 * BLOB_NAME: the name's length so far
+	 */
+	uint8_t bin_shift;
+	/* the event loop's record of the interest registered for fd
+	 * (EV_* bits), so it can skip re-arming with the same events
+	 */
+	uint8_t armed;
+	uint8_t zc;		/* ZeroCopyState */
+	/* binary framing: the length so far in BIN_HEADER, the payload bytes
+	 * still to come in BIN_PAYLOAD; BLOB_NAME: the name's hash so far
+	 */
+	uint32_t bin_left;
+	/* the id the kernel gives the socket's next zero-copy send */
+	uint32_t zc_next;
+	/* the tail of the output chain, NULL when nothing is pending;
+	 * on_peer_ready_recv handler appends to it,
+	 * on_peer_ready_send handler drains it back into the pool
+	 */
+	outseg_t* out;
+	/* non-NULL for same-host peers talking over shared-memory rings;
+	 * the fd is then the channel's eventfd instead of a socket
+	 */
+	shm_chan_t* shm;
+#ifdef LATENCY_TRACE
+	/* the sampled frame in flight; only in tracing builds */
+	lat_frame_t lat;
+#endif
+} peer_state_t;
+
+/* the return structure of callback functions
+ * tell if the port should be kept monitoring for read/write
+ */
+typedef struct {
+	bool want_read;		/* true -> keep monitoring fd for reading */
+	bool want_write;	/* true -> keep monitoring fd for writing */
+} fd_status_t;
+
+/* these constants make creating fd_status_t values less verebose */
+extern const fd_status_t fd_status_R;
+extern const fd_status_t fd_status_W;
+extern const fd_status_t fd_status_RW;
+extern const fd_status_t fd_status_NORW;
+
+/* busy-poll budget of a shm peer before parking it on its eventfd */
+extern long shm_spin_ns;
+
+/* Opt-in zero-copy sends: socket peers get SO_ZEROCOPY, and a send of at
+ * least this many bytes goes out with MSG_ZEROCOPY; 0 (default) is off.
+ * The segments it reads from are only reused once the kernel reports the
+ * send complete on the socket's error queue.
+ */
+extern long zerocopy_min;
+
+/* sends by peers with zero-copy on, all event loop threads together */
+typedef struct {
+	_Atomic uint64_t zerocopy;	/* sent with MSG_ZEROCOPY */
+	_Atomic uint64_t copied;	/* below the threshold, or fallen back */
+	_Atomic uint64_t fell_back;	/* MSG_ZEROCOPY sends the kernel copied */
+} zerocopy_stats_t;
+extern zerocopy_stats_t zerocopy_stats;
+
+/* When set, every peer's connect, inbound bytes and close are appended to
+ * this trace (see capture.h); NULL (default) is off
+ */
+extern struct capture* peer_capture;
+
+/* Bytes the calling thread's peers have received and sent so far. Loops
+ * diff it around a handler call to attribute traffic to a peer.
+ */
+extern _Thread_local uint64_t peer_bytes_moved;
+
+/* Allocates the state of a new peer on fd (the channel's eventfd for shm
+ * peers). Peer states and send buffers come from pools owned by the
+ * calling thread.
+ */
+peer_state_t* peer_create(int fd, shm_chan_t* shm);
+
+/* Closes the peer's fd or channel and releases its state; a socket whose
+ * zero-copy sends are not all complete stays open until they are
+ */
+void peer_destroy(peer_state_t* peerstate);
+
+/* Moving a peer between event loop threads: peer_detach releases the
+ * state to the calling thread's pools, leaving the fd open, and returns a
+ * heap copy carrying the pending output. peer_adopt takes such a copy into
+ * the calling thread's pools, frees it and sets status to what to wait for.
+ */
+peer_state_t* peer_detach(peer_state_t* peerstate);
+peer_state_t* peer_adopt(peer_state_t* moved, fd_status_t* status);
+
+/* True if peer_detach can take the peer: not for shm peers, which park
+ * against their own eventfd protocol, nor while a blob is pending or a
+ * zero-copy send may still read its output
+ */
+bool peer_can_move(peer_state_t* peerstate);
+
+/* Calls fn(peer, arg) on every peer in the calling thread's pool, which
+ * are the peers its event loop serves; fn may destroy the peer. For rare
+ * sweeps only: a call sorts the pool's free list.
+ */
+void peer_foreach(void (*fn)(peer_state_t* peerstate, void* arg), void* arg);
+
+/* True if the peer is between frames with nothing pending either way, so
+ * closing it drops no frame. Never true for shm peers.
+ */
+bool peer_at_rest(peer_state_t* peerstate);
+
+/* Protocol callbacks: each returns what the loop should wait for next,
+ * fd_status_NORW meaning the peer is done and should be destroyed.
+ * peer_addr may be NULL for peers without an INET address.
+ */
+fd_status_t on_peer_connected(peer_state_t* peerstate,
+		const struct sockaddr* peer_addr, socklen_t peer_addr_len);
+fd_status_t on_peer_ready_recv(peer_state_t* peerstate);
+fd_status_t on_peer_ready_send(peer_state_t* peerstate);
+
+/* Reads zero-copy completions off a socket peer's error queue, releasing
+ * the segments they held. Returns false if there were none, so an error
+ * reported on the fd is a real one.
+ */
+bool peer_reap_zerocopy(peer_state_t* peerstate);
+
+/* A shm peer's eventfd fired: runs the callbacks above against its rings */
+fd_status_t on_shm_peer_ready(peer_state_t* peerstate);
+
+/* The frame state machine behind on_peer_ready_recv: appends the replies
+ * for nbytes of input to the peer's output chain. Returns true if
+ * anything was queued.
+ */
+bool transform_frames(peer_state_t* peerstate, const uint8_t* buf, int nbytes);
+
+/* Releases the peer's queued output unsent; returns how many bytes it held.
+ * Segments a zero-copy send may still read stay until their completion.
+ */
+size_t peer_discard_output(peer_state_t* peerstate);
+
+#endif /* PROTOCOL_H */
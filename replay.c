@@ -0,0 +1,403 @@
+/* Trace replay client
+ * streams the inbound bytes of a trace captured by a server (-C) back
+ * against any server, one connection per traced connection, at the
+ * original pace or as fast as the server takes them
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "connector.h"
+#include "capture.h"
+
+#define MAXEVENTS 1024
+#define CONNECT_TIMEOUT_MS 5000
+/* default bytes queued for one connection before reading the trace waits */
+#define MAX_BACKLOG (1 << 20)
+#define RECV_BUF (64 * 1024)
+
+/* one replayed connection; lives until both the trace and the server
+ * have closed it
+ */
+typedef struct {
+	int fd;			/* -1 until connected */
+	bool failed;		/* connect failed or connection broke: data is dropped */
+	bool closing;		/* the trace closed it: shut down once sent */
+	bool want_write;	/* EPOLLOUT registered */
+	uint8_t* out;		/* trace bytes not sent yet: out[off, len) */
+	size_t off, len, cap;
+} rconn_t;
+
+typedef struct {
+	uint64_t conns, failed;
+	uint64_t sent, received;
+	uint64_t records;
+} replay_stats_t;
+
+static int epfd;
+static int live;		/* connections not freed yet */
+static size_t max_backlog = MAX_BACKLOG;
+static replay_stats_t stats;
+
+/* trace connection ids (server fds) to the connection replaying them */
+static rconn_t** by_id;
+static uint32_t by_id_cap;
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void set_id(uint32_t id, rconn_t* rc) {
+	if (id >= by_id_cap) {
+		uint32_t cap = by_id_cap ? by_id_cap : 1024;
+		while (cap <= id) {
+			cap *= 2;
+		}
+		by_id = realloc(by_id, cap * sizeof *by_id);
+		if (by_id == NULL) {
+			die("OOM");
+		}
+		memset(by_id + by_id_cap, 0, (cap - by_id_cap) * sizeof *by_id);
+		by_id_cap = cap;
+	}
+	by_id[id] = rc;
+}
+
+static rconn_t* get_id(uint32_t id) {
+	return id < by_id_cap ? by_id[id] : NULL;
+}
+
+static void rconn_free(rconn_t* rc) {
+	if (rc->fd >= 0) {
+		close(rc->fd);
+	}
+	free(rc->out);
+	free(rc);
+	live--;
+}
+
+/* The connection is gone, but the trace may still refer to it */
+static void rconn_broken(rconn_t* rc) {
+	if (rc->closing) {
+		rconn_free(rc);
+		return;
+	}
+	if (rc->fd >= 0) {
+		close(rc->fd);
+		rc->fd = -1;
+	}
+	rc->failed = true;
+	free(rc->out);
+	rc->out = NULL;
+	rc->off = rc->len = rc->cap = 0;
+}
+
+static void rconn_set_write(rconn_t* rc, bool want_write) {
+	if (rc->want_write == want_write) {
+		return;
+	}
+	struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = rc};
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, rc->fd, &ev) < 0) {
+		perror_die("epoll_ctl MOD");
+	}
+	rc->want_write = want_write;
+}
+
+/* Sends what it can of the backlog; false if the connection broke */
+static bool rconn_flush(rconn_t* rc) {
+	while (rc->off < rc->len) {
+		ssize_t n = send(rc->fd, rc->out + rc->off, rc->len - rc->off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				rconn_set_write(rc, true);
+				return true;
+			}
+			return false;
+		}
+		rc->off += n;
+		stats.sent += n;
+	}
+	rc->off = rc->len = 0;
+	rconn_set_write(rc, false);
+	if (rc->closing) {
+		/* the server sees the client's close and closes its end */
+		shutdown(rc->fd, SHUT_WR);
+	}
+	return true;
+}
+
+/* Queues len trace bytes; false if the backlog is full */
+static bool rconn_queue(rconn_t* rc, const uint8_t* data, size_t len) {
+	if (rc->failed) {
+		return true;
+	}
+	if (rc->len - rc->off + len > max_backlog && rc->len > rc->off) {
+		return false;
+	}
+	if (rc->off > 0 && rc->len + len > rc->cap) {
+		memmove(rc->out, rc->out + rc->off, rc->len - rc->off);
+		rc->len -= rc->off;
+		rc->off = 0;
+	}
+	if (rc->len + len > rc->cap) {
+		size_t cap = rc->cap ? rc->cap : 4096;
+		while (cap < rc->len + len) {
+			cap *= 2;
+		}
+		rc->out = realloc(rc->out, cap);
+		if (rc->out == NULL) {
+			die("OOM");
+		}
+		rc->cap = cap;
+	}
+	memcpy(rc->out + rc->len, data, len);
+	rc->len += len;
+	return true;
+}
+
+/* Sends queued bytes right away unless EPOLLOUT will */
+static void rconn_kick(rconn_t* rc) {
+	if (rc->fd >= 0 && !rc->want_write && !rconn_flush(rc)) {
+		rconn_broken(rc);
+	}
+}
+
+static void rconn_mark_closing(rconn_t* rc) {
+	rc->closing = true;
+	if (rc->failed) {
+		rconn_free(rc);
+	} else if (rc->fd >= 0 && rc->off == rc->len) {
+		shutdown(rc->fd, SHUT_WR);
+	}
+}
+
+/* Plays one record. Returns false if it has to wait for sends to drain. */
+static bool apply_record(connector_t* connector, const trace_rec_t* rec, const uint8_t* data,
+		char* host, char* port) {
+	rconn_t* rc = get_id(rec->conn);
+	switch (TRACE_KIND(rec->info)) {
+		case TRACE_OPEN:
+			if (rc != NULL) {
+				/* its close is missing from the trace */
+				rconn_mark_closing(rc);
+			}
+			rc = calloc(1, sizeof *rc);
+			if (rc == NULL) {
+				die("OOM");
+			}
+			rc->fd = -1;
+			live++;
+			stats.conns++;
+			set_id(rec->conn, rc);
+			int err = connector_start(connector, host, port, rc);
+			if (err != 0) {
+				die("replay: %s: %s", host, gai_strerror(err));
+			}
+			break;
+		case TRACE_DATA:
+			if (rc == NULL) {
+				/* the connection predates the capture */
+				break;
+			}
+			if (!rconn_queue(rc, data, TRACE_LEN(rec->info))) {
+				return false;
+			}
+			rconn_kick(rc);
+			break;
+		case TRACE_CLOSE:
+			if (rc != NULL) {
+				set_id(rec->conn, NULL);
+				rconn_mark_closing(rc);
+			}
+			break;
+	}
+	stats.records++;
+	return true;
+}
+
+static void on_connected(connect_result_t* res) {
+	rconn_t* rc = res->data;
+	if (res->fd < 0) {
+		stats.failed++;
+		rconn_broken(rc);
+		return;
+	}
+	rc->fd = res->fd;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = rc};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, rc->fd, &ev) < 0) {
+		perror_die("epoll_ctl ADD");
+	}
+	if (!rconn_flush(rc)) {
+		rconn_broken(rc);
+	}
+}
+
+/* Drains replies; false once the server has closed the connection */
+static bool rconn_read(rconn_t* rc) {
+	static uint8_t buf[RECV_BUF];
+	while (1) {
+		ssize_t n = recv(rc->fd, buf, sizeof buf, 0);
+		if (n > 0) {
+			stats.received += n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		return false;
+	}
+}
+
+int main(int argc, char** argv) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	char* host = "localhost";
+	char* port = "9090";
+	double speed = 0;	/* 0: as fast as possible */
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:x:q:")) != -1) {
+		switch (opt) {
+			case 's':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'q':
+				max_backlog = (size_t)atol(optarg) * 1024;
+				break;
+			default:
+				fprintf(stderr, "usage: %s "
+						"[-s server] [-p port] "
+						"[-x speed (1 = original timing, 0 = as fast as possible)] "
+						"[-q max_backlog_kb] "
+						"trace_file\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
+		die("replay: no trace file given");
+	}
+	if (speed < 0 || max_backlog == 0) {
+		die("bad arguments");
+	}
+
+	trace_reader_t* trace = trace_open(argv[optind]);
+	connector_t* connector = connector_create(CONNECT_TIMEOUT_MS);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror_die("epoll_create1");
+	}
+	/* readable while connects have finished; data.ptr NULL marks it */
+	struct epoll_event cev = {.events = EPOLLIN, .data.ptr = NULL};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connector_fd(connector), &cev) < 0) {
+		perror_die("epoll_ctl ADD");
+	}
+
+	printf("Replaying %s (%lu bytes) against %s:%s %s\n", argv[optind],
+		(unsigned long)trace_size(trace), host, port,
+		speed > 0 ? "on the trace's clock" : "as fast as possible");
+	if (speed > 0) {
+		printf("Speed %.2fx\n", speed);
+	}
+
+	int64_t start = now_ns();
+	const uint8_t* data = NULL;
+	const trace_rec_t* rec = trace_next(trace, &data);
+	bool ended = false;
+	struct epoll_event events[MAXEVENTS];
+	connect_result_t results[MAXEVENTS];
+	while (rec != NULL || live > 0) {
+		/* play records until one is not due yet or has to wait */
+		int timeout = -1;
+		while (rec != NULL) {
+			if (speed > 0) {
+				int64_t due = start + (int64_t)(rec->t_ns / speed);
+				int64_t left = due - now_ns();
+				if (left > 0) {
+					timeout = (int)((left + 999999) / 1000000);
+					break;
+				}
+			}
+			if (!apply_record(connector, rec, data, host, port)) {
+				break;
+			}
+			rec = trace_next(trace, &data);
+		}
+		if (rec == NULL && !ended) {
+			/* connections the capture never saw closed end here */
+			for (uint32_t id = 0; id < by_id_cap; id++) {
+				if (by_id[id] != NULL) {
+					rconn_t* rc = by_id[id];
+					by_id[id] = NULL;
+					rconn_mark_closing(rc);
+				}
+			}
+			ended = true;
+			continue;
+		}
+		if (connector_pending(connector) > 0 &&
+				(timeout < 0 || timeout > CONNECT_ATTEMPT_DELAY_MS)) {
+			timeout = CONNECT_ATTEMPT_DELAY_MS;
+		}
+
+		int nready = epoll_wait(epfd, events, MAXEVENTS, timeout);
+		if (nready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror_die("epoll_wait");
+		}
+		for (int i = 0; i < nready; i++) {
+			rconn_t* rc = events[i].data.ptr;
+			if (rc == NULL) {
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && !rconn_flush(rc)) {
+				rconn_broken(rc);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !rconn_read(rc)) {
+				rconn_broken(rc);
+			}
+		}
+		/* collects finished connects and runs the connector's timers */
+		if (connector_pending(connector) > 0) {
+			int n = connector_poll(connector, results, MAXEVENTS, 0);
+			for (int i = 0; i < n; i++) {
+				on_connected(&results[i]);
+			}
+		}
+	}
+
+	double secs = (now_ns() - start) / 1e9;
+	printf("%lu records, %lu connections (%lu failed) in %.3fs\n",
+		(unsigned long)stats.records, (unsigned long)stats.conns,
+		(unsigned long)stats.failed, secs);
+	printf("sent %lu bytes (%.1f MB/s), received %lu bytes\n",
+		(unsigned long)stats.sent, stats.sent / secs / 1e6,
+		(unsigned long)stats.received);
+
+	connector_destroy(connector);
+	trace_close(trace);
+	return 0;
+}
@@ -6,56 +6,14 @@
 #include <sys/socket.h>
 
 #include "sockutils.h"
+#include "latency.h"
+#include "serve.h"
 
 #define PORT "9090"
 
-/* Server states */
-typedef enum { WAIT_FOR_MSG, IN_MSG } ServerState;
-
-void serve_connection(int sockfd) {
-/* serves connected client */
-
-	/* assume well behaved clients that waits for server hello */
-	if (send(sockfd, "*", 1, 0) < 1)
-		perror_die("server: send");
-
-	ServerState state = WAIT_FOR_MSG;
-
-	while (1) {
-		uint8_t buf[1024];
-		int len = recv(sockfd, buf, sizeof buf, 0);
-		if (len < 0)
-			perror_die("server: recv");
-		else if (len == 0)
-			break;
-
-		for (int i=0; i<len; ++i) {
-			switch (state) {
-				case WAIT_FOR_MSG:
-					if (buf[i] == '^')
-						state = IN_MSG;
-					break;
-				case IN_MSG:
-					if (buf[i] == '$')
-						state = WAIT_FOR_MSG;
-					else {
-						buf[i] += 1;
-						if (send(sockfd, &buf[i], 1, 0) <1) {
-							perror("server: send error");
-							close(sockfd);
-							return;
-						}
-					}
-					break;
-			}
-		}
-	}
-
-	close(sockfd);
-}
-
 int main(void)
 {
+	lat_init();
 	int sockfd = listen_inet(PORT);
 
 	while(1) { /* server keeps on running */
@@ -66,9 +24,10 @@ int main(void)
 				&sin_size);
 	        if (new_fd < 0)
 			perror_die("accept");
+		int64_t accept_ns = LAT_NOW();
 
 		connection_report((struct sockaddr *)&their_addr, sin_size);
-		serve_connection(new_fd);
+		serve_connection(new_fd, accept_ns);
 		printf("peer done\n");
 	}
 
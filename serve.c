@@ -0,0 +1,90 @@
+/* Blocking connection handler */
+/* one recv, in-place transform and one send per round */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sockutils.h"
+#include "latency.h"
+#include "framing.h"
+#include "serve.h"
+
+/* Server states; the first byte after the ack picks text or binary */
+typedef enum { WAIT_FOR_MODE, WAIT_FOR_MSG, IN_MSG, BINARY } ServerState;
+
+void serve_connection(int sockfd, int64_t accept_ns) {
+/* serves connected client, accepted at accept_ns (LAT_NOW) */
+
+	/* assume well behaved clients that waits for server hello */
+	if (send(sockfd, "*", 1, 0) < 1)
+		perror_die("server: send");
+
+	LAT_ACCEPTED(accept_ns);
+	lat_frame_t lat = {0};
+	(void)accept_ns, (void)lat;	/* only read when tracing */
+
+	ServerState state = WAIT_FOR_MODE;
+	binframe_t bin = {0};
+
+	while (1) {
+		uint8_t buf[1024];
+		int len = recv(sockfd, buf, sizeof buf, 0);
+		if (len < 0)
+			perror_die("server: recv");
+		else if (len == 0)
+			break;
+
+		/* transform every frame in the buffer in place, then
+		 * answer them all in order with a single send */
+		int outlen = 0, start = 0;
+		if (state == WAIT_FOR_MODE) {
+			if (buf[0] == BINARY_HELLO) {
+				/* the hello stays in buf as its own echo */
+				state = BINARY;
+				start = 1;
+			} else
+				state = WAIT_FOR_MSG;
+		}
+		if (state == BINARY) {
+			/* replies are as long as the input: no scanning,
+			 * payloads incremented a run at a time */
+			if (!bin.in_payload && bin.shift == 0)
+				LAT_FRAME_START(&lat);
+			if (binframe_transform(&bin, buf + start, buf + start, len - start) > 0)
+				LAT_FRAME_END(&lat);
+			outlen = len;
+		}
+		for (int i=0; state != BINARY && i<len; ++i) {
+			switch (state) {
+				case WAIT_FOR_MSG:
+					if (buf[i] == '^') {
+						state = IN_MSG;
+						LAT_FRAME_START(&lat);
+					}
+					break;
+				case IN_MSG:
+					if (buf[i] == '$') {
+						state = WAIT_FOR_MSG;
+						LAT_FRAME_END(&lat);
+					} else
+						buf[outlen++] = buf[i] + 1;
+					break;
+				default:
+					break;
+			}
+		}
+		LAT_FRAME_QUEUED(&lat);
+		if (outlen > 0 && send_all(sockfd, buf, outlen) < 0) {
+			perror("server: send error");
+			close(sockfd);
+			return;
+		}
+		LAT_FRAME_SENT(&lat);
+	}
+
+	close(sockfd);
+}
@@ -0,0 +1,16 @@
+/* header file for the blocking connection handler */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+/* Serves one connected client on a blocking socket until it hangs up, then
+ * closes sockfd: sends the '*' ack, then answers '^payload$' frames with
+ * payload+1. accept_ns is when the connection was accepted (LAT_NOW), for
+ * the latency trace. Shared by the sequential, threaded and threadpool
+ * servers.
+ */
+void serve_connection(int sockfd, int64_t accept_ns);
+
+#endif /* SERVE_H */
@@ -0,0 +1,413 @@
+/* Shared-memory ring transport for same-host peers */
+/* Two SPSC byte rings in a memfd, set up over a Unix socket */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "shmring.h"
+
+#define N_BACKLOG 64
+#define CACHELINE 64
+
+/* one direction of a channel; head and tail are free running counters */
+typedef struct {
+	_Alignas(CACHELINE) _Atomic uint32_t head;	/* written by producer */
+	_Alignas(CACHELINE) _Atomic uint32_t tail;	/* written by consumer */
+	_Alignas(CACHELINE) _Atomic uint32_t rd_parked;	/* consumer sleeps */
+	_Atomic uint32_t wr_parked;			/* producer sleeps */
+	_Atomic uint32_t closed;			/* either side closed */
+	_Alignas(CACHELINE) uint8_t data[SHM_RING_SIZE];
+} shm_ring_t;
+
+/* the memfd holds ring[0] (client -> server) and ring[1] (server -> client) */
+typedef struct {
+	shm_ring_t ring[2];
+} shm_region_t;
+
+struct shm_chan {
+	shm_region_t* region;
+	shm_ring_t* rx;
+	shm_ring_t* tx;
+	int rx_wait_efd;	/* we sleep here for data */
+	int tx_wait_efd;	/* we sleep here for space (== rx_wait_efd on server) */
+	int rx_kick_efd;	/* peer sleeps here for space */
+	int tx_kick_efd;	/* peer sleeps here for data */
+	int owned_fds[3];	/* eventfds to close with the channel */
+};
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void kick(int efd) {
+	uint64_t one = 1;
+	if (write(efd, &one, sizeof one) < 0 && errno != EAGAIN) {
+		perror_die("shm: eventfd write");
+	}
+}
+
+static void drain(int efd) {
+	uint64_t cnt;
+	if (read(efd, &cnt, sizeof cnt) < 0 && errno != EAGAIN) {
+		perror_die("shm: eventfd read");
+	}
+}
+
+static bool rx_ready(shm_chan_t* chan) {
+	return atomic_load_explicit(&chan->rx->head, memory_order_acquire) !=
+		atomic_load_explicit(&chan->rx->tail, memory_order_relaxed) ||
+		atomic_load_explicit(&chan->rx->closed, memory_order_acquire);
+}
+
+static bool tx_ready(shm_chan_t* chan) {
+	return atomic_load_explicit(&chan->tx->head, memory_order_relaxed) -
+		atomic_load_explicit(&chan->tx->tail, memory_order_acquire) < SHM_RING_SIZE ||
+		atomic_load_explicit(&chan->tx->closed, memory_order_acquire);
+}
+
+ssize_t shm_chan_send(shm_chan_t* chan, const void* buf, size_t len) {
+	shm_ring_t* r = chan->tx;
+	if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+		errno = EPIPE;
+		return -1;
+	}
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t room = SHM_RING_SIZE - (head - tail);
+	if (room == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > room) {
+		len = room;
+	}
+
+	/* copy in at most two pieces around the wrap point */
+	size_t off = head & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+	memcpy(&r->data[off], buf, first);
+	memcpy(r->data, (const uint8_t*)buf + first, len - first);
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+	/* pairs with the fence in the consumer's park path */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange_explicit(&r->rd_parked, 0, memory_order_relaxed)) {
+		kick(chan->tx_kick_efd);
+	}
+	return len;
+}
+
+ssize_t shm_chan_recv(shm_chan_t* chan, void* buf, size_t len) {
+	shm_ring_t* r = chan->rx;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t avail = head - tail;
+	if (avail == 0) {
+		if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+			return 0;
+		}
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > avail) {
+		len = avail;
+	}
+
+	size_t off = tail & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+	memcpy(buf, &r->data[off], first);
+	memcpy((uint8_t*)buf + first, r->data, len - first);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange_explicit(&r->wr_parked, 0, memory_order_relaxed)) {
+		kick(chan->rx_kick_efd);
+	}
+	return len;
+}
+
+bool shm_chan_arm(shm_chan_t* chan, bool want_read, bool want_write,
+		long spin_ns) {
+	/* bounded busy-poll first: no syscalls on either side */
+	long deadline = now_ns() + spin_ns;
+	do {
+		if ((want_read && rx_ready(chan)) || (want_write && tx_ready(chan))) {
+			return true;
+		}
+		cpu_relax();
+	} while (spin_ns > 0 && now_ns() < deadline);
+
+	/* park: raise the flags, then re-check to close the race with the peer */
+	if (want_read) {
+		atomic_store_explicit(&chan->rx->rd_parked, 1, memory_order_relaxed);
+	}
+	if (want_write) {
+		atomic_store_explicit(&chan->tx->wr_parked, 1, memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	if ((want_read && rx_ready(chan)) || (want_write && tx_ready(chan))) {
+		if (want_read) {
+			atomic_store_explicit(&chan->rx->rd_parked, 0, memory_order_relaxed);
+		}
+		if (want_write) {
+			atomic_store_explicit(&chan->tx->wr_parked, 0, memory_order_relaxed);
+		}
+		return true;
+	}
+	return false;
+}
+
+void shm_chan_notify(shm_chan_t* chan) {
+	kick(chan->rx_wait_efd);
+}
+
+void shm_chan_clear(shm_chan_t* chan) {
+	drain(chan->rx_wait_efd);
+}
+
+int shm_chan_fd(shm_chan_t* chan) {
+	return chan->rx_wait_efd;
+}
+
+ssize_t shm_chan_send_all(shm_chan_t* chan, const void* buf, size_t len,
+		long spin_ns) {
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t n = shm_chan_send(chan, (const uint8_t*)buf + sent, len - sent);
+		if (n > 0) {
+			sent += n;
+		} else if (errno != EAGAIN) {
+			return -1;
+		} else if (!shm_chan_arm(chan, false, true, spin_ns)) {
+			drain(chan->tx_wait_efd);
+		}
+	}
+	return sent;
+}
+
+ssize_t shm_chan_recv_wait(shm_chan_t* chan, void* buf, size_t len,
+		long spin_ns) {
+	while (1) {
+		ssize_t n = shm_chan_recv(chan, buf, len);
+		if (n >= 0 || errno != EAGAIN) {
+			return n;
+		}
+		if (!shm_chan_arm(chan, true, false, spin_ns)) {
+			drain(chan->rx_wait_efd);
+		}
+	}
+}
+
+void shm_chan_wait(shm_chan_t* chan, bool want_write, long spin_ns) {
+	if (shm_chan_arm(chan, true, want_write, spin_ns)) {
+		return;
+	}
+	struct pollfd pfd[2] = {
+		{ .fd = chan->rx_wait_efd, .events = POLLIN },
+		{ .fd = chan->tx_wait_efd, .events = POLLIN },
+	};
+	if (poll(pfd, want_write ? 2 : 1, -1) < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		perror_die("shm: poll");
+	}
+	for (int i = 0; i < 2; i++) {
+		if (pfd[i].revents & POLLIN) {
+			drain(pfd[i].fd);
+		}
+	}
+}
+
+void shm_chan_close(shm_chan_t* chan) {
+	atomic_store_explicit(&chan->rx->closed, 1, memory_order_release);
+	atomic_store_explicit(&chan->tx->closed, 1, memory_order_release);
+	/* peer may be parked on either side */
+	kick(chan->tx_kick_efd);
+	kick(chan->rx_kick_efd);
+
+	for (int i = 0; i < 3; i++) {
+		if (chan->owned_fds[i] >= 0) {
+			close(chan->owned_fds[i]);
+		}
+	}
+	munmap(chan->region, sizeof(shm_region_t));
+	free(chan);
+}
+
+int listen_shm(char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		die("shm socket path too long: %s", path);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		perror_die("shm: socket");
+	}
+	if (bind(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+		perror_die("shm: bind");
+	}
+	if (listen(sockfd, N_BACKLOG) < 0) {
+		perror_die("shm: listen");
+	}
+	return sockfd;
+}
+
+shm_chan_t* shm_chan_accept(int connfd) {
+	shm_chan_t* chan = NULL;
+	int efd[3] = {-1, -1, -1};	/* server, client rx, client tx */
+
+	int memfd = memfd_create("shmring", MFD_CLOEXEC);
+	if (memfd < 0) {
+		perror("shm: memfd_create");
+		goto out;
+	}
+	if (ftruncate(memfd, sizeof(shm_region_t)) < 0) {
+		perror("shm: ftruncate");
+		goto out;
+	}
+	efd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	efd[1] = eventfd(0, EFD_CLOEXEC);
+	efd[2] = eventfd(0, EFD_CLOEXEC);
+	if (efd[0] < 0 || efd[1] < 0 || efd[2] < 0) {
+		perror("shm: eventfd");
+		goto out;
+	}
+
+	void* map = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+			MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED) {
+		perror("shm: mmap");
+		goto out;
+	}
+
+	/* hand the memfd and the eventfds over in one message */
+	int fds[4] = {memfd, efd[0], efd[1], efd[2]};
+	char cbuf[CMSG_SPACE(sizeof fds)];
+	memset(cbuf, 0, sizeof cbuf);
+	char tag = '*';
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof cbuf,
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+	if (sendmsg(connfd, &msg, MSG_NOSIGNAL) < 0) {
+		perror("shm: sendmsg");
+		munmap(map, sizeof(shm_region_t));
+		goto out;
+	}
+
+	chan = xmalloc(sizeof *chan);
+	chan->region = map;
+	chan->rx = &chan->region->ring[0];
+	chan->tx = &chan->region->ring[1];
+	chan->rx_wait_efd = chan->tx_wait_efd = efd[0];
+	chan->rx_kick_efd = efd[2];
+	chan->tx_kick_efd = efd[1];
+	memcpy(chan->owned_fds, efd, sizeof efd);
+	efd[0] = efd[1] = efd[2] = -1;
+
+out:
+	for (int i = 0; i < 3; i++) {
+		if (efd[i] >= 0) {
+			close(efd[i]);
+		}
+	}
+	if (memfd >= 0) {
+		close(memfd);
+	}
+	close(connfd);
+	return chan;
+}
+
+shm_chan_t* shm_chan_connect(char* path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		die("shm socket path too long: %s", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		perror_die("shm: socket");
+	}
+	if (connect(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+		perror_die("shm: connect");
+	}
+
+	int fds[4];
+	char cbuf[CMSG_SPACE(sizeof fds)];
+	char tag;
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof cbuf,
+	};
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		perror_die("shm: recvmsg");
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof fds)) {
+		die("shm: server did not pass the channel fds");
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+	close(sockfd);
+
+	void* map = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fds[0], 0);
+	if (map == MAP_FAILED) {
+		perror_die("shm: mmap");
+	}
+	close(fds[0]);
+
+	shm_chan_t* chan = xmalloc(sizeof *chan);
+	chan->region = map;
+	chan->rx = &chan->region->ring[1];
+	chan->tx = &chan->region->ring[0];
+	chan->rx_wait_efd = fds[2];
+	chan->tx_wait_efd = fds[3];
+	chan->rx_kick_efd = fds[1];
+	chan->tx_kick_efd = fds[1];
+	chan->owned_fds[0] = fds[1];
+	chan->owned_fds[1] = fds[2];
+	chan->owned_fds[2] = fds[3];
+	return chan;
+}
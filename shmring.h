@@ -0,0 +1,80 @@
+/* header file for the shared-memory ring transport */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Size in bytes of each direction's ring (power of two) */
+#define SHM_RING_SIZE (64 * 1024)
+
+/* Default time to busy-poll a ring before parking on its eventfd */
+#define SHM_SPIN_NS 20000
+
+/* A same-host connection: a pair of single-producer single-consumer byte
+ * rings living in one memfd mapping shared by both peers. Each side only
+ * enters the kernel (eventfd write) when the other side has parked.
+ */
+typedef struct shm_chan shm_chan_t;
+
+/* Creates a listening Unix socket at path, used to set up shm peers.
+ * Any stale socket file is removed first. Dies in case of errors.
+ */
+int listen_shm(char* path);
+
+/* Server side: builds a new channel for the Unix connection connfd and hands
+ * the memfd and eventfds to the peer with SCM_RIGHTS. connfd is closed.
+ * Returns NULL on failure.
+ */
+shm_chan_t* shm_chan_accept(int connfd);
+
+/* Client side: connects to the Unix socket at path and maps the channel the
+ * server hands over. Dies in case of errors.
+ */
+shm_chan_t* shm_chan_connect(char* path);
+
+/* The eventfd the server registers with its event loop. It becomes readable
+ * when the peer produced data or freed ring space while we were parked.
+ */
+int shm_chan_fd(shm_chan_t* chan);
+
+/* Non-blocking ring I/O with send/recv semantics: returns the number of
+ * bytes moved, -1 with errno EAGAIN when the ring is full/empty, and
+ * shm_chan_recv returns 0 once the peer has closed and the ring is drained.
+ */
+ssize_t shm_chan_send(shm_chan_t* chan, const void* buf, size_t len);
+ssize_t shm_chan_recv(shm_chan_t* chan, void* buf, size_t len);
+
+/* Spins up to spin_ns for the awaited condition (data to read, space to
+ * write), then flags this side as parked so the peer kicks our eventfd.
+ * Returns true, without parking, if the condition is already satisfied.
+ */
+bool shm_chan_arm(shm_chan_t* chan, bool want_read, bool want_write,
+		long spin_ns);
+
+/* Kicks our own eventfd so the event loop comes back to this channel */
+void shm_chan_notify(shm_chan_t* chan);
+
+/* Resets our eventfd counter after the event loop reported it readable */
+void shm_chan_clear(shm_chan_t* chan);
+
+/* Blocking variants for threaded clients: spin for spin_ns, then sleep on
+ * the eventfd until the whole buffer is moved (send) or some data, or end of
+ * stream, is available (recv).
+ */
+ssize_t shm_chan_send_all(shm_chan_t* chan, const void* buf, size_t len,
+		long spin_ns);
+ssize_t shm_chan_recv_wait(shm_chan_t* chan, void* buf, size_t len,
+		long spin_ns);
+
+/* Blocks, the same way, until there is data to read or, with want_write,
+ * space to write, for clients that interleave both
+ */
+void shm_chan_wait(shm_chan_t* chan, bool want_write, long spin_ns);
+
+/* Marks our end closed, wakes the peer and releases the mapping and fds */
+void shm_chan_close(shm_chan_t* chan);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,111 @@
+/* Fixed-size object pool */
+/* chunked allocation with an intrusive free list */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "sockutils.h"
+#include "slab.h"
+
+/* free objects store the link to the next free object in their first bytes */
+typedef struct free_obj {
+	struct free_obj* next;
+} free_obj_t;
+
+typedef struct chunk {
+	struct chunk* next;
+	max_align_t objs[];
+} chunk_t;
+
+struct slab {
+	size_t objsize;
+	size_t per_chunk;
+	size_t in_use;
+	free_obj_t* free_list;
+	chunk_t* chunks;
+};
+
+slab_t* slab_create(size_t objsize, size_t per_chunk) {
+	slab_t* slab = xmalloc(sizeof *slab);
+	/* keep every object aligned for any type and big enough for a link */
+	size_t align = _Alignof(max_align_t);
+	if (objsize < sizeof(free_obj_t)) {
+		objsize = sizeof(free_obj_t);
+	}
+	slab->objsize = (objsize + align - 1) & ~(align - 1);
+	slab->per_chunk = per_chunk > 0 ? per_chunk : 1;
+	slab->in_use = 0;
+	slab->free_list = NULL;
+	slab->chunks = NULL;
+	return slab;
+}
+
+void* slab_alloc(slab_t* slab) {
+	if (slab->free_list == NULL) {
+		/* thread a fresh chunk onto the free list */
+		chunk_t* chunk = xmalloc(sizeof(chunk_t) + slab->objsize * slab->per_chunk);
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		uint8_t* base = (uint8_t*)chunk->objs;
+		for (size_t i = slab->per_chunk; i > 0; i--) {
+			free_obj_t* obj = (free_obj_t*)(base + (i - 1) * slab->objsize);
+			obj->next = slab->free_list;
+			slab->free_list = obj;
+		}
+	}
+	free_obj_t* obj = slab->free_list;
+	slab->free_list = obj->next;
+	slab->in_use++;
+	return obj;
+}
+
+void slab_free(slab_t* slab, void* obj) {
+	free_obj_t* f = (free_obj_t*)obj;
+	f->next = slab->free_list;
+	slab->free_list = f;
+	slab->in_use--;
+}
+
+static int cmp_addr(const void* a, const void* b) {
+	uintptr_t x = (uintptr_t)*(void* const*)a, y = (uintptr_t)*(void* const*)b;
+	return x < y ? -1 : x > y;
+}
+
+void slab_foreach(slab_t* slab, void (*fn)(void* obj, void* arg), void* arg) {
+	/* objects keep no in-use mark: the free list is the only record */
+	size_t nfree = 0;
+	for (free_obj_t* f = slab->free_list; f != NULL; f = f->next) {
+		nfree++;
+	}
+	void** free_objs = xmalloc((nfree > 0 ? nfree : 1) * sizeof *free_objs);
+	size_t i = 0;
+	for (free_obj_t* f = slab->free_list; f != NULL; f = f->next) {
+		free_objs[i++] = f;
+	}
+	qsort(free_objs, nfree, sizeof *free_objs, cmp_addr);
+
+	for (chunk_t* chunk = slab->chunks; chunk != NULL; chunk = chunk->next) {
+		uint8_t* base = (uint8_t*)chunk->objs;
+		for (size_t k = 0; k < slab->per_chunk; k++) {
+			void* obj = base + k * slab->objsize;
+			if (bsearch(&obj, free_objs, nfree, sizeof *free_objs, cmp_addr) == NULL) {
+				fn(obj, arg);
+			}
+		}
+	}
+	free(free_objs);
+}
+
+size_t slab_in_use(slab_t* slab) {
+	return slab->in_use;
+}
+
+void slab_destroy(slab_t* slab) {
+	chunk_t* chunk = slab->chunks;
+	while (chunk != NULL) {
+		chunk_t* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(slab);
+}
@@ -0,0 +1,36 @@
+/* header file for the fixed-size object pool */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* A pool of equally sized objects carved out of large chunks. Freed objects
+ * go on a free list and are handed out again before a new chunk is
+ * allocated; memory is only returned to the system by slab_destroy.
+ * Not thread safe: each event loop owns its slabs.
+ */
+typedef struct slab slab_t;
+
+/* Creates a pool of objsize byte objects, allocating per_chunk at a time */
+slab_t* slab_create(size_t objsize, size_t per_chunk);
+
+/* Takes an object from the pool; dies if memory is exhausted */
+void* slab_alloc(slab_t* slab);
+
+/* Returns obj, which came from slab_alloc on the same slab, to the pool */
+void slab_free(slab_t* slab, void* obj);
+
+/* Calls fn(obj, arg) on every object currently handed out; fn may free
+ * obj. Meant for rare sweeps: the free list is sorted to tell the objects
+ * apart, so a call costs O(n log n) in the objects of the pool.
+ */
+void slab_foreach(slab_t* slab, void (*fn)(void* obj, void* arg), void* arg);
+
+/* Number of objects currently handed out */
+size_t slab_in_use(slab_t* slab);
+
+/* Releases every chunk of the pool */
+void slab_destroy(slab_t* slab);
+
+#endif /* SLAB_H */
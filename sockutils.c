@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 
 /* POSIX compliance headers */
 #include <sys/socket.h>
@@ -15,7 +16,11 @@
 #include <netdb.h>
 
 #include <arpa/inet.h>
-#define N_BACKLOG 64
+/* Mass connect ramps (clients -c) complete hundreds of handshakes at
+ * once; with SYN cookies an overflowing accept queue silently drops them.
+ * The kernel caps this to net.core.somaxconn.
+ */
+#define N_BACKLOG SOMAXCONN
 
 void die(char* fmt, ...) {
 /* Print ERRORs and terminate */
@@ -52,15 +57,16 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-int __setup_socket__(char* server, char* port) {
+int __setup_socket__(char* server, char* port, int socktype) {
 /* Helper function to setup server or client sockets */
+/* -- socktype is SOCK_STREAM or SOCK_DGRAM */
 	
-	int sockfd;
+	int sockfd = -1;
 	struct addrinfo hints, *servinfo, *p;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;		/* Allow IPv4 or IPv6 */
-	hints.ai_socktype = SOCK_STREAM;	/* Stream socket */
+	hints.ai_socktype = socktype;		/* Stream or datagram socket */
 	if (server == NULL) {
 		hints.ai_flags = AI_PASSIVE; 		/* use my IP */
 	}
@@ -135,7 +141,7 @@ int listen_inet(char* port) {
 /* -- uses the provided port number */
 
 	/* setup the socket */
-	int sockfd = __setup_socket__(NULL, port);
+	int sockfd = __setup_socket__(NULL, port, SOCK_STREAM);
 
 	/* listen failure */
 	if (listen(sockfd, N_BACKLOG) == -1) {
@@ -149,7 +155,18 @@ int connect_inet(char* server, char* port) {
 /* Wrapper for client: socket creation and connection setup stages */
 
 	/* setup and connect */
-	return __setup_socket__(server, port);
+	return __setup_socket__(server, port, SOCK_STREAM);
+}
+
+int bind_udp(char* port) {
+/* Wrapper for datagram server: socket creation and bind stages */
+/* -- SO_REUSEPORT lets every worker bind its own socket to the port */
+	return __setup_socket__(NULL, port, SOCK_DGRAM);
+}
+
+int connect_udp(char* server, char* port) {
+/* Wrapper for datagram client: fixes the default peer address */
+	return __setup_socket__(server, port, SOCK_DGRAM);
 }
 
 void connection_report(const struct sockaddr* sa, socklen_t salen) {
@@ -168,6 +185,22 @@ void connection_report(const struct sockaddr* sa, socklen_t salen) {
 	}
 }
 
+ssize_t send_all(int sockfd, const void* buf, size_t len) {
+/* Wrapper for send: keep sending until the whole buffer is out */
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t n = send(sockfd, (const char*)buf + sent, len - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		sent += n;
+	}
+	return sent;
+}
+
 void make_socket_non_blocking(int sockfd) {
 /* make socket non-blocking */
 	int flags = fcntl(sockfd, F_GETFL, 0);
@@ -33,6 +33,22 @@ int listen_inet(char* portnum);
  */
 int connect_inet(char* server, char* portnum);
 
+/* Creates a bound INET datagram socket on the given port number. Several
+ * sockets may bind the same port (SO_REUSEPORT). Returns the socket fd when
+ * successful; dies in case of errors.
+ */
+int bind_udp(char* portnum);
+
+/* Creates an INET datagram socket connected to the given server, port number.
+ * Returns the socket fd when successful; dies in case of errors.
+ */
+int connect_udp(char* server, char* portnum);
+
+/* Sends all len bytes of buf on a blocking socket, retrying short sends.
+ * Returns len when successful, -1 (with errno set) on errors.
+ */
+ssize_t send_all(int sockfd, const void* buf, size_t len);
+
 /* Sets the given socket into non-blocking mode */
 void make_socket_non_blocking(int sockfd);
 
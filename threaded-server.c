@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include <pthread.h>
 #include <unistd.h>
@@ -8,76 +11,170 @@
 #include <sys/socket.h>
 
 #include "sockutils.h"
-
-typedef struct {int sockfd; } thread_conf_t;
-/* Server states */
-typedef enum { WAIT_FOR_MSG, IN_MSG } ServerState;
-
-void serve_connection(int sockfd) {
-/* serves connected client */
-
-	/* assume well behaved clients that waits for server hello */
-	if (send(sockfd, "*", 1, 0) < 1)
-		perror_die("server: send");
-
-	ServerState state = WAIT_FOR_MSG;
+#include "latency.h"
+#include "serve.h"
+
+#define DEFAULT_STACK_KB 64	/* instead of the 8 MB glibc default */
+#define DEFAULT_MAX_CACHED 64	/* parked threads kept for reuse */
+#define CACHE_IDLE_SECS 30	/* a parked thread exits after this long */
+#define STATS_INTERVAL 1000	/* print cache stats every this many accepts */
+
+/* A connection thread. When its client is done it parks in the cache and
+ * waits for the next accepted socket instead of exiting, so connection
+ * churn does not pay for clone/mmap/munmap of a thread every time.
+ */
+typedef struct worker {
+	pthread_cond_t wake;
+	int sockfd;		/* -1 while parked */
+	int64_t accept_ns;	/* for the latency trace */
+	struct worker *next;
+} worker_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	worker_t *parked;	/* LIFO: the most recently used stack is warmest */
+	int nparked, max_parked;
+	unsigned long created;	/* connections that needed a new thread */
+	unsigned long reused;	/* connections served by a parked thread */
+	pthread_attr_t attr;	/* small stack, guard page, detached */
+} thread_cache_t;
+
+thread_cache_t cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+void *server_thread(void *arg) {
+/* server threads to server_connection to multiple clients at the same time */
+	worker_t *w = (worker_t *)arg;
+	unsigned long id = (unsigned long)pthread_self();
+	printf("Thread %lu created to handle connection with socket %d\n", id,
+		w->sockfd);
 
 	while (1) {
-		uint8_t buf[1024];
-		int len = recv(sockfd, buf, sizeof buf, 0);
-		if (len < 0)
-			perror_die("server: recv");
-		else if (len == 0)
-			break;
+		serve_connection(w->sockfd, w->accept_ns);
+		printf("Thread %lu done \n", id);
 
-		for (int i=0; i<len; ++i) {
-			switch (state) {
-				case WAIT_FOR_MSG:
-					if (buf[i] == '^')
-						state = IN_MSG;
-					break;
-				case IN_MSG:
-					if (buf[i] == '$')
-						state = WAIT_FOR_MSG;
-					else {
-						buf[i] += 1;
-						if (send(sockfd, &buf[i], 1, 0) <1) {
-							perror("server: send error");
-							close(sockfd);
-							return;
-						}
-					}
-					break;
+		/* park in the cache until the next connection or the idle timeout */
+		pthread_mutex_lock(&cache.lock);
+		if (cache.nparked >= cache.max_parked) {
+			pthread_mutex_unlock(&cache.lock);
+			break;
+		}
+		w->sockfd = -1;
+		w->next = cache.parked;
+		cache.parked = w;
+		cache.nparked++;
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += CACHE_IDLE_SECS;
+		int rc = 0;
+		while (w->sockfd < 0 && rc != ETIMEDOUT) {
+			rc = pthread_cond_timedwait(&w->wake, &cache.lock, &deadline);
+		}
+		if (w->sockfd < 0) {
+			/* timed out while still parked: unlink and exit */
+			worker_t **pp = &cache.parked;
+			while (*pp != w) {
+				pp = &(*pp)->next;
 			}
+			*pp = w->next;
+			cache.nparked--;
+			pthread_mutex_unlock(&cache.lock);
+			break;
 		}
+		pthread_mutex_unlock(&cache.lock);
+		printf("Thread %lu reused to handle connection with socket %d\n", id,
+			w->sockfd);
 	}
 
-	close(sockfd);
+	pthread_cond_destroy(&w->wake);
+	free(w);
+	return NULL;
 }
 
-void *server_thread(void *arg) {
-/* server threads to server_connection to multiple clients at the same time */
-	thread_conf_t* data = (thread_conf_t*)arg;
-	int sockfd = data->sockfd;
-	free(data);
-
-	unsigned long id = (unsigned long)pthread_self();
-	printf("Thread %lu created to handle connection with socket %d\n", id,
-		sockfd);	
+void dispatch_connection(int sockfd, int64_t accept_ns) {
+/* hand sockfd to a parked thread, or start a new one */
+	pthread_mutex_lock(&cache.lock);
+	worker_t *w = cache.parked;
+	if (w != NULL) {
+		cache.parked = w->next;
+		cache.nparked--;
+		cache.reused++;
+		w->sockfd = sockfd;
+		w->accept_ns = accept_ns;
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&cache.lock);
+		return;
+	}
+	cache.created++;
+	pthread_mutex_unlock(&cache.lock);
+
+	w = (worker_t *)xmalloc(sizeof(*w));
+	pthread_cond_init(&w->wake, NULL);
+	w->sockfd = sockfd;
+	w->accept_ns = accept_ns;
+	pthread_t t_sock;
+	if (pthread_create(&t_sock, &cache.attr, server_thread, w)) {
+		die("thread creation error");
+	}
+}
 
-	serve_connection(sockfd);
-	printf("Thread %lu done \n", id);
+void print_cache_stats(double elapsed) {
+	pthread_mutex_lock(&cache.lock);
+	unsigned long created = cache.created, reused = cache.reused;
+	int parked = cache.nparked;
+	pthread_mutex_unlock(&cache.lock);
+
+	unsigned long total = created + reused;
+	printf("threads: %lu created, %lu reused (%.1f%% hits), %d parked, "
+		"%.1f creations/s\n", created, reused,
+		total ? 100.0 * reused / total : 0.0, parked,
+		elapsed > 0 ? created / elapsed : 0.0);
 }
 
 int main(int argc, char** argv)
 {
+	int stack_kb = DEFAULT_STACK_KB;
+	cache.max_parked = DEFAULT_MAX_CACHED;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				stack_kb = atoi(optarg);
+				break;
+			case 'c':
+				cache.max_parked = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: threaded-server "
+						"[-s stack_kb] "
+						"[-c max_cached_threads] "
+						"[port_num]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
 	char *port = "9090";
-	if(argc >= 2) {
-		port = argv[1];
+	if (optind < argc) {
+		port = argv[optind];
 	}
+	lat_init();
 	printf("Serving on port: %s\n",port);
+
+	/* detached threads with small stacks and a guard page below them */
+	size_t stacksize = (size_t)stack_kb * 1024;
+	if (stacksize < PTHREAD_STACK_MIN) {
+		stacksize = PTHREAD_STACK_MIN;
+	}
+	pthread_attr_init(&cache.attr);
+	if (pthread_attr_setstacksize(&cache.attr, stacksize) ||
+			pthread_attr_setguardsize(&cache.attr, sysconf(_SC_PAGESIZE)) ||
+			pthread_attr_setdetachstate(&cache.attr, PTHREAD_CREATE_DETACHED)) {
+		die("thread attribute setup error");
+	}
+	printf("Thread stacks: %zu KB, up to %d cached threads\n",
+		stacksize / 1024, cache.max_parked);
 	
 	int sockfd = listen_inet(port);
+	time_t start = time(NULL);
+	unsigned long accepted = 0;
 
 	while(1) { /* server keeps on running */
 		struct sockaddr_storage their_addr;
@@ -88,23 +185,17 @@ int main(int argc, char** argv)
 	        if (newsockfd < 0) {
 			perror_die("accept");
 		}
+		int64_t accept_ns = LAT_NOW();
 
 		connection_report((struct sockaddr *)&their_addr, sin_size);
 
-		/* create a new thread to handle communications,
+		/* hand communications to a cached or new thread,
 		 * once connection established */
-		pthread_t t_sock;
-		thread_conf_t* data = (thread_conf_t*)malloc(sizeof(*data));
-		if(!data) {
-			die("thread resource allocation error");
-		}
-		data->sockfd = newsockfd;
-		pthread_create(&t_sock, NULL, server_thread, data);
+		dispatch_connection(newsockfd, accept_ns);
 
-		/* original thread keeps running forever
-		 * so, just detach the child threads so that resources from
-		 * dead threads willl be cleaned up */
-		pthread_detach(t_sock);
+		if (++accepted % STATS_INTERVAL == 0) {
+			print_cache_stats(difftime(time(NULL), start));
+		}
 	}
 
 	return 0;
@@ -8,65 +8,27 @@
 #include <sys/socket.h>
 
 #include "sockutils.h"
+#include "latency.h"
+#include "serve.h"
 #include "threadpool.h"
 
-typedef struct { int sockfd; } tconf_t;
-/* Server states */
-typedef enum { WAIT_FOR_MSG, IN_MSG } ServerState;
-
-void serve_connection(int sockfd) {
-/* serves connected client */
-
-	/* assume well behaved clients that waits for server hello */
-	if (send(sockfd, "*", 1, 0) < 1)
-	{printf("%d", sockfd);
-		perror_die("server: send");}
-
-	ServerState state = WAIT_FOR_MSG;
-
-	while (1) {
-		uint8_t buf[1024];
-		int len = recv(sockfd, buf, sizeof buf, 0);
-		if (len < 0)
-			perror_die("server: recv");
-		else if (len == 0)
-			break;
-
-		for (int i=0; i<len; ++i) {
-			switch (state) {
-				case WAIT_FOR_MSG:
-					if (buf[i] == '^')
-						state = IN_MSG;
-					break;
-				case IN_MSG:
-					if (buf[i] == '$')
-						state = WAIT_FOR_MSG;
-					else {
-						buf[i] += 1;
-						if (send(sockfd, &buf[i], 1, 0) <1) {
-							perror("server: send error");
-							close(sockfd);
-							return;
-						}
-					}
-					break;
-			}
-		}
-	}
-	close(sockfd);
-}
+#define STATS_INTERVAL 1000	/* print pool stats every this many accepts */
+/* connections block a worker each: let the pool grow well past the CPUs */
+#define MAX_THREADS_PER_CPU 8
 
+typedef struct { int sockfd; int64_t accept_ns; } tconf_t;
 void server_thread(void *arg) {
 /* server threads to server_connection to multiple clients at the same time */
 	tconf_t* data = (tconf_t*)arg;
 	int sockfd = data->sockfd;
+	int64_t accept_ns = data->accept_ns;
 	free(data);
 	
 	unsigned long id = (unsigned long)pthread_self();
 	printf("Thread %lu created to handle connection with socket %d\n", id,
 		sockfd);
 
-	serve_connection(sockfd);
+	serve_connection(sockfd, accept_ns);
 
 	printf("Thread %lu done \n", id);
 }
@@ -77,17 +39,26 @@ int main(int argc, char** argv)
 	if(argc >= 2) {
 		port = argv[1];
 	}
-	int n_threads = 2;
+	int min_threads = tpool_default_threads();
 	if(argc >= 3) {
-		n_threads = atoi(argv[2]);
+		min_threads = atoi(argv[2]);
+	}
+	int max_threads = min_threads * MAX_THREADS_PER_CPU;
+	if(argc >= 4) {
+		max_threads = atoi(argv[3]);
 	}
 
-	printf("Serving on port: %s\n",port);
+	lat_init();
+	printf("Serving on port: %s with %d to %d threads\n", port,
+		min_threads, max_threads);
 	
-	tpool_t tp = tpool_create(n_threads);
+	tpool_t tp = tpool_create_elastic(min_threads, max_threads);
+	if (tp == NULL) {
+		die("threadpool: bad thread counts");
+	}
 
 	int sockfd = listen_inet(port);
-	int thr = 0;
+	unsigned long accepted = 0;
 	while(1) { /* server keeps on running */
 	
 		struct sockaddr_storage their_addr;
@@ -97,6 +68,7 @@ int main(int argc, char** argv)
 		if (new_fd < 0) {
 			perror_die("accept");
 		}
+		int64_t accept_ns = LAT_NOW();
 		connection_report((struct sockaddr *)&their_addr, sin_size);
 
 		tconf_t* data = (tconf_t*)malloc(sizeof(*data));
@@ -104,8 +76,29 @@ int main(int argc, char** argv)
 			die("Thread resource allocation error");
 		}
 		data->sockfd = new_fd;
-
-		tpool_dispatch(tp, server_thread, data);
+		data->accept_ns = accept_ns;
+
+		/* connections hold a worker for their whole life: keep them on
+		 * the bulk lane so short jobs on the other lanes get ahead */
+		tpool_dispatch_lane(tp, TPOOL_BULK, server_thread, data);
+
+		if (++accepted % STATS_INTERVAL == 0) {
+			tpool_stats_t st;
+			tpool_stats(tp, &st);
+			printf("pool: %d threads (%lu grown, %lu retired), "
+				"%lu spin hits, %lu parks, %lu wakeups, "
+				"mean gap %ldns, spin budget %ldns\n",
+				st.threads, (unsigned long)st.grown,
+				(unsigned long)st.retired,
+				(unsigned long)st.spin_hits, (unsigned long)st.parks,
+				(unsigned long)st.wakeups, (long)st.mean_gap_ns,
+				(long)st.spin_budget_ns);
+			tpool_lane_stats_t ls;
+			tpool_lane_stats(tp, TPOOL_BULK, &ls);
+			printf("bulk lane: depth %d (max %d), mean wait %ldns, "
+				"max wait %ldns\n", ls.depth, ls.max_depth,
+				(long)ls.mean_wait_ns, (long)ls.max_wait_ns);
+		}
 
 	}
 
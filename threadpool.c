@@ -1,183 +1,900 @@
 /* thradpool implementaion */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "threadpool.h"
 
+/* upper bound on how long an idle worker spins before parking */
+#define MAX_SPIN_NS 50000
+/* spin for this many times the recent mean gap between dispatches */
+#define SPIN_GAP_FACTOR 2
+/* pause instructions between clock reads while spinning */
+#define SPIN_CHECK_EVERY 64
+/* a job waiting this long is dequeued ahead of the lane weights */
+#define DEFAULT_STARVE_NS 10000000
+/* parked workers woken after dropping the lock, the rest under it */
+#define WAKE_BATCH 64
+
+/* elastic sizing: the monitor looks at the pool this often while jobs are
+ * queued and it may grow; otherwise it sleeps until that changes */
+#define MONITOR_NS 2000000
+/* grow when the oldest queued job has waited this long */
+#define GROW_WAIT_NS 1000000
+/* a worker inside one job for this long counts as blocked */
+#define BLOCKED_NS 10000000
+/* workers above the minimum retire after parking this long */
+#define IDLE_RETIRE_NS 5000000000LL
+
 /* job struct */
 typedef struct work_st{
 	void (*routine) (void*);
 	void * arg;
+	tpool_future_t* done;		/* counted down when the job finishes */
+	int64_t enqueued_ns;		/* for the lane wait-time stats */
 	struct work_st* next;
 } work_t;
 
+/* one priority lane: a FIFO plus its share of the workers */
+typedef struct {
+	work_t* head;
+	work_t* tail;
+	_Atomic int size;		/* peeked at by spinners */
+	int weight;			/* share of dequeues while lanes compete */
+	int credit;			/* smooth weighted round robin state */
+	int reserved;			/* workers serving only this lane */
+
+	/* stats, under qlock */
+	int max_depth;
+	uint64_t dequeued;
+	uint64_t aged;			/* dequeued past the starvation limit */
+	int64_t wait_ns_total;
+	int64_t wait_ns_max;
+} lane_t;
+
+/* default weights: realtime, normal, bulk */
+static const int default_weight[TPOOL_LANES] = { 16, 4, 1 };
+
+/* completion latch: done once remaining drops to zero */
+struct tpool_future {
+	_Atomic int remaining;
+	int done;			/* under lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void (*callback)(void*);
+	void* callback_arg;
+};
+
+struct _threadpool_st;
+
+/* per-thread state: each worker parks on its own futex word, so a producer
+ * can wake exactly one of them */
+typedef struct worker_st {
+	_Atomic uint32_t wake;		/* futex word: 0 parked, 1 woken */
+	struct worker_st* next_parked;	/* parked stack link */
+	int lane;			/* reserved lane, -1 if shared; under qlock */
+	int idle;			/* looking for work; under qlock */
+	_Atomic int64_t job_start_ns;	/* 0 between jobs, read by the monitor */
+	struct worker_st* next;		/* all workers, under qlock */
+	pthread_t thread;
+	struct _threadpool_st* pool;
+} worker_t;
+
 /* Internal representation of threadpool */
 /* cast to type "tpool_t" before it given out to callers */
 typedef struct _threadpool_st {
 	int num_threads;		/* number of threads */
-	int qsize;			/* queue size */
-	pthread_t *threads;		/* ptr to threads */
-	work_t* qhead;			/* queue head ptr */
-	work_t* qtail;			/* queue tail ptr */
+	int min_threads;		/* elastic range; equal for a fixed pool */
+	int max_threads;
+	_Atomic int qsize;		/* jobs in all lanes, peeked at by spinners */
+	worker_t *workers;		/* list of threads */
+	lane_t lanes[TPOOL_LANES];	/* job queues by priority */
+	int64_t starve_ns;		/* age that overrides the lane weights */
 	pthread_mutex_t qlock;		/* mutex lock to use on queue */
-	pthread_cond_t q_not_empty;	/* check queue emptiness */
-	pthread_cond_t q_empty;
+	worker_t* parked;		/* idle workers sleeping on their futex */
+	_Atomic int active;		/* jobs taken off the queue, not finished */
+	_Atomic int idle_waiters;	/* threads in tpool_wait_all */
+	pthread_cond_t q_idle;		/* queue empty and nothing running */
 	int shutdown;
 	int dont_accept;
+
+	/* elastic pools only */
+	pthread_t monitor;
+	pthread_cond_t monitor_cond;	/* wakes the monitor for work or shutdown */
+	int monitor_parked;		/* monitor waits untimed; under qlock */
+	uint64_t grown;			/* workers started above the minimum */
+	uint64_t retired;		/* idle workers that exited */
+
+	/* arrival rate, sizes the spin budget */
+	_Atomic int64_t last_dispatch_ns;
+	_Atomic int64_t mean_gap_ns;	/* EWMA of the gap between dispatches */
+
+	/* idle strategy counters */
+	_Atomic uint64_t spin_hits;	/* work showed up while spinning */
+	_Atomic uint64_t parks;		/* worker went to sleep */
+	_Atomic uint64_t wakeups;	/* producer woke a parked worker */
 } _threadpool;
 
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* timeout_ns < 0 waits forever */
+static void futex_wait(_Atomic uint32_t* word, uint32_t val, int64_t timeout_ns) {
+	struct timespec ts = { timeout_ns / 1000000000, timeout_ns % 1000000000 };
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val,
+			timeout_ns < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t* word) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Spin budget from the recent arrival rate: worth spinning only when the
+ * next job is likely to show up sooner than a park/wake round trip */
+static int64_t spin_budget(_threadpool* pool) {
+	int64_t gap = atomic_load_explicit(&pool->mean_gap_ns, memory_order_relaxed);
+	if (gap <= 0 || gap > MAX_SPIN_NS) {
+		return 0;
+	}
+	int64_t budget = gap * SPIN_GAP_FACTOR;
+	return budget < MAX_SPIN_NS ? budget : MAX_SPIN_NS;
+}
+
+/* Spin for up to the budget watching a queue size; true if work showed up */
+static int spin_for_work(_threadpool* pool, _Atomic int* qsize) {
+	int64_t budget = spin_budget(pool);
+	if (budget == 0) {
+		return 0;
+	}
+	int64_t deadline = now_ns() + budget;
+	while (1) {
+		for (int i = 0; i < SPIN_CHECK_EVERY; i++) {
+			if (atomic_load_explicit(qsize, memory_order_relaxed) > 0 ||
+					pool->shutdown) {
+				return 1;
+			}
+			cpu_relax();
+		}
+		if (now_ns() >= deadline) {
+			return 0;
+		}
+	}
+}
+
+tpool_future_t* tpool_future_create(int count) {
+	tpool_future_t* f = (tpool_future_t*) malloc(sizeof(tpool_future_t));
+	if (f == NULL) {
+		fprintf(stderr, "Out of memory creating a future!\n");
+		return NULL;
+	}
+	atomic_init(&f->remaining, count);
+	f->done = count <= 0;
+	f->callback = NULL;
+	f->callback_arg = NULL;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	return f;
+}
+
+/* one job of the future finished; the last one releases the waiters and
+ * runs the callback on the worker thread */
+static void future_count_down(tpool_future_t* f) {
+	if (atomic_fetch_sub_explicit(&f->remaining, 1, memory_order_acq_rel) != 1) {
+		return;
+	}
+	pthread_mutex_lock(&f->lock);
+	f->done = 1;
+	void (*cb)(void*) = f->callback;
+	void* cb_arg = f->callback_arg;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+	if (cb != NULL) {
+		cb(cb_arg);
+	}
+}
+
+int tpool_future_poll(tpool_future_t* f) {
+	return atomic_load_explicit(&f->remaining, memory_order_acquire) <= 0;
+}
+
+void tpool_future_wait(tpool_future_t* f) {
+	/* done, not remaining: the worker that counts remaining down to zero
+	 * only sets done once it holds the lock, and is finished with f when
+	 * it releases it, so f may be destroyed as soon as this returns */
+	pthread_mutex_lock(&f->lock);
+	while (!f->done) {
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	pthread_mutex_unlock(&f->lock);
+}
+
+void tpool_future_on_done(tpool_future_t* f, void (*callback)(void*), void* arg) {
+	pthread_mutex_lock(&f->lock);
+	if (f->done) {
+		pthread_mutex_unlock(&f->lock);
+		callback(arg);
+		return;
+	}
+	f->callback = callback;
+	f->callback_arg = arg;
+	pthread_mutex_unlock(&f->lock);
+}
+
+void tpool_future_destroy(tpool_future_t* f) {
+	/* a worker may still be inside future_count_down */
+	tpool_future_wait(f);
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+/* size of the queue(s) a worker serves; caller holds qlock */
+static _Atomic int* served_size(_threadpool* pool, worker_t* w) {
+	return w->lane < 0 ? &pool->qsize : &pool->lanes[w->lane].size;
+}
+
+/* Picks the lane the next job comes from, -1 if none the worker serves has
+ * work; caller holds qlock. A head older than starve_ns goes first, then
+ * lanes share dequeues by weight (smooth weighted round robin) */
+static int pick_lane(_threadpool* pool, worker_t* self) {
+	if (self->lane >= 0) {
+		return pool->lanes[self->lane].size > 0 ? self->lane : -1;
+	}
+	if (pool->qsize == 0) {
+		return -1;
+	}
+
+	int pick = -1;
+	int64_t oldest = now_ns() - pool->starve_ns;
+	for (int l = 0; l < TPOOL_LANES; l++) {
+		lane_t* ln = &pool->lanes[l];
+		if (ln->size > 0 && ln->head->enqueued_ns < oldest) {
+			oldest = ln->head->enqueued_ns;
+			pick = l;
+		}
+	}
+	if (pick >= 0) {
+		pool->lanes[pick].aged++;
+		return pick;
+	}
+
+	int total = 0;
+	for (int l = 0; l < TPOOL_LANES; l++) {
+		lane_t* ln = &pool->lanes[l];
+		if (ln->size > 0) {
+			ln->credit += ln->weight;
+			total += ln->weight;
+			if (pick < 0 || ln->credit > pool->lanes[pick].credit) {
+				pick = l;
+			}
+		}
+	}
+	pool->lanes[pick].credit -= total;
+	return pick;
+}
+
+/* takes a timed-out worker off the parked stack; caller holds qlock */
+static void unlink_parked(_threadpool* pool, worker_t* self) {
+	worker_t** link = &pool->parked;
+	while (*link != self) {
+		link = &(*link)->next_parked;
+	}
+	*link = self->next_parked;
+}
+
+/* wakes a parked monitor: jobs arrived or a worker left; caller holds qlock */
+static void kick_monitor(_threadpool* pool) {
+	if (pool->monitor_parked) {
+		pool->monitor_parked = 0;
+		pthread_cond_signal(&(pool->monitor_cond));
+	}
+}
+
+/* exits an idle worker of an elastic pool; caller holds qlock */
+static void retire(_threadpool* pool, worker_t* self) {
+	worker_t** link = &pool->workers;
+	while (*link != self) {
+		link = &(*link)->next;
+	}
+	*link = self->next;
+	pool->num_threads--;
+	pool->retired++;
+	kick_monitor(pool);
+	pthread_mutex_unlock(&(pool->qlock));
+	pthread_detach(self->thread);
+	free(self);
+	pthread_exit(NULL);
+}
+
 /* Thread pool queue management */
-void* do_work(tpool_t p) {
-	_threadpool * pool = (_threadpool *) p;
+void* do_work(void* p) {
+	worker_t* self = (worker_t *) p;
+	_threadpool * pool = self->pool;
 	work_t* cur;
-	int k;
+	int lane;
+	int elastic = pool->min_threads < pool->max_threads;
 
 	/* selecting job from the queue for current thread */
 	while(1) {
-		pool->qsize = pool->qsize;
 		pthread_mutex_lock(&(pool->qlock));	/* lock critical section */
 
-		while( pool->qsize == 0) {		/* nothing in queue */
+		while ((lane = pick_lane(pool, self)) < 0) {	/* nothing to serve */
 			if(pool->shutdown) {		/* thread pool is shutdown, unlock and exit thread */
 				pthread_mutex_unlock(&(pool->qlock));
 				pthread_exit(NULL);
 			}
-			/* give up lock and wait for something to arrive in queue */
-			pthread_mutex_unlock(&(pool->qlock)); 
-			pthread_cond_wait(&(pool->q_not_empty),&(pool->qlock));
+			self->idle = 1;
 
-			/* check for shutdown condition */
-			if(pool->shutdown) {
-				pthread_mutex_unlock(&(pool->qlock));
-				pthread_exit(NULL);
+			/* spin first: a burst of short tasks should not pay a
+			 * futex wake and context switch per task */
+			_Atomic int* watch = served_size(pool, self);
+			pthread_mutex_unlock(&(pool->qlock));
+			int hit = spin_for_work(pool, watch);
+			pthread_mutex_lock(&(pool->qlock));
+			if (hit) {
+				if (*served_size(pool, self) > 0) {
+					atomic_fetch_add_explicit(&pool->spin_hits, 1, memory_order_relaxed);
+				}
+				continue;
+			}
+			if (*served_size(pool, self) > 0 || pool->shutdown) {
+				continue;
+			}
+
+			/* park: join the parked stack under the lock, so a producer
+			 * that enqueues after this point is sure to see us */
+			atomic_store_explicit(&self->wake, 0, memory_order_relaxed);
+			self->next_parked = pool->parked;
+			pool->parked = self;
+			atomic_fetch_add_explicit(&pool->parks, 1, memory_order_relaxed);
+			pthread_mutex_unlock(&(pool->qlock));
+			int64_t deadline = now_ns() + IDLE_RETIRE_NS;
+			while (atomic_load_explicit(&self->wake, memory_order_acquire) == 0) {
+				int64_t left = elastic ? deadline - now_ns() : -1;
+				if (elastic && left <= 0) {
+					break;
+				}
+				futex_wait(&self->wake, 0, left);
+			}
+			pthread_mutex_lock(&(pool->qlock));
+
+			/* timed out with nobody popping us: retire if the pool is
+			 * above its minimum, else park again */
+			if (atomic_load_explicit(&self->wake, memory_order_relaxed) == 0) {
+				unlink_parked(pool, self);
+				if (self->lane < 0 && !pool->shutdown &&
+						pool->num_threads > pool->min_threads) {
+					retire(pool, self);
+				}
 			}
 		}
+		self->idle = 0;
 
-		cur = pool->qhead;		/* select job at head of queue */
+		lane_t* ln = &pool->lanes[lane];
+		cur = ln->head;			/* select job at head of lane */
 
 		/* remove it from queue since it will be dispached */
-		pool->qsize--;
-		if(pool->qsize == 0) {
-			pool->qhead = NULL;
-			pool->qtail = NULL;
-		}
-		else {
-			pool->qhead = cur->next;
+		ln->head = cur->next;
+		if (ln->head == NULL) {
+			ln->tail = NULL;
 		}
+		ln->size--;
+		pool->qsize--;
+		pool->active++;
 
-		if(pool->qsize == 0 && ! pool->shutdown) {	/* signal that queue is empty */
-			pthread_cond_signal(&(pool->q_empty));
+		int64_t start = now_ns();
+		int64_t wait = start - cur->enqueued_ns;
+		ln->dequeued++;
+		ln->wait_ns_total += wait;
+		if (wait > ln->wait_ns_max) {
+			ln->wait_ns_max = wait;
 		}
+
+		atomic_store_explicit(&self->job_start_ns, start, memory_order_relaxed);
 		pthread_mutex_unlock(&(pool->qlock));		/* free the lock */
 		(cur->routine) (cur->arg);			/* perform the task */
+		atomic_store_explicit(&self->job_start_ns, 0, memory_order_relaxed);
+		if (cur->done != NULL) {
+			future_count_down(cur->done);
+		}
 		free(cur);				/* free the memory associated with completed task */
+
+		/* only take the lock when someone waits for the pool to go idle;
+		 * seq_cst pairs with the waiter's increment of idle_waiters */
+		atomic_fetch_sub(&pool->active, 1);
+		if (atomic_load(&pool->idle_waiters) > 0) {
+			pthread_mutex_lock(&(pool->qlock));
+			if (pool->qsize == 0 && pool->active == 0) {
+				pthread_cond_broadcast(&(pool->q_idle));
+			}
+			pthread_mutex_unlock(&(pool->qlock));
+		}
+	}
+}
+
+/* pops one parked worker able to serve lane (any worker for -1), if any,
+ * preferring one reserved for the lane; caller holds qlock and wakes it
+ * after unlocking */
+static worker_t* pop_parked(_threadpool* pool, int lane) {
+	worker_t **link, **pick = NULL;
+	for (link = &pool->parked; *link != NULL; link = &(*link)->next_parked) {
+		worker_t* w = *link;
+		if (lane < 0 || w->lane == lane) {
+			pick = link;
+			break;
+		}
+		if (w->lane < 0 && pick == NULL) {
+			pick = link;
+		}
+	}
+	if (pick == NULL) {
+		return NULL;
+	}
+	worker_t* w = *pick;
+	*pick = w->next_parked;
+	atomic_store_explicit(&w->wake, 1, memory_order_release);
+	atomic_fetch_add_explicit(&pool->wakeups, 1, memory_order_relaxed);
+	return w;
+}
+
+/* starts one more worker as a shared one; caller holds qlock */
+static int spawn_worker(_threadpool* pool) {
+	worker_t* w = (worker_t*) calloc(1, sizeof(worker_t));
+	if (w == NULL) {
+		fprintf(stderr, "Not enough memory to create a worker!\n");
+		return -1;
+	}
+	w->pool = pool;
+	w->lane = -1;
+	if (pthread_create(&w->thread, NULL, do_work, w)) {
+		fprintf(stderr, "Thread initiation error!\n");
+		free(w);
+		return -1;
+	}
+	w->next = pool->workers;
+	pool->workers = w;
+	pool->num_threads++;
+	return 0;
+}
+
+/* Grows an elastic pool when queued work has no shared worker to go to,
+ * and either it has waited GROW_WAIT_NS or every shared worker is blocked
+ * inside a long job; caller holds qlock */
+static void maybe_grow(_threadpool* pool) {
+	if (pool->qsize == 0 || pool->num_threads >= pool->max_threads) {
+		return;
+	}
+	int64_t now = now_ns();
+	int shared = 0, blocked = 0;
+	for (worker_t* w = pool->workers; w != NULL; w = w->next) {
+		if (w->lane >= 0) {
+			continue;
+		}
+		if (w->idle) {
+			return;		/* it will get to the queue */
+		}
+		shared++;
+		int64_t start = atomic_load_explicit(&w->job_start_ns, memory_order_relaxed);
+		if (start != 0 && now - start >= BLOCKED_NS) {
+			blocked++;
+		}
+	}
+
+	int64_t oldest = now;
+	for (int l = 0; l < TPOOL_LANES; l++) {
+		lane_t* ln = &pool->lanes[l];
+		if (ln->size > 0 && ln->head->enqueued_ns < oldest) {
+			oldest = ln->head->enqueued_ns;
+		}
+	}
+
+	int want;
+	if (blocked == shared) {
+		want = pool->qsize;		/* nobody will come back soon */
+	} else if (now - oldest >= GROW_WAIT_NS) {
+		want = shared / 4 > 1 ? shared / 4 : 1;
+	} else {
+		return;
+	}
+	if (want > pool->qsize) {
+		want = pool->qsize;
 	}
+	if (want > pool->max_threads - pool->num_threads) {
+		want = pool->max_threads - pool->num_threads;
+	}
+	while (want-- > 0 && spawn_worker(pool) == 0) {
+		pool->grown++;
+	}
+}
+
+static void* monitor(void* p) {
+	_threadpool* pool = (_threadpool*) p;
+	pthread_mutex_lock(&(pool->qlock));
+	while (!pool->shutdown) {
+		if (pool->qsize == 0 || pool->num_threads >= pool->max_threads) {
+			/* nothing to grow for: an idle pool costs no wakeups */
+			pool->monitor_parked = 1;
+			pthread_cond_wait(&(pool->monitor_cond), &(pool->qlock));
+			pool->monitor_parked = 0;
+			continue;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += MONITOR_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&(pool->monitor_cond), &(pool->qlock), &ts);
+		if (!pool->shutdown) {
+			maybe_grow(pool);
+		}
+	}
+	pthread_mutex_unlock(&(pool->qlock));
+	return NULL;
 }
 
 /* Thread pool creation */
 tpool_t tpool_create(int n_threads) {
+	return tpool_create_elastic(n_threads, n_threads);
+}
+
+tpool_t tpool_create_elastic(int min_threads, int max_threads) {
 	_threadpool *pool;
 	int i;
 
-	/* Can't create threads more than a max */
-	if ((n_threads <= 0) || (n_threads > MAX_THREADS))
+	if ((min_threads <= 0) || (max_threads < min_threads))
 		return NULL;
 
 	/* Allocate memory for threadpool */
-	pool = (_threadpool *) malloc(sizeof(_threadpool));
+	pool = (_threadpool *) calloc(1, sizeof(_threadpool));
 	if (pool == NULL) {
 		fprintf(stderr, "Not enough memory to create threadpool!\n");
 		return NULL;
 	}
-	pool->threads = (pthread_t*) malloc (sizeof(pthread_t) * n_threads);
-	if(!pool->threads) {
-		fprintf(stderr, "Not enough memory to create threadpool!\n");
-		return NULL;	
-	}
 
 	/* Populate the threadpool structure */
-	pool->num_threads = n_threads; 
+	pool->num_threads = 0;
+	pool->min_threads = min_threads;
+	pool->max_threads = max_threads;
+	pool->workers = NULL;
 	pool->qsize = 0;
-	pool->qhead = NULL;
-	pool->qtail = NULL;
+	for (i = 0; i < TPOOL_LANES; i++) {
+		pool->lanes[i].weight = default_weight[i];
+	}
+	pool->starve_ns = DEFAULT_STARVE_NS;
+	pool->parked = NULL;
 	pool->shutdown = 0;
 	pool->dont_accept = 0;
 
-	/* initialize mutex and condition variables. */
+	/* initialize mutex and condition variables */
 	if(pthread_mutex_init(&pool->qlock,NULL)) {
 		fprintf(stderr, "Mutex initiation error!\n");
 		return NULL;
 	}
-	if(pthread_cond_init(&(pool->q_empty),NULL)) {
-		fprintf(stderr, "CV initiation error!\n");	
+	if(pthread_cond_init(&(pool->q_idle),NULL)) {
+		fprintf(stderr, "CV initiation error!\n");
 		return NULL;
 	}
-	if(pthread_cond_init(&(pool->q_not_empty),NULL)) {
-		fprintf(stderr, "CV initiation error!\n");	
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	if(pthread_cond_init(&(pool->monitor_cond),&ca)) {
+		fprintf(stderr, "CV initiation error!\n");
 		return NULL;
 	}
+	pthread_condattr_destroy(&ca);
 
 	/* make threads */
-	for (i = 0;i < n_threads; i++) {
-		if(pthread_create(&(pool->threads[i]),NULL,do_work,pool)) {
-			fprintf(stderr, "Thread initiation error!\n");	
-			return NULL;		
+	pthread_mutex_lock(&(pool->qlock));
+	for (i = 0;i < min_threads; i++) {
+		if (spawn_worker(pool)) {
+			pthread_mutex_unlock(&(pool->qlock));
+			return NULL;
 		}
 	}
+	pthread_mutex_unlock(&(pool->qlock));
+	if (min_threads < max_threads &&
+			pthread_create(&(pool->monitor), NULL, monitor, pool)) {
+		fprintf(stderr, "Thread initiation error!\n");
+		return NULL;
+	}
 	return (tpool_t)pool;
 }
 
-/* Dispatching jobs to the job queue */
-void tpool_dispatch(tpool_t tpool, dispatch_fn d_func, void *arg) {
-	_threadpool *pool = (_threadpool *) tpool;
-	work_t * cur;
-	int k;
+/* CPUs this process may run on, cut down to the cgroup CPU quota */
+int tpool_default_threads(void) {
+	int n = 1;
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == 0) {
+		n = CPU_COUNT(&set);
+	}
 
-	k = pool->qsize;
+	long quota = -1, period = 0;
+	FILE* f = fopen("/sys/fs/cgroup/cpu.max", "r");		/* cgroup v2 */
+	if (f != NULL) {
+		char q[32];
+		if (fscanf(f, "%31s %ld", q, &period) == 2 && q[0] != 'm') {
+			quota = atol(q);
+		}
+		fclose(f);
+	} else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+		if (fscanf(f, "%ld", &quota) != 1) {		/* cgroup v1 */
+			quota = -1;
+		}
+		fclose(f);
+		if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+			if (fscanf(f, "%ld", &period) != 1) {
+				period = 0;
+			}
+			fclose(f);
+		}
+	}
+	if (quota > 0 && period > 0) {
+		int cpus = (int)((quota + period - 1) / period);
+		if (cpus < n) {
+			n = cpus;
+		}
+	}
+	return n > 0 ? n : 1;
+}
 
-	/* creating work structure */
-	cur = (work_t*) malloc(sizeof(work_t));
-	if(cur == NULL) {
-		fprintf(stderr, "Out of memory creating a work struct!\n");
-		return;	
+static void note_arrival(_threadpool* pool) {
+/* track the arrival rate: EWMA with weight 1/8 */
+	int64_t now = now_ns();
+	int64_t last = atomic_exchange_explicit(&pool->last_dispatch_ns, now, memory_order_relaxed);
+	if (last != 0) {
+		int64_t mean = atomic_load_explicit(&pool->mean_gap_ns, memory_order_relaxed);
+		int64_t gap = now - last;
+		atomic_store_explicit(&pool->mean_gap_ns,
+				mean == 0 ? gap : mean + (gap - mean) / 8, memory_order_relaxed);
 	}
+}
 
-	/* populating the structure */
-	cur->routine = d_func;
-	cur->arg = arg;
-	cur->next = NULL;
+/* Appends the chain first..last of n jobs to lane under one lock round trip
+ * and wakes up to n parked workers; returns 0 if the pool refused them */
+static int publish(_threadpool* pool, int lane, work_t* first, work_t* last, int n) {
+	lane_t* ln = &pool->lanes[lane];
+	worker_t* wake[WAKE_BATCH];
+	int nwake = 0;
+
+	note_arrival(pool);
 
 	pthread_mutex_lock(&(pool->qlock));	/* lock before accessing thread pool */
 
 	if(pool->dont_accept) {			/* pool configured not to accept any more */
-		free(cur);
-		return;
+		pthread_mutex_unlock(&(pool->qlock));
+		return 0;
+	}
+	if(ln->size == 0) {			/* dispatch immediately if lane empty */
+		ln->head = first;
+	} else {				/* put at end of lane if threads all used */
+		ln->tail->next = first;
 	}
-	if(pool->qsize == 0) {			/* dispatch immediately if queue empty */
-		pool->qhead = cur;
-		pool->qtail = cur;
-		pthread_cond_signal(&(pool->q_not_empty));	/* signal queue empty */
-	} else {				/* put at end of queue if threads all used */
-		pool->qtail->next = cur;
-		pool->qtail = cur;			
+	ln->tail = last;
+	ln->size += n;
+	pool->qsize += n;
+	kick_monitor(pool);
+	if (ln->size > ln->max_depth) {
+		ln->max_depth = ln->size;
+	}
+
+	/* spinning workers pick the jobs up on their own; otherwise wake
+	 * one parked worker per job */
+	while (nwake < n) {
+		worker_t* w = pop_parked(pool, lane);
+		if (w == NULL) {
+			break;
+		}
+		if (nwake < WAKE_BATCH) {
+			wake[nwake] = w;
+		} else {
+			futex_wake(&w->wake);
+		}
+		nwake++;
 	}
-	pool->qsize++;
 	pthread_mutex_unlock(&(pool->qlock));	/* release lock */
+	for (int i = 0; i < nwake && i < WAKE_BATCH; i++) {
+		futex_wake(&wake[i]->wake);
+	}
+	return 1;
+}
+
+/* Dispatching jobs to the job queue */
+void tpool_dispatch(tpool_t tpool, dispatch_fn d_func, void *arg) {
+	tpool_dispatch_lane(tpool, TPOOL_NORMAL, d_func, arg);
+}
+
+void tpool_dispatch_lane(tpool_t tpool, tpool_lane_t lane, dispatch_fn d_func,
+		void *arg) {
+	tpool_task_t task = { d_func, arg };
+	tpool_dispatch_batch(tpool, lane, &task, 1, NULL);
+}
+
+int tpool_dispatch_batch(tpool_t tpool, tpool_lane_t lane,
+		const tpool_task_t *tasks, int n, tpool_future_t *done) {
+	_threadpool *pool = (_threadpool *) tpool;
+	work_t *first = NULL, *last = NULL;
+
+	if (n <= 0) {
+		return 0;
+	}
+	if (lane < 0 || lane >= TPOOL_LANES) {
+		return -1;
+	}
+	int64_t now = now_ns();
+
+	/* build the chain outside the lock */
+	for (int i = 0; i < n; i++) {
+		work_t* cur = (work_t*) malloc(sizeof(work_t));
+		if(cur == NULL) {
+			fprintf(stderr, "Out of memory creating a work struct!\n");
+			while (first != NULL) {
+				work_t* next = first->next;
+				free(first);
+				first = next;
+			}
+			return -1;
+		}
+		cur->routine = tasks[i].routine;
+		cur->arg = tasks[i].arg;
+		cur->done = done;
+		cur->enqueued_ns = now;
+		cur->next = NULL;
+		if (last == NULL) {
+			first = cur;
+		} else {
+			last->next = cur;
+		}
+		last = cur;
+	}
+
+	if (!publish(pool, lane, first, last, n)) {
+		while (first != NULL) {
+			work_t* next = first->next;
+			free(first);
+			first = next;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+void tpool_wait_all(tpool_t tpool) {
+	_threadpool *pool = (_threadpool *) tpool;
+	pthread_mutex_lock(&(pool->qlock));
+	atomic_fetch_add(&pool->idle_waiters, 1);
+	while (pool->qsize > 0 || atomic_load(&pool->active) > 0) {
+		pthread_cond_wait(&(pool->q_idle), &(pool->qlock));
+	}
+	atomic_fetch_sub(&pool->idle_waiters, 1);
+	pthread_mutex_unlock(&(pool->qlock));
+}
+
+int tpool_set_lane(tpool_t tpool, tpool_lane_t lane, int weight, int reserved) {
+	_threadpool *pool = (_threadpool *) tpool;
+	if (lane < 0 || lane >= TPOOL_LANES || weight <= 0 || reserved < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&(pool->qlock));
+	int total = reserved;
+	for (int l = 0; l < TPOOL_LANES; l++) {
+		if (l != (int)lane) {
+			total += pool->lanes[l].reserved;
+		}
+	}
+	if (total >= pool->min_threads) {	/* keep one shared worker */
+		pthread_mutex_unlock(&(pool->qlock));
+		return -1;
+	}
+	pool->lanes[lane].weight = weight;
+	pool->lanes[lane].reserved = reserved;
+
+	/* hand out reservations from the head of the worker list; reserved
+	 * workers never retire, so these stay put */
+	worker_t* w = pool->workers;
+	for (int l = 0; l < TPOOL_LANES; l++) {
+		for (int k = 0; k < pool->lanes[l].reserved; k++, w = w->next) {
+			w->lane = l;
+		}
+	}
+	for (; w != NULL; w = w->next) {
+		w->lane = -1;
+	}
+
+	/* parked workers may now serve a different lane: let them recheck */
+	worker_t* p;
+	while ((p = pop_parked(pool, -1)) != NULL) {
+		futex_wake(&p->wake);
+	}
+	pthread_mutex_unlock(&(pool->qlock));
+	return 0;
+}
+
+void tpool_set_starve_limit(tpool_t tpool, int64_t starve_ns) {
+	_threadpool *pool = (_threadpool *) tpool;
+	pthread_mutex_lock(&(pool->qlock));
+	pool->starve_ns = starve_ns;
+	pthread_mutex_unlock(&(pool->qlock));
+}
+
+void tpool_lane_stats(tpool_t tpool, tpool_lane_t lane, tpool_lane_stats_t *stats) {
+	_threadpool *pool = (_threadpool *) tpool;
+	lane_t* ln = &pool->lanes[lane];
+	pthread_mutex_lock(&(pool->qlock));
+	stats->depth = ln->size;
+	stats->max_depth = ln->max_depth;
+	stats->weight = ln->weight;
+	stats->reserved = ln->reserved;
+	stats->dequeued = ln->dequeued;
+	stats->aged = ln->aged;
+	stats->mean_wait_ns = ln->dequeued ? ln->wait_ns_total / (int64_t)ln->dequeued : 0;
+	stats->max_wait_ns = ln->wait_ns_max;
+	pthread_mutex_unlock(&(pool->qlock));
+}
+
+void tpool_stats(tpool_t tpool, tpool_stats_t *stats) {
+	_threadpool *pool = (_threadpool *) tpool;
+	stats->spin_hits = atomic_load(&pool->spin_hits);
+	stats->parks = atomic_load(&pool->parks);
+	stats->wakeups = atomic_load(&pool->wakeups);
+	stats->mean_gap_ns = atomic_load(&pool->mean_gap_ns);
+	stats->spin_budget_ns = spin_budget(pool);
+	pthread_mutex_lock(&(pool->qlock));
+	stats->threads = pool->num_threads;
+	stats->grown = pool->grown;
+	stats->retired = pool->retired;
+	pthread_mutex_unlock(&(pool->qlock));
 }
 
 /* Destroy the threadpool */
 void tpool_destroy(tpool_t destroyme) {
 	_threadpool *pool = (_threadpool *) destroyme;
-	void* nothing;
-	int i = 0;
 
-	free(pool->threads);
+	/* let the workers drain the queue, then wake and join all of them;
+	 * the worker list no longer changes once shutdown is set */
+	pthread_mutex_lock(&(pool->qlock));
+	pool->dont_accept = 1;
+	pool->shutdown = 1;
+	worker_t* w;
+	while ((w = pop_parked(pool, -1)) != NULL) {
+		futex_wake(&w->wake);
+	}
+	pthread_cond_signal(&(pool->monitor_cond));
+	pthread_mutex_unlock(&(pool->qlock));
+
+	if (pool->min_threads < pool->max_threads) {
+		pthread_join(pool->monitor, NULL);
+	}
+	while ((w = pool->workers) != NULL) {
+		pthread_join(w->thread, NULL);
+		pool->workers = w->next;
+		free(w);
+	}
 
 	pthread_mutex_destroy(&(pool->qlock));
-	pthread_cond_destroy(&(pool->q_empty));
-	pthread_cond_destroy(&(pool->q_not_empty));
-	return;
+	pthread_cond_destroy(&(pool->q_idle));
+	pthread_cond_destroy(&(pool->monitor_cond));
+	free(pool);
 }
@@ -3,22 +3,121 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#define MAX_THREADS 32
+#include <stdint.h>
 
 /* threadpool structure */
 /* hide internal structure from users */
 typedef void *tpool_t;
 
-/* Creates threadpool */
+/* Creates threadpool with a fixed number of threads */
 tpool_t tpool_create(int n_threads);
 
+/* Creates a pool that grows from min_threads up to max_threads while
+ * queued jobs wait (longer than 1ms, or with every shared worker stuck in
+ * a job for over 10ms) and shrinks back as workers stay parked for 5s */
+tpool_t tpool_create_elastic(int min_threads, int max_threads);
+
+/* Number of CPUs the process may use: the affinity mask, capped by the
+ * cgroup (v2 or v1) CPU quota */
+int tpool_default_threads(void);
+
+/* Priority lanes. Each lane is a FIFO; while several lanes have work,
+ * shared workers split dequeues between them by weight, and a job that
+ * has waited past the starvation limit goes first whatever its lane */
+typedef enum {
+	TPOOL_REALTIME,		/* health checks, short control tasks */
+	TPOOL_NORMAL,		/* tpool_dispatch */
+	TPOOL_BULK,		/* long running streams */
+	TPOOL_LANES
+} tpool_lane_t;
+
 /* Dispatch jobs immediately if thread limit not reached
  * blocks when all threads in pools are busy */
 typedef void (*dispatch_fn)(void *);
 void tpool_dispatch(tpool_t tp, dispatch_fn d_func,
 		void *arg);
 
-/* Destroys the threadpool */
+/* Same, on the given lane */
+void tpool_dispatch_lane(tpool_t tp, tpool_lane_t lane, dispatch_fn d_func,
+		void *arg);
+
+/* Sets a lane's weight (defaults 16, 4, 1) and the number of workers that
+ * serve only that lane. Reservations come out of the minimum pool size and
+ * at least one worker always stays shared. Returns
+ * -1 if the arguments do not fit the pool */
+int tpool_set_lane(tpool_t tp, tpool_lane_t lane, int weight, int reserved);
+
+/* Jobs older than this skip the weights (default 10ms) */
+void tpool_set_starve_limit(tpool_t tp, int64_t starve_ns);
+
+/* Completion handle: a latch that is done once the jobs counted into it
+ * have finished. Create it with the number of jobs, pass it to
+ * tpool_dispatch_batch (one or several times) and then wait on, poll or
+ * attach a callback to it. */
+typedef struct tpool_future tpool_future_t;
+
+tpool_future_t *tpool_future_create(int count);
+
+/* Non-zero once every counted job has finished; the worker that finished
+ * the last may still be releasing waiters (tpool_future_destroy waits) */
+int tpool_future_poll(tpool_future_t *f);
+
+/* Blocks until every counted job has finished */
+void tpool_future_wait(tpool_future_t *f);
+
+/* Runs callback(arg) once, on the worker finishing the last job, or right
+ * away in the caller if the future is already done */
+void tpool_future_on_done(tpool_future_t *f, void (*callback)(void *),
+		void *arg);
+
+/* Waits for the future and frees it */
+void tpool_future_destroy(tpool_future_t *f);
+
+typedef struct {
+	dispatch_fn routine;
+	void *arg;
+} tpool_task_t;
+
+/* Enqueues n tasks on lane with a single lock round trip, waking up to n
+ * parked workers. done, if not NULL, is counted down once per finished
+ * task. Returns 0 on success, -1 if the pool refused the batch */
+int tpool_dispatch_batch(tpool_t tp, tpool_lane_t lane,
+		const tpool_task_t *tasks, int n, tpool_future_t *done);
+
+/* Blocks until the queue is empty and no job is running */
+void tpool_wait_all(tpool_t tp);
+
+/* Idle strategy counters: workers spin briefly (sized from the recent
+ * arrival rate) before parking on a futex, and a dispatch wakes at most
+ * one parked worker */
+typedef struct {
+	uint64_t spin_hits;	/* work picked up while spinning */
+	uint64_t parks;		/* times a worker went to sleep */
+	uint64_t wakeups;	/* parked workers woken by a dispatch */
+	int64_t mean_gap_ns;	/* recent mean gap between dispatches */
+	int64_t spin_budget_ns;	/* current spin time before parking */
+	int threads;		/* live workers */
+	uint64_t grown;		/* workers started above the minimum */
+	uint64_t retired;	/* idle workers that exited */
+} tpool_stats_t;
+
+void tpool_stats(tpool_t tp, tpool_stats_t *stats);
+
+/* Per-lane queue depth and wait time (enqueue to dequeue) */
+typedef struct {
+	int depth;		/* jobs queued now */
+	int max_depth;		/* highest depth seen */
+	int weight;
+	int reserved;		/* workers serving only this lane */
+	uint64_t dequeued;	/* jobs handed to workers */
+	uint64_t aged;		/* of those, taken past the starvation limit */
+	int64_t mean_wait_ns;
+	int64_t max_wait_ns;
+} tpool_lane_stats_t;
+
+void tpool_lane_stats(tpool_t tp, tpool_lane_t lane, tpool_lane_stats_t *stats);
+
+/* Waits for queued jobs to finish, then stops and frees the threadpool */
 void tpool_destroy(tpool_t destroyme);
 
 #endif /* THREADPOOL_H */
@@ -0,0 +1,388 @@
+/* Datagram server: one SO_REUSEPORT socket per core,
+ * receiving and replying in batches with recvmmsg/sendmmsg
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "latency.h"
+#include "framing.h"
+
+#define MAX_BATCH 256
+#define DEFAULT_BATCH 32
+#define GRO_BUF_SIZE 65536	/* a GRO receive may coalesce up to 64KB */
+#define MAX_GRO_SEGS 64
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* server configuration shared by all workers */
+typedef struct {
+	char* port;
+	int batch;		/* max datagrams per recvmmsg/sendmmsg */
+	bool gso;		/* UDP_GRO on receive, UDP_SEGMENT on send */
+} udp_conf_t;
+
+/* per-worker batch buffers */
+typedef struct {
+	int id, cpu;
+	udp_conf_t* conf;
+	bool gro;		/* UDP_GRO accepted by this worker's socket */
+	size_t bufsize;
+	uint8_t* rxbuf;		/* batch * bufsize */
+	uint8_t* txbuf;		/* batch * bufsize */
+	struct mmsghdr* rxmsgs;
+	struct iovec* rxiov;
+	struct sockaddr_storage* addrs;
+	char* rxctl;
+	struct mmsghdr* txmsgs;	/* batch * MAX_GRO_SEGS with GRO on */
+	struct iovec* txiov;
+	char* txctl;
+} udp_worker_t;
+
+/* datagrams cut short by a receive buffer, over all workers */
+atomic_long truncated;
+
+#define CTL_SIZE CMSG_SPACE(sizeof(uint16_t) > sizeof(int) ? sizeof(uint16_t) : sizeof(int))
+
+size_t transform_binary_datagram(const uint8_t* in, size_t len, uint8_t* out) {
+/* A datagram starting with BINARY_HELLO carries varint-framed frames
+ * after it; the reply is the hello and the frames that are whole.
+ */
+	size_t n = 1;
+	out[0] = BINARY_HELLO;
+	while (n < len) {
+		uint32_t plen;
+		int hlen = varint_get(in + n, len - n, &plen);
+		if (hlen == 0 || plen > len - n - hlen) {
+			break;
+		}
+		binframe_t f = {0};
+		binframe_transform(&f, in + n, out + n, hlen + plen);
+		n += hlen + plen;
+	}
+	return n > 1 ? n : 0;
+}
+
+size_t transform_datagram(const uint8_t* in, size_t len, uint8_t* out) {
+/* Apply the '^payload$' protocol to one datagram: every complete frame
+ * comes back with its payload incremented. There is no state across
+ * datagrams, so an unterminated frame is dropped.
+ */
+	if (len > 0 && in[0] == BINARY_HELLO) {
+		return transform_binary_datagram(in, len, out);
+	}
+	size_t n = 0, frame_start = 0;
+	bool in_msg = false;
+	for (size_t i = 0; i < len; i++) {
+		if (!in_msg) {
+			if (in[i] == '^') {
+				in_msg = true;
+				frame_start = n;
+			}
+		} else if (in[i] == '$') {
+			in_msg = false;
+		} else {
+			out[n++] = in[i] + 1;
+		}
+	}
+	if (in_msg) {
+		n = frame_start;
+	}
+	return n;
+}
+
+uint16_t gro_segment_size(struct msghdr* msg) {
+/* size of the coalesced segments in a GRO receive, 0 if not coalesced */
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			int seg;
+			memcpy(&seg, CMSG_DATA(cmsg), sizeof seg);
+			return seg;
+		}
+	}
+	return 0;
+}
+
+void add_tx(udp_worker_t* w, int* ntx, struct sockaddr_storage* addr,
+		socklen_t addrlen, uint8_t* buf, size_t len, uint16_t segsize) {
+/* queue one reply for sendmmsg; segsize > 0 lets the kernel split it (GSO) */
+	struct mmsghdr* m = &w->txmsgs[*ntx];
+	struct iovec* iov = &w->txiov[*ntx];
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	memset(m, 0, sizeof *m);
+	m->msg_hdr.msg_name = addr;
+	m->msg_hdr.msg_namelen = addrlen;
+	m->msg_hdr.msg_iov = iov;
+	m->msg_hdr.msg_iovlen = 1;
+	if (segsize > 0) {
+		char* ctl = &w->txctl[*ntx * CTL_SIZE];
+		memset(ctl, 0, CTL_SIZE);
+		m->msg_hdr.msg_control = ctl;
+		m->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&m->msg_hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &segsize, sizeof segsize);
+	}
+	(*ntx)++;
+}
+
+void flush_tx(int sockfd, udp_worker_t* w, int ntx) {
+/* push the replies of a batch out, in as few sendmmsg calls as possible */
+	int sent = 0;
+	while (sent < ntx) {
+		int n = sendmmsg(sockfd, &w->txmsgs[sent], ntx - sent, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* drop the rest of the batch rather than stall the worker */
+			perror("sendmmsg");
+			return;
+		}
+		sent += n;
+	}
+}
+
+int open_worker_socket(udp_worker_t* w) {
+	int sockfd = bind_udp(w->conf->port);
+	w->gro = false;
+	if (w->conf->gso) {
+		int on = 1;
+		if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof on) < 0) {
+			perror("setsockopt UDP_GRO");
+		} else {
+			w->gro = true;
+		}
+	}
+	return sockfd;
+}
+
+void* udp_worker(void* arg) {
+	udp_worker_t* w = (udp_worker_t*)arg;
+	udp_conf_t* conf = w->conf;
+	int batch = conf->batch;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	}
+
+	int sockfd = open_worker_socket(w);
+	printf("worker %d on cpu %d serving udp socket %d\n", w->id, w->cpu, sockfd);
+
+	while (1) {
+		/* reset the receive slots: recvmmsg overwrites the lengths */
+		for (int i = 0; i < batch; i++) {
+			w->rxiov[i].iov_base = &w->rxbuf[i * w->bufsize];
+			w->rxiov[i].iov_len = w->bufsize;
+			memset(&w->rxmsgs[i], 0, sizeof w->rxmsgs[i]);
+			w->rxmsgs[i].msg_hdr.msg_name = &w->addrs[i];
+			w->rxmsgs[i].msg_hdr.msg_namelen = sizeof w->addrs[i];
+			w->rxmsgs[i].msg_hdr.msg_iov = &w->rxiov[i];
+			w->rxmsgs[i].msg_hdr.msg_iovlen = 1;
+			if (w->gro) {
+				w->rxmsgs[i].msg_hdr.msg_control = &w->rxctl[i * CTL_SIZE];
+				w->rxmsgs[i].msg_hdr.msg_controllen = CTL_SIZE;
+			}
+		}
+
+		/* block for the first datagram, then take whatever else is queued */
+		int nrecv = recvmmsg(sockfd, w->rxmsgs, batch, MSG_WAITFORONE, NULL);
+		if (nrecv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror_die("recvmmsg");
+		}
+
+		/* a datagram arrives whole: its recv stage is empty, and one
+		 * sampled batch stands for the frames in it */
+		lat_frame_t lat = {0};
+		(void)lat;	/* only read when tracing */
+		LAT_FRAME_START(&lat);
+		LAT_FRAME_END(&lat);
+
+		int ntx = 0;
+		for (int i = 0; i < nrecv; i++) {
+			struct msghdr* hdr = &w->rxmsgs[i].msg_hdr;
+			uint8_t* in = &w->rxbuf[i * w->bufsize];
+			uint8_t* out = &w->txbuf[i * w->bufsize];
+			size_t len = w->rxmsgs[i].msg_len;
+			uint16_t seg = w->gro ? gro_segment_size(hdr) : 0;
+
+			if (hdr->msg_flags & MSG_TRUNC) {
+				/* its frames are cut off: count it rather than answer */
+				long t = atomic_fetch_add_explicit(&truncated, 1, memory_order_relaxed) + 1;
+				if ((t & (t - 1)) == 0) {
+					printf("%ld datagrams truncated to %zu bytes so far\n", t, w->bufsize);
+				}
+				continue;
+			}
+			if (seg == 0 || seg >= len) {
+				size_t n = transform_datagram(in, len, out);
+				if (n > 0) {
+					add_tx(w, &ntx, &w->addrs[i], hdr->msg_namelen, out, n, 0);
+				}
+				continue;
+			}
+
+			/* GRO coalesced several datagrams from one sender: answer each
+			 * segment, and let GSO split the replies if they are all equal
+			 */
+			size_t n = 0, first_len = 0;
+			bool uniform = true;
+			int nseg = 0;
+			size_t seg_off[MAX_GRO_SEGS], seg_len[MAX_GRO_SEGS];
+			for (size_t off = 0; off < len && nseg < MAX_GRO_SEGS; off += seg) {
+				size_t inlen = len - off < seg ? len - off : seg;
+				size_t r = transform_datagram(in + off, inlen, out + n);
+				if (r == 0) {
+					continue;
+				}
+				if (nseg == 0) {
+					first_len = r;
+				} else if (seg_len[nseg-1] != first_len || r > first_len) {
+					/* only the last GSO segment may be short */
+					uniform = false;
+				}
+				seg_off[nseg] = n;
+				seg_len[nseg] = r;
+				nseg++;
+				n += r;
+			}
+			if (nseg == 0) {
+				continue;
+			}
+			if (uniform && nseg > 1) {
+				add_tx(w, &ntx, &w->addrs[i], hdr->msg_namelen, out, n, first_len);
+			} else {
+				for (int k = 0; k < nseg; k++) {
+					add_tx(w, &ntx, &w->addrs[i], hdr->msg_namelen,
+						out + seg_off[k], seg_len[k], 0);
+				}
+			}
+		}
+
+		LAT_FRAME_QUEUED(&lat);
+		if (ntx > 0) {
+			flush_tx(sockfd, w, ntx);
+		}
+		LAT_FRAME_SENT(&lat);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	setvbuf(stdout, NULL, _IONBF, 0);
+	lat_init();
+
+	udp_conf_t conf = { .port = "9090", .batch = DEFAULT_BATCH, .gso = false };
+	int n_workers = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:t:g")) != -1) {
+		switch (opt) {
+			case 'b':
+				conf.batch = atoi(optarg);
+				break;
+			case 't':
+				n_workers = atoi(optarg);
+				break;
+			case 'g':
+				conf.gso = true;
+				break;
+			default:
+				fprintf(stderr, "usage: udp-server "
+						"[-b batch_size] "
+						"[-t num_of_workers] "
+						"[-g] "
+						"[port_num]\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind < argc) {
+		conf.port = argv[optind];
+	}
+	if (conf.batch < 1 || conf.batch > MAX_BATCH) {
+		die("batch size must be within 1..%d", MAX_BATCH);
+	}
+
+	/* one worker per core we may run on */
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (sched_getaffinity(0, sizeof cpus, &cpus) < 0) {
+		perror_die("sched_getaffinity");
+	}
+	if (n_workers <= 0) {
+		n_workers = CPU_COUNT(&cpus);
+	}
+	printf("Serving udp on port %s with %d workers, batch %d%s\n", conf.port,
+		n_workers, conf.batch, conf.gso ? ", GSO/GRO" : "");
+
+	pthread_t threads[n_workers];
+	udp_worker_t* workers = xmalloc(n_workers * sizeof(udp_worker_t));
+	int cpu = -1;
+	for (int i = 0; i < n_workers; i++) {
+		udp_worker_t* w = &workers[i];
+		w->id = i;
+		w->conf = &conf;
+
+		/* next cpu in the affinity mask, wrapping around */
+		w->cpu = -1;
+		for (int k = 0; k < CPU_SETSIZE; k++) {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+			if (CPU_ISSET(cpu, &cpus)) {
+				w->cpu = cpu;
+				break;
+			}
+		}
+
+		int max_tx = conf.gso ? conf.batch * MAX_GRO_SEGS : conf.batch;
+		w->bufsize = conf.gso ? GRO_BUF_SIZE : UDP_DGRAM_MAX;
+		w->rxbuf = xmalloc(conf.batch * w->bufsize);
+		w->txbuf = xmalloc(conf.batch * w->bufsize);
+		w->rxmsgs = xmalloc(conf.batch * sizeof(struct mmsghdr));
+		w->rxiov = xmalloc(conf.batch * sizeof(struct iovec));
+		w->addrs = xmalloc(conf.batch * sizeof(struct sockaddr_storage));
+		w->rxctl = xmalloc(conf.batch * CTL_SIZE);
+		w->txmsgs = xmalloc(max_tx * sizeof(struct mmsghdr));
+		w->txiov = xmalloc(max_tx * sizeof(struct iovec));
+		w->txctl = xmalloc(max_tx * CTL_SIZE);
+
+		if (pthread_create(&threads[i], NULL, udp_worker, w)) {
+			die("udp worker thread creation error");
+		}
+	}
+
+	for (int i = 0; i < n_workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+/* Listener hand-over between an old and a new server process */
+/* Unix socket rendezvous, listeners passed with SCM_RIGHTS */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "sockutils.h"
+#include "upgrade.h"
+
+static void upgrade_addr(struct sockaddr_un* addr, char* path) {
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr->sun_path) {
+		die("upgrade socket path too long: %s", path);
+	}
+	strcpy(addr->sun_path, path);
+}
+
+int upgrade_listen(char* path) {
+	struct sockaddr_un addr;
+	upgrade_addr(&addr, path);
+	/* the predecessor's socket, if any, stays bound to the old inode */
+	unlink(path);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		perror_die("upgrade: socket");
+	}
+	if (bind(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+		perror_die("upgrade: bind");
+	}
+	if (listen(sockfd, 1) < 0) {
+		perror_die("upgrade: listen");
+	}
+	return sockfd;
+}
+
+int upgrade_take_over(char* path, int fds[UPGRADE_MAX_FDS], int* connfd) {
+	struct sockaddr_un addr;
+	upgrade_addr(&addr, path);
+
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd < 0) {
+		perror_die("upgrade: socket");
+	}
+	if (connect(sockfd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			/* nobody to take over from */
+			close(sockfd);
+			return 0;
+		}
+		perror_die("upgrade: connect");
+	}
+
+	char cbuf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	char tag;
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof cbuf,
+	};
+	if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		perror_die("upgrade: recvmsg");
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)) {
+		die("upgrade: the running server did not pass its listeners");
+	}
+	int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	*connfd = sockfd;
+	return nfds;
+}
+
+int upgrade_hand_over(int connfd, const int* fds, int nfds) {
+	char cbuf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	memset(cbuf, 0, sizeof cbuf);
+	char tag = 'L';
+	struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	return sendmsg(connfd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+void upgrade_confirm(int connfd) {
+	char ok = '+';
+	if (send(connfd, &ok, 1, MSG_NOSIGNAL) != 1) {
+		perror("upgrade: confirm");
+	}
+	close(connfd);
+}
@@ -0,0 +1,36 @@
+/* header file for handing listeners over to a new server process */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/* most listening sockets passed in one hand-over */
+#define UPGRADE_MAX_FDS 2
+
+/* Hot upgrade: a running server listens on a Unix socket. A new build
+ * started with the same path connects, receives the listening sockets
+ * (SCM_RIGHTS), starts accepting on them and confirms; only then does the
+ * old process stop accepting and drain. The listening sockets are never
+ * closed in between, so no SYN finds the port without a listener.
+ */
+
+/* Creates the listening Unix socket at path, replacing any stale socket
+ * file. Dies in case of errors.
+ */
+int upgrade_listen(char* path);
+
+/* New process: asks the server listening at path for its listeners.
+ * Returns how many were stored in fds, with *connfd kept open for
+ * upgrade_confirm, or 0 if no server listens there. Dies on a broken
+ * hand-over.
+ */
+int upgrade_take_over(char* path, int fds[UPGRADE_MAX_FDS], int* connfd);
+
+/* Old process: sends nfds listeners to the successor on connfd.
+ * Returns 0 when successful, -1 (with errno set) on errors.
+ */
+int upgrade_hand_over(int connfd, const int* fds, int nfds);
+
+/* New process: tells the old one it is accepting now, and closes connfd */
+void upgrade_confirm(int connfd);
+
+#endif /* UPGRADE_H */